@@ -1,18 +1,32 @@
+#define _GNU_SOURCE
+
 #include <linux/cn_proc.h>
 #include <linux/connector.h>
+#include <linux/genetlink.h>
 #include <linux/netlink.h>
+#include <linux/taskstats.h>
 
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <netdb.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <glob.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,9 +39,50 @@
 
 #include <sqlite3.h>
 
+#ifndef SPYCY_STB_PATH_HASH
+#include "spycy_hash.h"
+#define STBDS_HASH_STRING(str, seed) spycy_hash_string(str, seed)
+#endif
+
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 
+#include "spycy_ring.h"
+
+// statically defined tracepoints for perf and bpftrace, `bpftrace -l 'usdt:./spycy:*'` lists them. each
+// one is a single nop until something attaches, and nothing at all without systemtap's sys/sdt.h
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+// with semaphores the tracer counts itself in spycy_<probe>_semaphore when it attaches, so spycy knows
+// when it is worth reading the clock for a probe
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define SPYCY_PROBES
+#endif
+#endif
+
+#ifdef SPYCY_PROBES
+#define PROBE_SEMAPHORE(name) volatile unsigned short spycy_##name##_semaphore __attribute__((section(".probes")))
+PROBE_SEMAPHORE(receive);
+PROBE_SEMAPHORE(proc);
+PROBE_SEMAPHORE(exec);
+PROBE_SEMAPHORE(exec_handled);
+PROBE_SEMAPHORE(exit_handled);
+PROBE_SEMAPHORE(exit);
+PROBE_SEMAPHORE(flush_begin);
+PROBE_SEMAPHORE(flush_end);
+
+#define PROBE_ENABLED(name) (spycy_##name##_semaphore != 0)
+#define PROBE2(name, a, b) DTRACE_PROBE2(spycy, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(spycy, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(spycy, name, a, b, c, d)
+#else
+#define PROBE_ENABLED(name) false
+#define PROBE2(name, a, b) ((void) 0)
+#define PROBE3(name, a, b, c) ((void) 0)
+#define PROBE4(name, a, b, c, d) ((void) 0)
+#endif
+
 volatile sig_atomic_t quit = 0;
 
 #define FAIL(reason)                            \
@@ -44,10 +99,38 @@ volatile sig_atomic_t quit = 0;
     destruct();                                 \
   } while (0)
 
+typedef struct {
+  uint64_t nanoseconds_spent;
+  // finished runs; processes still running when spycy stops add their time but not a run
+  uint64_t executions;
+  // own time plus that of every descendant that finished before the process did
+  uint64_t inclusive_ns;
+  uint64_t cpu_user_ns;
+  uint64_t cpu_system_ns;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+  uint64_t max_rss_kb;
+  uint32_t flags;
+} usage_t;
+
+typedef enum {
+  // part of the usage comes from a sampled process and was scaled up, see --sample-above
+  USAGE_SAMPLED = 1,
+  // part of the usage comes from a process whose exit was missed, it only counts up to when it was last seen
+  USAGE_ESTIMATED = 2,
+} usage_flags_t;
+
 typedef struct {
   uint64_t start_time_ns;
-  char executable_path[PATH_MAX];
+  // the last time the process was known to be running, for when its exit never arrives
+  uint64_t last_seen_ns;
+  uint32_t executable_id;
   uid_t uid;
+  uint32_t cgroup_id;
+  // how many processes this one stands for, more than 1 while sampling
+  uint32_t weight;
+  // filled in from taskstats, which usually arrive right before the exit event
+  usage_t usage;
 } process_info_t;
 
 typedef struct {
@@ -57,16 +140,224 @@ typedef struct {
 
 item_t* tgids = NULL;
 
+// --max-processes: how many running processes are tracked at most, 0 for no limit. a missed exit
+// event leaves its process behind forever, so once the table is full the least recently seen
+// entries are checked and the dead ones let go of
+size_t max_processes = 0;
+#define EVICTION_BATCH 32
+// a full table of live processes is only checked again on the next tick
+bool eviction_exhausted = false;
+
+// --sweep-batch: how many tracked processes are checked on every tick regardless of the cap, the
+// cursor walks the table so all of them get checked every len / sweep_batch seconds
+size_t sweep_batch = 64;
+size_t sweep_cursor = 0;
+
+typedef struct {
+  char* key;
+  uint32_t value;
+} executable_item_t;
+
+// every executable path is stored once, processes and aggregates refer to it by index
+executable_item_t* executable_ids = NULL;
+char** executable_paths = NULL;
+// running processes per executable and where its usage goes, itself unless --top-k evicted it
+uint32_t* executable_refs = NULL;
+uint32_t* executable_folded_into = NULL;
+
+// --top-k: only the K executables with the most usage get rows of their own, found with Space-Saving
+// (a min-heap of K weighted counters where a newcomer takes over the smallest one). everything else
+// is folded into the directory it lives in, `tail_depth` levels deep, so memory stays bounded by K
+// and the number of those directories however many unique paths show up
+size_t top_k = 0;
+int tail_depth = 1;
+
+typedef struct {
+  uint32_t executable_id;
+  uint64_t weight;
+  // how much of `weight` may have been inherited from the executables evicted before
+  uint64_t error;
+} sketch_slot_t;
+
+sketch_slot_t* sketch = NULL;
+int32_t* executable_slots = NULL;
+// evicted executables stay around until their aggregates are written and their processes are gone
+uint32_t* evicted_executables = NULL;
+uint32_t* free_executable_ids = NULL;
+
+typedef struct {
+  char* key;
+  uint32_t value;
+} cgroup_item_t;
+
+// cgroups are interned the same way; a database numbers them on its own, `cgroup_db_ids` maps ours
+// to the ones of the database that is currently open (0 until looked up)
+cgroup_item_t* cgroup_ids = NULL;
+char** cgroup_paths = NULL;
+int64_t* cgroup_db_ids = NULL;
+
+typedef struct {
+  uint32_t executable_id;
+  uid_t uid;
+  uint32_t cgroup_id;
+} aggregate_key_t;
+
+// durations are counted in log-linear buckets: 4 per power of two from 2^10ns (~1us) to 2^47ns (~39h),
+// which keeps every percentile within 25% of the truth. bucket 0 is everything shorter
+#define DURATION_MIN_EXPONENT 10
+#define DURATION_MAX_EXPONENT 47
+#define DURATION_SUB_BUCKETS 4
+#define DURATION_BUCKETS ((DURATION_MAX_EXPONENT - DURATION_MIN_EXPONENT + 1) * DURATION_SUB_BUCKETS + 1)
+
+typedef struct {
+  usage_t total;
+  usage_t pending;
+  uint32_t pending_durations[DURATION_BUCKETS];
+  bool dirty;
+} aggregate_t;
+
+typedef struct {
+  aggregate_key_t key;
+  aggregate_t value;
+} aggregate_item_t;
+
+// totals since startup; `pending` is what has not been written to the database yet
+aggregate_item_t* aggregates = NULL;
+ptrdiff_t* dirty_aggregates = NULL;
+
+typedef struct {
+  uid_t key;
+  char* value;
+} username_item_t;
+
+username_item_t* usernames = NULL;
+
+// usage rows are kept per hour so reports can filter by time
+#define BUCKET_SECONDS (60 * 60)
+
+typedef enum {
+  SHARD_NONE,
+  SHARD_DAY,
+  SHARD_WEEK,
+} shard_mode_t;
+
 sqlite3* db = NULL;
+// stamped on every row a flush writes, `spycy changes` hands out rows newer than a cursor into it
+int64_t change_seq = 0;
 int connection = -1;
+int connection_taskstats = -1;
+// the last message sequence number per cpu, a jump means the connector lost messages
+#define EVENT_SEQS_COUNT 4096
+uint32_t event_seqs[EVENT_SEQS_COUNT] = {};
+
+char* base_db_path = NULL;
+shard_mode_t shard_mode = SHARD_NONE;
+int shard_retention = 0;
+char shard_path[PATH_MAX] = {};
+time_t shard_expires_at = 0;
+
+int flush_interval = 1;
+
+#define RING_PATHS_CAPACITY (8 * 1024 * 1024)
+
+char* ring_path = NULL;
+uint64_t ring_capacity = 64 * 1024;
+spycy_ring_t ring = {};
+
+typedef enum {
+  EVENT_EXEC,
+  EVENT_EXIT,
+  EVENT_FORK,
+  EVENT_OTHER,
+  EVENT_KINDS_COUNT,
+} event_kind_t;
+
+char* event_kind_names[EVENT_KINDS_COUNT] = {
+  [EVENT_EXEC] = "exec",
+  [EVENT_EXIT] = "exit",
+  [EVENT_FORK] = "fork",
+  [EVENT_OTHER] = "other",
+};
+
+typedef struct {
+  uint64_t events[EVENT_KINDS_COUNT];
+  uint64_t sequence_gaps;
+  uint64_t receive_overruns;
+  uint64_t taskstats_overruns;
+  uint64_t proc_lookup_failures;
+  uint64_t excluded_execs;
+  uint64_t sketch_evictions;
+  uint64_t sampled_out_execs;
+  uint64_t evicted_processes;
+  uint64_t swept_processes;
+  uint64_t process_table_full_execs;
+  size_t process_table_peak;
+  uint64_t flushes;
+  uint64_t flush_ns;
+  uint64_t flushed_aggregates;
+} collector_stats_t;
+
+collector_stats_t collector_stats = {};
+
+typedef enum {
+  LATENCY_EXEC,
+  LATENCY_EXIT,
+  LATENCY_PROC,
+  LATENCY_FLUSH,
+  LATENCY_LAG,
+  LATENCY_KINDS_COUNT,
+} latency_kind_t;
+
+// exec and exit are the time spent handling one event, proc is the /proc lookups an exec needs and lag
+// is how long after the kernel stamped an exec or exit we got to it
+char* latency_kind_names[LATENCY_KINDS_COUNT] = {
+  [LATENCY_EXEC] = "exec",
+  [LATENCY_EXIT] = "exit",
+  [LATENCY_PROC] = "proc",
+  [LATENCY_FLUSH] = "flush",
+  [LATENCY_LAG] = "lag",
+};
+
+// spycy has a single thread, so recording is a couple of increments in the same buckets durations use
+typedef struct {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[DURATION_BUCKETS];
+} latency_t;
+
+latency_t latencies[LATENCY_KINDS_COUNT] = {};
+
+volatile sig_atomic_t dump_requested = 0;
 
 int code = 0;
 
 bool should_close = false;
 
+// the running processes went to the instance that replaced us, see --handoff
+bool handed_off = false;
+// the connection to that instance. it waits for it to close, which we do before anything slow
+int handoff_client = -1;
+
+char* snapshot_path = NULL;
+char* export_address = NULL;
+
 uint64_t last_timestamp_ns = 0;
 
 void destruct();
+bool process_is_alive(pid_t tgid, process_info_t* info);
+void rotate_shard();
+void flush_usage();
+void stop_stats_server();
+void stop_metrics_server();
+void stop_handoff_server();
+void save_snapshot(char* path);
+void export_usage(usage_t* usage, aggregate_key_t* key);
+void export_tick();
+void drain_export();
+size_t directory_prefix_len(const char* path, int depth);
+uint64_t forest_inclusive_ns(pid_t tgid, uint64_t own_ns, uint32_t weight);
+bool make_room_for_process();
 
 int get_executable_path(pid_t pid, char executable_path[PATH_MAX]) {
   static char symlink_path[PATH_MAX];
@@ -79,386 +370,6494 @@ int get_executable_path(pid_t pid, char executable_path[PATH_MAX]) {
   return executable_path_len;
 }
 
-uid_t uid_by_pid(pid_t pid) {
-  struct stat info = {};
+uint64_t monotonic_now_ns() {
+  // the same clock the kernel stamps proc events with
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-  static char proc_path[128] = {};
-  snprintf(proc_path, 128, "/proc/%d", pid);
+void start_ring(char* path) {
+  size_t size = spycy_ring_size(ring_capacity, RING_PATHS_CAPACITY);
 
-  if (stat(proc_path, &info) == -1) {
-    FAIL("stat");
+  // built next to it and renamed over it. readers, or the instance that handed off to us, may still
+  // have the old file mapped, truncating it would pull the pages out from under them
+  static char temporary_path[PATH_MAX] = {};
+  snprintf(temporary_path, PATH_MAX, "%.*s.tmp", PATH_MAX - 8, path);
+
+  int fd = open(temporary_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    FAIL("open");
   }
 
-  return info.st_uid;
-}
+  if (ftruncate(fd, size) == -1) {
+    FAIL("ftruncate");
+  }
 
-void handle_exec_event(struct proc_event *event) {
-  (void) event;
-  assert(event->what == PROC_EVENT_EXEC);
+  void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    FAIL("mmap");
+  }
 
-  pid_t tgid = event->event_data.exec.process_tgid;
+  spycy_ring_header_t* header = memory;
+  header->version = SPYCY_RING_VERSION;
+  header->record_size = sizeof(spycy_ring_record_t);
+  header->capacity = ring_capacity;
+  header->paths_capacity = RING_PATHS_CAPACITY;
+  spycy_ring_map(&ring, memory, size);
 
-  if (hmgeti(tgids, tgid) >= 0) {
-    return;
+  // readers refuse the file until the magic shows up, so it goes in last
+  atomic_store_explicit(&header->magic, SPYCY_RING_MAGIC, memory_order_release);
+
+  if (rename(temporary_path, path) == -1) {
+    FAIL("rename");
   }
 
-  static process_info_t new_process_info = {};
-  new_process_info.start_time_ns = event->timestamp_ns;
-  if (get_executable_path(tgid, new_process_info.executable_path) == -1) {
-    fprintf(stderr, "WARNING: failed to readlink on /proc/%d/exe: %s\n", tgid, strerror(errno));
+  printf("LOG: publishing events into %s\n", path);
+}
+
+// position plus one of every executable id's path in the ring, 0 until it is (again) written there
+uint64_t* ring_path_positions = NULL;
+
+// an id handed out again with --top-k gets its new path written the next time a record needs it
+void ring_publish_executable(uint32_t executable_id) {
+  if (ring.header == NULL) {
     return;
   }
-  new_process_info.uid = uid_by_pid(tgid);
 
-  hmput(tgids, tgid, new_process_info);
+  if (executable_id < arrlenu(ring_path_positions)) {
+    ring_path_positions[executable_id] = 0;
+  }
 }
 
-bool exists_in_db(char* executable_path, char* username) {
-  assert(db != NULL);
+// the position a record of `executable_id` refers to, writing the path (again) if it is not in the ring
+// or newer paths have overwritten it. 0 for paths that do not fit at all
+uint64_t ring_path_position(uint32_t executable_id) {
+  while (arrlenu(ring_path_positions) <= executable_id) {
+    arrput(ring_path_positions, 0);
+  }
 
-  sqlite3_stmt* select_statement = NULL;
-  int rc = sqlite3_prepare(db,
-                           "select exists "
-                           "(select 1 from spycy_data "
-                           " where executable_path = ? and "
-                           "       username = ?)",
-                           -1, &select_statement, NULL);
-  if (rc != SQLITE_OK) {
-    SQLITE3_FAIL("ERROR: failed to prepare select statement: %s\n", sqlite3_errmsg(db));
+  uint64_t capacity = ring.header->paths_capacity;
+  uint64_t reserved = atomic_load_explicit(&ring.header->paths_reserved, memory_order_relaxed);
+  uint64_t position = ring_path_positions[executable_id];
+  if (position != 0 && reserved - (position - 1) <= capacity) {
+    return position;
   }
 
-  if (((rc = sqlite3_bind_text(select_statement, 1, executable_path, -1, SQLITE_STATIC)) != SQLITE_OK) ||
-      ((rc = sqlite3_bind_text(select_statement, 2, username, -1, SQLITE_STATIC)) != SQLITE_OK)) {
-    SQLITE3_FAIL("ERROR: failed to bind select statement: %s\n", sqlite3_errstr(rc));
+  char* executable_path = executable_paths[executable_id];
+  size_t path_len = executable_path != NULL ? strlen(executable_path) + 1 : 0;
+  if (path_len == 0 || path_len > capacity) {
+    return 0;
   }
 
-  int step = sqlite3_step(select_statement);
-  bool result = false;
-  if (step == SQLITE_ROW) {
-    result = sqlite3_column_int(select_statement, 0);
+  // a path never wraps, one that does not fit before the end starts over at the beginning
+  uint64_t start = reserved;
+  if (start % capacity + path_len > capacity) {
+    start += capacity - start % capacity;
   }
 
-  sqlite3_finalize(select_statement);
-  return result;
-}
+  // readers check paths_reserved after copying, it has to move before the bytes do
+  atomic_store_explicit(&ring.header->paths_reserved, start + path_len, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(ring.paths + start % capacity, executable_path, path_len);
 
-void update_executable(uint64_t execution_time_ns, char* executable_path, char* username) {
-  assert(db != NULL);
+  ring_path_positions[executable_id] = start + 1;
+  return start + 1;
+}
 
-  sqlite3_stmt* update_statement = NULL;
-  int rc = sqlite3_prepare_v2(db,
-                              "update spycy_data "
-                              "set nanoseconds_spent = nanoseconds_spent + ? "
-                              "where executable_path = ? and username = ?;",
-                              -1, &update_statement, NULL);
-  if (rc != SQLITE_OK) {
-    SQLITE3_FAIL("ERROR: failed to prepare update statement: %s\n", sqlite3_errmsg(db));
+void ring_publish(spycy_ring_kind_t kind, pid_t tgid, process_info_t* info, uint64_t end_time_ns) {
+  if (ring.header == NULL) {
+    return;
   }
 
-  if (((rc = sqlite3_bind_int64(update_statement, 1, execution_time_ns)) != SQLITE_OK) ||
-      ((rc = sqlite3_bind_text(update_statement, 2, executable_path, -1, SQLITE_STATIC)) != SQLITE_OK) ||
-      ((rc = sqlite3_bind_text(update_statement, 3, username, -1, SQLITE_STATIC)) != SQLITE_OK)) {
-    SQLITE3_FAIL("ERROR: failed to bind update statement: %s\n", sqlite3_errstr(rc));
-  }
+  uint64_t path_position = ring_path_position(info->executable_id);
 
-  while (sqlite3_step(update_statement) != SQLITE_DONE) ;
-  sqlite3_finalize(update_statement);
-}
+  uint64_t number = atomic_load_explicit(&ring.header->head, memory_order_relaxed);
+  spycy_ring_record_t* slot = &ring.records[number & (ring.header->capacity - 1)];
 
-void insert_executable(uint64_t execution_time_ns, char* executable_path, char* username) {
-  assert(db != NULL);
+  atomic_store_explicit(&slot->sequence, 2 * number + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
 
-  sqlite3_stmt* insert_statement = NULL;
+  slot->kind = kind;
+  slot->tgid = tgid;
+  slot->uid = info->uid;
+  slot->executable_id = info->executable_id;
+  slot->start_time_ns = info->start_time_ns;
+  slot->end_time_ns = end_time_ns;
+  slot->duration_ns = end_time_ns > info->start_time_ns ? end_time_ns - info->start_time_ns : 0;
+  slot->weight = info->weight;
+  slot->flags = info->weight > 1 ? SPYCY_RING_SAMPLED : 0;
+  slot->path_position = path_position;
 
-  int rc = sqlite3_prepare_v2(db,
-                              "insert into spycy_data (executable_path, nanoseconds_spent, username) "
-                              "values (?, ?, ?)",
-                              -1, &insert_statement, NULL);
-  if (rc != SQLITE_OK) {
-    SQLITE3_FAIL("ERROR: failed to prepare insert statement: %s\n", sqlite3_errmsg(db));
+  atomic_store_explicit(&slot->sequence, 2 * number + 2, memory_order_release);
+  atomic_store_explicit(&ring.header->head, number + 1, memory_order_release);
+}
+
+uint32_t intern_executable(char* executable_path) {
+  if (executable_ids == NULL && top_k > 0) {
+    sh_new_strdup(executable_ids);
+  } else if (executable_ids == NULL) {
+    sh_new_arena(executable_ids);
   }
 
+  ptrdiff_t index = shgeti(executable_ids, executable_path);
+  if (index >= 0) {
+    return executable_ids[index].value;
+  }
 
-  if (((rc = sqlite3_bind_text(insert_statement, 1, executable_path, -1, SQLITE_STATIC)) != SQLITE_OK) ||
-      ((rc = sqlite3_bind_int64(insert_statement, 2, execution_time_ns)) != SQLITE_OK) ||
-      ((rc = sqlite3_bind_text(insert_statement, 3, username, -1, SQLITE_STATIC)) != SQLITE_OK)) {
-    SQLITE3_FAIL("ERROR: failed to bind insert statement: %s\n", sqlite3_errstr(rc));
+  uint32_t executable_id = arrlenu(executable_paths);
+  if (arrlenu(free_executable_ids) > 0) {
+    executable_id = arrpop(free_executable_ids);
+  } else {
+    arrput(executable_paths, NULL);
+    arrput(executable_refs, 0);
+    arrput(executable_folded_into, executable_id);
+    arrput(executable_slots, -1);
   }
 
-  while (sqlite3_step(insert_statement) != SQLITE_DONE) ;
-  sqlite3_finalize(insert_statement);
-}
+  shput(executable_ids, executable_path, executable_id);
 
-void save_to_db(uint64_t execution_time_ns, char* executable_path, uid_t uid) {
-  assert(db != NULL);
+  // evicted paths leave the map before their id is given back, so they need a copy of their own
+  char* key = executable_ids[shgeti(executable_ids, executable_path)].key;
+  executable_paths[executable_id] = top_k > 0 ? strdup(key) : key;
+  executable_folded_into[executable_id] = executable_id;
 
-  struct passwd* passwd = getpwuid(uid);
-  assert(passwd != NULL);
+  ring_publish_executable(executable_id);
 
-  if (exists_in_db(executable_path, passwd->pw_name)) {
-    update_executable(execution_time_ns, executable_path, passwd->pw_name);
-  } else {
-    insert_executable(execution_time_ns, executable_path, passwd->pw_name);
+  return executable_id;
+}
+
+uint32_t intern_cgroup(char* cgroup_path) {
+  if (cgroup_ids == NULL) {
+    sh_new_arena(cgroup_ids);
   }
 
-  if (should_close) {
-    destruct();
+  ptrdiff_t index = shgeti(cgroup_ids, cgroup_path);
+  if (index >= 0) {
+    return cgroup_ids[index].value;
   }
-}
 
-void destruct() {
-  if (sqlite3_is_interrupted(db)) {
-    should_close = true;
+  uint32_t cgroup_id = arrlenu(cgroup_paths);
+  shput(cgroup_ids, cgroup_path, cgroup_id);
+  arrput(cgroup_paths, cgroup_ids[shgeti(cgroup_ids, cgroup_path)].key);
 
-    if (connection != -1) {
-      close(connection);
-    }
+  return cgroup_id;
+}
 
-    return;
+char* username_by_uid(uid_t uid) {
+  username_item_t* item = hmgetp_null(usernames, uid);
+  if (item != NULL) {
+    return item->value;
   }
 
-  if (connection != -1) {
-    close(connection);
+  // uids without a passwd entry (containers, deleted users) are stored as numbers
+  char* username = NULL;
+  struct passwd* passwd = getpwuid(uid);
+  if (passwd != NULL) {
+    username = strdup(passwd->pw_name);
+  } else if (asprintf(&username, "%u", uid) == -1) {
+    username = NULL;
   }
 
-  for (size_t i = 0; i < hmlenu(tgids); i++) {
-    uint64_t execution_time_ns = last_timestamp_ns - tgids[i].value.start_time_ns;
-    save_to_db(execution_time_ns, tgids[i].value.executable_path, tgids[i].value.uid);
-  }
+  assert(username != NULL);
+  hmput(usernames, uid, username);
+  return username;
+}
 
-  hmfree(tgids);
+aggregate_key_t aggregate_key_of(process_info_t* info) {
+  return (aggregate_key_t) {
+    .executable_id = executable_folded_into[info->executable_id],
+    .uid = info->uid,
+    .cgroup_id = info->cgroup_id,
+  };
+}
 
-  if (sqlite3_close(db) != SQLITE_OK) {
-    should_close = true;
-    return;
+aggregate_item_t* aggregate_of(aggregate_key_t key) {
+  aggregate_item_t* item = hmgetp_null(aggregates, key);
+  if (item == NULL) {
+    hmput(aggregates, key, (aggregate_t) {});
+    item = hmgetp_null(aggregates, key);
   }
 
-  exit(code);
+  return item;
 }
 
-void handle_exit_event(struct proc_event *event) {
-  (void) event;
-  assert(event->what == PROC_EVENT_EXIT);
-
-  pid_t tgid = event->event_data.exec.process_tgid;
-  pid_t pid = event->event_data.exec.process_pid;
+int duration_bucket(uint64_t duration_ns) {
+  if (duration_ns < (1ULL << DURATION_MIN_EXPONENT)) {
+    return 0;
+  }
 
-  item_t* item = hmgetp_null(tgids, tgid);
-  if (item == NULL) {
-    return;
+  int exponent = 63 - __builtin_clzll(duration_ns);
+  if (exponent > DURATION_MAX_EXPONENT) {
+    return DURATION_BUCKETS - 1;
   }
 
-  if (pid == tgid) {
-    uint64_t execution_time_ns = event->timestamp_ns - item->value.start_time_ns;
-    save_to_db(execution_time_ns, item->value.executable_path, item->value.uid);
-    assert(hmdel(tgids, tgid) == 1);
+  int sub_bucket = (duration_ns >> (exponent - 2)) & (DURATION_SUB_BUCKETS - 1);
+  return (exponent - DURATION_MIN_EXPONENT) * DURATION_SUB_BUCKETS + sub_bucket + 1;
+}
+
+// the middle of a bucket, what a percentile that lands in it is reported as
+uint64_t duration_bucket_value(int bucket) {
+  if (bucket == 0) {
+    return (1ULL << DURATION_MIN_EXPONENT) / 2;
   }
+
+  int exponent = (bucket - 1) / DURATION_SUB_BUCKETS + DURATION_MIN_EXPONENT;
+  uint64_t width = 1ULL << (exponent - 2);
+  uint64_t lower = (1ULL << exponent) + ((bucket - 1) % DURATION_SUB_BUCKETS) * width;
+  return lower + width / 2;
 }
 
-void handle_message(struct cn_msg *message) {
-  (void) message;
-  struct proc_event *event = (struct proc_event *)message->data;
+// a clock read costs about as much as handling a fork, so only one in LATENCY_SAMPLE_EVERY execs and
+// exits is recorded. percentiles of the sample are as good, counts are of the recorded events only.
+// -DSPYCY_NO_LATENCY records none of them, spycy_bench_no_latency measures the overhead against that
+#define LATENCY_SAMPLE_EVERY 64
 
-  last_timestamp_ns = event->timestamp_ns;
+uint64_t latency_candidates = 0;
+// whether the event being handled is one of the recorded ones
+bool latency_recorded = false;
+// whether it is timed at all, which it also is for every exec and exit while a probe taking the times
+// is attached
+bool latency_timed = false;
 
-  if (event->what == PROC_EVENT_EXEC) {
-    handle_exec_event(event);
-  } else if (event->what == PROC_EVENT_EXIT) {
-    handle_exit_event(event);
+#ifdef SPYCY_NO_LATENCY
+#define latency_sample() false
+#else
+#define latency_sample() (latency_candidates++ % LATENCY_SAMPLE_EVERY == 0)
+#endif
+#define latency_now_ns() (latency_timed ? monotonic_now_ns() : 0)
+#define latency_probes_enabled() \
+  (PROBE_ENABLED(proc) || PROBE_ENABLED(exec) || PROBE_ENABLED(exec_handled) || PROBE_ENABLED(exit_handled))
+
+void record_latency(latency_kind_t kind, uint64_t latency_ns) {
+  latency_t* latency = &latencies[kind];
+  latency->count++;
+  latency->sum_ns += latency_ns;
+  latency->max_ns = latency->max_ns > latency_ns ? latency->max_ns : latency_ns;
+  latency->buckets[duration_bucket(latency_ns)]++;
+}
+
+uint64_t latency_percentile(latency_kind_t kind, double percentile) {
+  latency_t* latency = &latencies[kind];
+  uint64_t rank = latency->count * percentile / 100;
+  uint64_t seen = 0;
+
+  for (int bucket = 0; bucket < DURATION_BUCKETS; bucket++) {
+    seen += latency->buckets[bucket];
+    if (seen > rank) {
+      uint64_t value = duration_bucket_value(bucket);
+      return value < latency->max_ns ? value : latency->max_ns;
+    }
   }
+
+  return 0;
 }
 
-char* default_data_home() {
-  struct passwd *passwd = getpwuid(getuid());
-  if (passwd == NULL) {
-    FAIL("getpwuid");
+void add_usage(usage_t* to, usage_t* usage) {
+  to->nanoseconds_spent += usage->nanoseconds_spent;
+  to->executions += usage->executions;
+  to->inclusive_ns += usage->inclusive_ns;
+  to->cpu_user_ns += usage->cpu_user_ns;
+  to->cpu_system_ns += usage->cpu_system_ns;
+  to->read_bytes += usage->read_bytes;
+  to->write_bytes += usage->write_bytes;
+  to->max_rss_kb = to->max_rss_kb > usage->max_rss_kb ? to->max_rss_kb : usage->max_rss_kb;
+  to->flags |= usage->flags;
+}
+
+// makes a sampled process stand for all the ones that were skipped; peak memory is not a sum and stays.
+// inclusive time is scaled by the tree as it is summed up, its descendants have weights of their own
+void scale_usage(usage_t* usage, uint32_t weight) {
+  if (weight <= 1) {
+    return;
   }
 
-  static char data_home_path[PATH_MAX] = {};
-  snprintf(data_home_path, PATH_MAX, "%s/.local/share/", passwd->pw_dir);
-  return data_home_path;
+  usage->nanoseconds_spent *= weight;
+  usage->executions *= weight;
+  usage->cpu_user_ns *= weight;
+  usage->cpu_system_ns *= weight;
+  usage->read_bytes *= weight;
+  usage->write_bytes *= weight;
+  usage->flags |= USAGE_SAMPLED;
 }
 
-void recursive_mkdir(char* path) {
-  char* separator = strrchr(path, '/');
+void account_usage(aggregate_key_t key, usage_t* usage) {
+  key.executable_id = executable_folded_into[key.executable_id];
+  aggregate_item_t* item = aggregate_of(key);
+  add_usage(&item->value.total, usage);
+  add_usage(&item->value.pending, usage);
 
-  if (separator == path) {
-    separator = strrchr(path + 1, '/');
+  if (usage->executions > 0) {
+    item->value.pending_durations[duration_bucket(usage->nanoseconds_spent / usage->executions)] += usage->executions;
   }
 
-  if (separator != NULL) {
-    *separator = 0;
-    recursive_mkdir(path);
-    *separator = '/';
+  if (!item->value.dirty) {
+    item->value.dirty = true;
+    arrput(dirty_aggregates, item - aggregates);
   }
 
-  if (mkdir(path, 0777) && errno != EEXIST) {
-    FAIL("mkdir");
+  if (flush_interval == 0) {
+    flush_usage();
   }
 }
 
-char* default_db_path() {
-  char* xdg_data_home = getenv("XDG_DATA_HOME");
-  if (xdg_data_home == NULL) {
-    xdg_data_home = default_data_home();
-  }
+// taskstats of a thread can arrive after the exit event of its process, so the last exits are kept
+// around to know who to charge. direct mapped by tgid, a collision just loses that late record
+#define EXITED_PROCESSES_COUNT 1024
 
-  assert(xdg_data_home != NULL);
+typedef struct {
+  pid_t tgid;
+  aggregate_key_t key;
+  uint32_t weight;
+} exited_process_t;
 
-  static char db_path[PATH_MAX] = {};
-  snprintf(db_path, PATH_MAX, "%s/spycy/", xdg_data_home);
+exited_process_t exited_processes[EXITED_PROCESSES_COUNT] = {};
 
-  recursive_mkdir(db_path);
+void remember_exited(pid_t tgid, process_info_t* info) {
+  exited_processes[tgid % EXITED_PROCESSES_COUNT] = (exited_process_t) {
+    .tgid = tgid,
+    .key = aggregate_key_of(info),
+    .weight = info->weight,
+  };
+}
 
-  snprintf(db_path, PATH_MAX, "%s/spycy/spycy.db", xdg_data_home);
+void sketch_swap(size_t a, size_t b) {
+  sketch_slot_t slot = sketch[a];
+  sketch[a] = sketch[b];
+  sketch[b] = slot;
 
-  return db_path;
+  executable_slots[sketch[a].executable_id] = a;
+  executable_slots[sketch[b].executable_id] = b;
 }
 
-void signal_handler(int asdf) {
-  (void) asdf;
-  destruct();
+void sketch_sift_up(size_t slot) {
+  while (slot > 0 && sketch[(slot - 1) / 2].weight > sketch[slot].weight) {
+    sketch_swap(slot, (slot - 1) / 2);
+    slot = (slot - 1) / 2;
+  }
 }
 
-void prepare_db() {
-  assert(db != NULL);
+void sketch_sift_down(size_t slot) {
+  for (;;) {
+    size_t smallest = slot;
+    size_t left = 2 * slot + 1;
+    size_t right = 2 * slot + 2;
 
-  char* error_message = NULL;
-  sqlite3_exec(db,
-               "create table if not exists spycy_data ("
-               " executable_path text not null unique,"
-               " nanoseconds_spent integer not null,"
-               " username text not null,"
-               " primary key(executable_path)"
-               ");",
-               NULL, NULL, &error_message);
+    if (left < arrlenu(sketch) && sketch[left].weight < sketch[smallest].weight) {
+      smallest = left;
+    }
+    if (right < arrlenu(sketch) && sketch[right].weight < sketch[smallest].weight) {
+      smallest = right;
+    }
+    if (smallest == slot) {
+      return;
+    }
 
-  if (error_message != NULL) {
-    fprintf(stderr, "ERROR: failed to prepare database: %s\n", error_message);
-    sqlite3_free(error_message);
-    code = 1;
-    destruct();
+    sketch_swap(slot, smallest);
+    slot = smallest;
   }
 }
 
-int main(int argc, char** argv) {
-  char* db_path = NULL;
-
-  if (argc > 2) {
-    fprintf(stderr, "USAGE: %s <path to database file>\n", argv[0]);
-  } else if (argc == 2) {
-    db_path = argv[1];
-  } else {
-    db_path = default_db_path();
+void sketch_add(uint32_t executable_id, uint64_t weight) {
+  if (top_k == 0 || executable_slots[executable_id] < 0) {
+    return;
   }
 
-  if (sqlite3_open(db_path, &db)) {
-    SQLITE3_FAIL("ERROR: failed to open database at %s: %s\n", db_path, sqlite3_errmsg(db));
-  }
+  size_t slot = executable_slots[executable_id];
+  sketch[slot].weight += weight;
+  sketch_sift_down(slot);
+}
 
-  printf("LOG: using database %s\n.", db_path);
+uint32_t directory_of(uint32_t executable_id) {
+  static char directory[PATH_MAX] = {};
+  char* executable_path = executable_paths[executable_id];
+  snprintf(directory, PATH_MAX, "%.*s", (int) directory_prefix_len(executable_path, tail_depth), executable_path);
 
-  prepare_db();
+  return intern_executable(directory);
+}
 
-  if ((connection = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR)) == -1) {
-    FAIL("socket");
-  }
+void evict_executable(uint32_t executable_id) {
+  char* executable_path = executable_paths[executable_id];
 
-  if (signal(SIGINT, signal_handler) == SIG_ERR || signal(SIGTERM, signal_handler) == SIG_ERR) {
-    FAIL("signal");
+  executable_folded_into[executable_id] = directory_of(executable_id);
+  executable_slots[executable_id] = -1;
+  shdel(executable_ids, executable_path);
+  arrput(evicted_executables, executable_id);
+
+  collector_stats.sketch_evictions++;
+}
+
+// the id a newly executed path is counted under, interning it as is unless --top-k is set
+uint32_t track_executable(char* executable_path) {
+  if (top_k == 0) {
+    return intern_executable(executable_path);
   }
 
-  struct sockaddr_nl my = {
-    .nl_family = AF_NETLINK,
-    .nl_groups = CN_IDX_PROC,
-    .nl_pid = getpid(),
-  };
+  ptrdiff_t index = executable_ids != NULL ? shgeti(executable_ids, executable_path) : -1;
+  if (index >= 0) {
+    return executable_ids[index].value;
+  }
 
-  if (bind(connection, (struct sockaddr *)&my, sizeof(my)) == -1) {
-    FAIL("bind");
+  if (arrlenu(sketch) < top_k) {
+    uint32_t executable_id = intern_executable(executable_path);
+    arrput(sketch, ((sketch_slot_t) {.executable_id = executable_id}));
+    executable_slots[executable_id] = arrlen(sketch) - 1;
+    sketch_sift_up(arrlenu(sketch) - 1);
+    return executable_id;
   }
 
-  static uint8_t buffer[1024] = {};
-  memset(buffer, 0, sizeof(buffer));
+  // the smallest counter is at the root and the newcomer keeps its weight, so nothing moves
+  evict_executable(sketch[0].executable_id);
+  uint32_t executable_id = intern_executable(executable_path);
+  sketch[0].executable_id = executable_id;
+  sketch[0].error = sketch[0].weight;
+  executable_slots[executable_id] = 0;
 
-  struct nlmsghdr *netlink_header = (struct nlmsghdr *) buffer;
-  struct cn_msg *message_header = (struct cn_msg *) NLMSG_DATA(netlink_header);
+  return executable_id;
+}
 
-  enum proc_cn_mcast_op *message_operation = (enum proc_cn_mcast_op *) &message_header->data[0];
-  *message_operation = PROC_CN_MCAST_LISTEN;
+// what an aggregate is written as. executables that got into the sketch by taking over someone
+// else's counter and have not used more than the smallest counter on their own yet may just be
+// passing through, their rows go to the directory until they prove themselves
+uint32_t flushed_executable_id(uint32_t executable_id) {
+  if (top_k == 0 || executable_slots[executable_id] < 0 || arrlenu(sketch) < top_k) {
+    return executable_id;
+  }
 
-  netlink_header->nlmsg_len = NLMSG_LENGTH(sizeof(*message_header) + sizeof(*message_operation));
-  netlink_header->nlmsg_type = NLMSG_DONE;
-  netlink_header->nlmsg_flags = 0;
-  netlink_header->nlmsg_seq = 0;
-  netlink_header->nlmsg_pid = getpid();
+  sketch_slot_t* slot = &sketch[executable_slots[executable_id]];
+  if (slot->weight - slot->error >= sketch[0].weight) {
+    return executable_id;
+  }
 
-  message_header->id.idx = CN_IDX_PROC;
-  message_header->id.val = CN_VAL_PROC;
-	message_header->seq = 0;
-	message_header->ack = 0;
-	message_header->len = sizeof(*message_operation);
+  return directory_of(executable_id);
+}
 
-  if (send(connection, netlink_header, netlink_header->nlmsg_len, 0) != netlink_header->nlmsg_len) {
-    FAIL("send");
+// run right after a flush: what evicted executables had left is written by now, so their aggregates
+// are folded into their directories, and ids no running process uses anymore are handed out again
+void release_evicted() {
+  if (arrlenu(evicted_executables) == 0) {
+    return;
   }
 
-  if (*message_operation == PROC_CN_MCAST_IGNORE) {
-    code = 2;
-    destruct();
+  // deleting swaps the last aggregate into the hole, which has been looked at already
+  for (ptrdiff_t i = hmlen(aggregates) - 1; i >= 0; i--) {
+    aggregate_key_t key = aggregates[i].key;
+    if (executable_folded_into[key.executable_id] == key.executable_id) {
+      continue;
+    }
+
+    usage_t total = aggregates[i].value.total;
+    aggregate_key_t folded_key = key;
+    folded_key.executable_id = executable_folded_into[key.executable_id];
+    add_usage(&aggregate_of(folded_key)->value.total, &total);
+    hmdel(aggregates, key);
   }
 
-  while (!quit) {
-    if (should_close) {
+  for (size_t i = 0; i < arrlenu(evicted_executables);) {
+    uint32_t executable_id = evicted_executables[i];
+    if (executable_refs[executable_id] > 0) {
+      i++;
+      continue;
+    }
+
+    free(executable_paths[executable_id]);
+    executable_paths[executable_id] = NULL;
+    executable_folded_into[executable_id] = executable_id;
+    arrput(free_executable_ids, executable_id);
+    arrdelswap(evicted_executables, i);
+  }
+
+  // late taskstats must not be charged to whoever gets the id next
+  for (size_t i = 0; i < EXITED_PROCESSES_COUNT; i++) {
+    if (exited_processes[i].tgid != 0 && executable_paths[exited_processes[i].key.executable_id] == NULL) {
+      exited_processes[i].tgid = 0;
+    }
+  }
+}
+
+int uid_by_pid(pid_t pid, uid_t* uid) {
+  struct stat info = {};
+
+  static char proc_path[128] = {};
+  snprintf(proc_path, 128, "/proc/%d", pid);
+
+  if (stat(proc_path, &info) == -1) {
+    return -1;
+  }
+
+  *uid = info.st_uid;
+  return 0;
+}
+
+// the cgroup v2 path of a process, or of the systemd hierarchy on hosts that only have v1
+int cgroup_by_pid(pid_t pid, char cgroup_path[PATH_MAX]) {
+  static char proc_path[128] = {};
+  snprintf(proc_path, 128, "/proc/%d/cgroup", pid);
+
+  FILE* cgroups = fopen(proc_path, "re");
+  if (cgroups == NULL) {
+    return -1;
+  }
+
+  static char line[PATH_MAX] = {};
+  cgroup_path[0] = 0;
+  while (fgets(line, sizeof(line), cgroups) != NULL) {
+    line[strcspn(line, "\n")] = 0;
+
+    if (strncmp(line, "0::", 3) == 0) {
+      snprintf(cgroup_path, PATH_MAX, "%s", line + 3);
       break;
     }
 
-    struct cn_msg* message = (struct cn_msg *) (buffer + sizeof(struct nlmsghdr));
-    struct proc_event* event = (struct proc_event *) (buffer + sizeof(struct nlmsghdr) + sizeof(struct cn_msg));
-    struct nlmsghdr* header = (struct nlmsghdr *) buffer;
+    char* systemd = strstr(line, ":name=systemd:");
+    if (systemd != NULL) {
+      snprintf(cgroup_path, PATH_MAX, "%s", systemd + strlen(":name=systemd:"));
+    }
+  }
 
-    memset(buffer, 0, sizeof(buffer));
+  fclose(cgroups);
+  return 0;
+}
 
-    struct sockaddr_nl from = {
-      .nl_family = AF_NETLINK,
-      .nl_groups = CN_IDX_PROC,
-      .nl_pid = 1,
-    };
+// where an exec's details come from, the benchmark swaps in synthetic processes
+typedef struct {
+  int (*executable_path)(pid_t pid, char executable_path[PATH_MAX]);
+  int (*uid)(pid_t pid, uid_t* uid);
+  int (*cgroup)(pid_t pid, char cgroup_path[PATH_MAX]);
+} resolver_t;
 
-    socklen_t from_len = sizeof (from);
-    size_t received_len = recvfrom(connection, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
-    if (from.nl_pid != 0 || received_len < 1) {
-      continue;
+resolver_t resolver = {
+  .executable_path = get_executable_path,
+  .uid = uid_by_pid,
+  .cgroup = cgroup_by_pid,
+};
+
+// --sample-above=N: once more than N processes a second are executed, only the tgids whose hash has
+// its low `sampling_shift` bits clear are tracked, and each of them counts for 2^sampling_shift
+uint64_t sample_above = 0;
+int sampling_shift = 0;
+uint64_t execs_at_last_tick = 0;
+
+#define SAMPLING_MAX_SHIFT 10
+
+bool sampled_out(pid_t tgid) {
+  if (sampling_shift == 0) {
+    return false;
+  }
+
+  // murmur3's finalizer, neighbouring pids end up far apart
+  uint32_t hash = tgid;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+
+  return (hash & ((1U << sampling_shift) - 1)) != 0;
+}
+
+// picks the smallest power of two sample rate that brings the exec rate seen since the last tick under the limit
+void update_sampling(uint64_t seconds) {
+  if (sample_above == 0 || seconds == 0) {
+    return;
+  }
+
+  uint64_t execs = collector_stats.events[EVENT_EXEC];
+  uint64_t rate = (execs - execs_at_last_tick) / seconds;
+  execs_at_last_tick = execs;
+
+  int shift = 0;
+  while (shift < SAMPLING_MAX_SHIFT && (rate >> shift) > sample_above) {
+    shift++;
+  }
+
+  if (shift != sampling_shift) {
+    printf("LOG: %" PRIu64 " execs/s, tracking 1 in %u processes\n", rate, 1U << shift);
+  }
+  sampling_shift = shift;
+}
+
+typedef enum {
+  RULE_INCLUDE,
+  RULE_EXCLUDE,
+} rule_action_t;
+
+typedef struct {
+  char* key;
+  uint32_t value;
+} rule_child_t;
+
+// one path component; `rule` is the first rule whose prefix ends here, -1 if none does
+typedef struct {
+  rule_child_t* children;
+  int rule;
+} rule_node_t;
+
+typedef struct {
+  char* pattern;
+  int rule;
+} rule_glob_t;
+
+typedef struct {
+  uid_t key;
+  int value;
+} rule_uid_t;
+
+// rules from `--rules=PATH`, compiled per kind. the first line of the file that matches a process
+// decides about it, processes no rule matches are tracked
+typedef struct {
+  rule_action_t* actions;
+  rule_node_t* paths;
+  rule_node_t* cgroups;
+  rule_glob_t* globs;
+  rule_uid_t* uids;
+  // rules below this one need the uid or the cgroup of the process
+  int first_process_rule;
+} rules_t;
+
+rules_t rules = {
+  .first_process_rule = INT_MAX,
+};
+
+void add_prefix_rule(rule_node_t** trie, char* prefix, int rule) {
+  if (arrlenu(*trie) == 0) {
+    arrput(*trie, ((rule_node_t) {.rule = -1}));
+  }
+
+  static char components[PATH_MAX] = {};
+  snprintf(components, PATH_MAX, "%s", prefix);
+
+  uint32_t node = 0;
+  char* rest = NULL;
+  for (char* component = strtok_r(components, "/", &rest); component != NULL; component = strtok_r(NULL, "/", &rest)) {
+    if ((*trie)[node].children == NULL) {
+      sh_new_strdup((*trie)[node].children);
     }
 
-    if (event->what == PROC_EVENT_NONE) {
+    ptrdiff_t child = shgeti((*trie)[node].children, component);
+    if (child < 0) {
+      uint32_t next = arrlenu(*trie);
+      shput((*trie)[node].children, component, next);
+      arrput(*trie, ((rule_node_t) {.rule = -1}));
+      node = next;
+    } else {
+      node = (*trie)[node].children[child].value;
+    }
+  }
+
+  if ((*trie)[node].rule == -1) {
+    (*trie)[node].rule = rule;
+  }
+}
+
+// first rule whose prefix covers `path` on whole components, so /usr/lib matches /usr/lib/x but not /usr/libexec
+int match_prefix_rules(rule_node_t* trie, char* path) {
+  if (arrlenu(trie) == 0) {
+    return -1;
+  }
+
+  static char components[PATH_MAX] = {};
+  snprintf(components, PATH_MAX, "%s", path);
+
+  int rule = trie[0].rule;
+  uint32_t node = 0;
+  char* rest = NULL;
+  for (char* component = strtok_r(components, "/", &rest); component != NULL; component = strtok_r(NULL, "/", &rest)) {
+    ptrdiff_t child = trie[node].children != NULL ? shgeti(trie[node].children, component) : -1;
+    if (child < 0) {
+      break;
+    }
+
+    node = trie[node].children[child].value;
+    if (trie[node].rule != -1 && (rule == -1 || trie[node].rule < rule)) {
+      rule = trie[node].rule;
+    }
+  }
+
+  return rule;
+}
+
+int match_path_rules(char* executable_path) {
+  int rule = match_prefix_rules(rules.paths, executable_path);
+
+  // globs are checked in file order and only while they could still beat the prefix match
+  for (size_t i = 0; i < arrlenu(rules.globs) && (rule == -1 || rules.globs[i].rule < rule); i++) {
+    if (fnmatch(rules.globs[i].pattern, executable_path, 0) == 0) {
+      rule = rules.globs[i].rule;
+      break;
+    }
+  }
+
+  return rule;
+}
+
+int match_process_rules(int rule, uid_t uid, char* cgroup_path) {
+  ptrdiff_t uid_rule = hmgeti(rules.uids, uid);
+  if (uid_rule >= 0 && (rule == -1 || rules.uids[uid_rule].value < rule)) {
+    rule = rules.uids[uid_rule].value;
+  }
+
+  int cgroup_rule = match_prefix_rules(rules.cgroups, cgroup_path);
+  if (cgroup_rule != -1 && (rule == -1 || cgroup_rule < rule)) {
+    rule = cgroup_rule;
+  }
+
+  return rule;
+}
+
+bool is_excluded(int rule) {
+  return rule != -1 && rules.actions[rule] == RULE_EXCLUDE;
+}
+
+// lines look like `include|exclude path|glob|uid|cgroup VALUE`, `#` starts a comment
+void load_rules(char* path) {
+  FILE* file = fopen(path, "re");
+  if (file == NULL) {
+    fprintf(stderr, "ERROR: failed to open rules %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  static char line[PATH_MAX + 32] = {};
+  int line_number = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+    line[strcspn(line, "#\n")] = 0;
+
+    char* action = strtok(line, " \t");
+    char* kind = strtok(NULL, " \t");
+    char* value = strtok(NULL, "\n");
+    while (value != NULL && (*value == ' ' || *value == '\t')) {
+      value++;
+    }
+
+    if (action == NULL) {
       continue;
     }
 
-    static uint32_t seqs[4096] = {};
-    if (seqs[event->cpu] && message->seq != seqs[event->cpu] + 1) {
-      fprintf(stderr, "WARNING: out of order message on cpu %d\n", event->cpu);
+    int rule = arrlen(rules.actions);
+    if (strcmp(action, "include") == 0) {
+      arrput(rules.actions, RULE_INCLUDE);
+    } else if (strcmp(action, "exclude") == 0) {
+      arrput(rules.actions, RULE_EXCLUDE);
+    } else {
+      fprintf(stderr, "ERROR: %s:%d: expected include or exclude, got '%s'\n", path, line_number, action);
+      exit(1);
     }
-    seqs[event->cpu] = message->seq;
 
-    while (NLMSG_OK(header, received_len)) {
-      if (header->nlmsg_type == NLMSG_NOOP) {
-        continue;
+    if (kind == NULL || value == NULL || *value == 0) {
+      fprintf(stderr, "ERROR: %s:%d: expected '%s path|glob|uid|cgroup VALUE'\n", path, line_number, action);
+      exit(1);
+    }
+
+    if (strcmp(kind, "path") == 0) {
+      add_prefix_rule(&rules.paths, value, rule);
+    } else if (strcmp(kind, "glob") == 0) {
+      arrput(rules.globs, ((rule_glob_t) {.pattern = strdup(value), .rule = rule}));
+    } else if (strcmp(kind, "cgroup") == 0) {
+      add_prefix_rule(&rules.cgroups, value, rule);
+      rules.first_process_rule = rules.first_process_rule < rule ? rules.first_process_rule : rule;
+    } else if (strcmp(kind, "uid") == 0) {
+      struct passwd* passwd = getpwnam(value);
+      char* end = NULL;
+      uid_t uid = passwd != NULL ? passwd->pw_uid : (uid_t) strtoul(value, &end, 10);
+      if (passwd == NULL && (end == value || *end != 0)) {
+        fprintf(stderr, "ERROR: %s:%d: no such user '%s'\n", path, line_number, value);
+        exit(1);
       }
 
-      if (header->nlmsg_type == NLMSG_ERROR ||
-          header->nlmsg_type == NLMSG_OVERRUN) {
-        break;
+      if (hmgeti(rules.uids, uid) < 0) {
+        hmput(rules.uids, uid, rule);
       }
+      rules.first_process_rule = rules.first_process_rule < rule ? rules.first_process_rule : rule;
+    } else {
+      fprintf(stderr, "ERROR: %s:%d: unknown rule kind '%s'\n", path, line_number, kind);
+      exit(1);
+    }
+  }
 
-      handle_message(NLMSG_DATA(header));
+  fclose(file);
+  printf("LOG: loaded %td rules from %s\n", arrlen(rules.actions), path);
+}
 
-      if (header->nlmsg_type == NLMSG_DONE) {
-        break;
+void track_process(pid_t tgid, process_info_t* info, char* executable_path, char* cgroup_path) {
+  info->executable_id = track_executable(executable_path);
+  info->cgroup_id = intern_cgroup(cgroup_path);
+
+  // the aggregate exists up front so live queries can fold running processes into it
+  aggregate_of(aggregate_key_of(info));
+
+  hmput(tgids, tgid, *info);
+  if (hmlenu(tgids) > collector_stats.process_table_peak) {
+    collector_stats.process_table_peak = hmlenu(tgids);
+  }
+  executable_refs[info->executable_id]++;
+}
+
+void handle_exec_event(struct proc_event *event) {
+  (void) event;
+  assert(event->what == PROC_EVENT_EXEC);
+
+  pid_t tgid = event->event_data.exec.process_tgid;
+
+  if (hmgeti(tgids, tgid) >= 0) {
+    return;
+  }
+
+  // decided before anything is looked up, shedding that work is the point
+  if (sampled_out(tgid)) {
+    collector_stats.sampled_out_execs++;
+    return;
+  }
+
+  static char executable_path[PATH_MAX] = {};
+  static char cgroup_path[PATH_MAX] = {};
+  static process_info_t new_process_info = {};
+  new_process_info.start_time_ns = event->timestamp_ns;
+  new_process_info.last_seen_ns = event->timestamp_ns;
+  new_process_info.weight = 1U << sampling_shift;
+
+  uint64_t proc_start_ns = latency_now_ns();
+  if (resolver.executable_path(tgid, executable_path) == -1) {
+    fprintf(stderr, "WARNING: failed to readlink on /proc/%d/exe: %s\n", tgid, strerror(errno));
+    collector_stats.proc_lookup_failures++;
+    if (latency_timed) {
+      uint64_t proc_ns = latency_now_ns() - proc_start_ns;
+      if (latency_recorded) {
+        record_latency(LATENCY_PROC, proc_ns);
       }
-      header = NLMSG_NEXT(header, received_len);
+      PROBE3(proc, tgid, proc_ns, -1);
+    }
+    return;
+  }
+
+  // decided by the path alone, the process is not even looked at
+  int rule = match_path_rules(executable_path);
+  if (rule != -1 && rule < rules.first_process_rule && is_excluded(rule)) {
+    collector_stats.excluded_execs++;
+    return;
+  }
+
+  int resolved = resolver.uid(tgid, &new_process_info.uid);
+  if (resolved == -1) {
+    fprintf(stderr, "WARNING: failed to stat /proc/%d: %s\n", tgid, strerror(errno));
+  } else if ((resolved = resolver.cgroup(tgid, cgroup_path)) == -1) {
+    fprintf(stderr, "WARNING: failed to read /proc/%d/cgroup: %s\n", tgid, strerror(errno));
+  }
+  uint64_t proc_ns = latency_now_ns() - proc_start_ns;
+  if (latency_recorded) {
+    record_latency(LATENCY_PROC, proc_ns);
+  }
+  if (latency_timed) {
+    PROBE3(proc, tgid, proc_ns, resolved);
+  }
+  if (resolved == -1) {
+    collector_stats.proc_lookup_failures++;
+    return;
+  }
+
+  if (rule == -1 || rule > rules.first_process_rule) {
+    rule = match_process_rules(rule, new_process_info.uid, cgroup_path);
+  }
+  if (is_excluded(rule)) {
+    collector_stats.excluded_execs++;
+    return;
+  }
+
+  if (max_processes > 0 && hmlenu(tgids) >= max_processes && !make_room_for_process()) {
+    collector_stats.process_table_full_execs++;
+    return;
+  }
+
+  track_process(tgid, &new_process_info, executable_path, cgroup_path);
+  ring_publish(SPYCY_RING_EXEC, tgid, &new_process_info, 0);
+  PROBE3(exec, tgid, new_process_info.executable_id, proc_ns);
+}
+
+bool exists_in_db(char* executable_path, char* username, int64_t bucket, int64_t cgroup_id) {
+  assert(db != NULL);
+
+  sqlite3_stmt* select_statement = NULL;
+  int rc = sqlite3_prepare(db,
+                           "select exists "
+                           "(select 1 from spycy_data "
+                           " where executable_path = ? and "
+                           "       username = ? and "
+                           "       bucket = ? and "
+                           "       cgroup_id = ?)",
+                           -1, &select_statement, NULL);
+  if (rc != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare select statement: %s\n", sqlite3_errmsg(db));
+  }
+
+  if (((rc = sqlite3_bind_text(select_statement, 1, executable_path, -1, SQLITE_STATIC)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_text(select_statement, 2, username, -1, SQLITE_STATIC)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(select_statement, 3, bucket)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(select_statement, 4, cgroup_id)) != SQLITE_OK)) {
+    SQLITE3_FAIL("ERROR: failed to bind select statement: %s\n", sqlite3_errstr(rc));
+  }
+
+  int step = sqlite3_step(select_statement);
+  bool result = false;
+  if (step == SQLITE_ROW) {
+    result = sqlite3_column_int(select_statement, 0);
+  }
+
+  sqlite3_finalize(select_statement);
+  return result;
+}
+
+// histograms are stored sparsely as varint pairs of (distance to the previous non-empty bucket, count)
+#define HISTOGRAM_BLOB_MAX (DURATION_BUCKETS * 2 * 10)
+
+size_t put_varint(uint8_t* out, uint64_t value) {
+  size_t len = 0;
+  do {
+    out[len++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+    value >>= 7;
+  } while (value != 0);
+  return len;
+}
+
+bool get_varint(const uint8_t* in, size_t in_len, size_t* offset, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; *offset < in_len && shift < 64; shift += 7) {
+    uint8_t byte = in[(*offset)++];
+    *value |= (uint64_t) (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t encode_histogram(uint64_t counts[DURATION_BUCKETS], uint8_t out[HISTOGRAM_BLOB_MAX]) {
+  size_t len = 0;
+  int previous = -1;
+  for (int i = 0; i < DURATION_BUCKETS; i++) {
+    if (counts[i] != 0) {
+      len += put_varint(out + len, i - previous);
+      len += put_varint(out + len, counts[i]);
+      previous = i;
+    }
+  }
+  return len;
+}
+
+// adds the histogram in `blob` to `counts`, false if it is malformed
+bool decode_histogram(const uint8_t* blob, size_t blob_len, uint64_t counts[DURATION_BUCKETS]) {
+  size_t offset = 0;
+  int bucket = -1;
+  while (offset < blob_len) {
+    uint64_t distance = 0;
+    uint64_t count = 0;
+    if (!get_varint(blob, blob_len, &offset, &distance) ||
+        !get_varint(blob, blob_len, &offset, &count) ||
+        distance == 0 || distance > (uint64_t) (DURATION_BUCKETS - 1 - bucket)) {
+      return false;
+    }
+
+    bucket += distance;
+    counts[bucket] += count;
+  }
+  return true;
+}
+
+void result_histogram(sqlite3_context* context, uint64_t counts[DURATION_BUCKETS]) {
+  static uint8_t blob[HISTOGRAM_BLOB_MAX] = {};
+  sqlite3_result_blob(context, blob, encode_histogram(counts, blob), SQLITE_TRANSIENT);
+}
+
+bool add_histogram_value(sqlite3_value* value, uint64_t counts[DURATION_BUCKETS]) {
+  return sqlite3_value_type(value) == SQLITE_NULL ||
+         decode_histogram(sqlite3_value_blob(value), sqlite3_value_bytes(value), counts);
+}
+
+// spycy_histogram_merge(a, b): both histograms in one, how flushes add to a stored row
+void histogram_merge_function(sqlite3_context* context, int argc, sqlite3_value** argv) {
+  static uint64_t counts[DURATION_BUCKETS] = {};
+  memset(counts, 0, sizeof(counts));
+
+  for (int i = 0; i < argc; i++) {
+    if (!add_histogram_value(argv[i], counts)) {
+      sqlite3_result_error(context, "malformed histogram", -1);
+      return;
+    }
+  }
+
+  result_histogram(context, counts);
+}
+
+// spycy_histogram_sum(h): the aggregate version, for `group by`
+void histogram_sum_step(sqlite3_context* context, int argc, sqlite3_value** argv) {
+  (void) argc;
+
+  uint64_t* counts = sqlite3_aggregate_context(context, sizeof(uint64_t) * DURATION_BUCKETS);
+  if (counts == NULL) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  if (!add_histogram_value(argv[0], counts)) {
+    sqlite3_result_error(context, "malformed histogram", -1);
+  }
+}
+
+void histogram_sum_final(sqlite3_context* context) {
+  uint64_t* counts = sqlite3_aggregate_context(context, 0);
+  if (counts == NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+
+  result_histogram(context, counts);
+}
+
+// spycy_histogram_percentile(h, p): duration in nanoseconds that p percent of the runs in h took at most
+void histogram_percentile_function(sqlite3_context* context, int argc, sqlite3_value** argv) {
+  (void) argc;
+
+  static uint64_t counts[DURATION_BUCKETS] = {};
+  memset(counts, 0, sizeof(counts));
+  if (!add_histogram_value(argv[0], counts)) {
+    sqlite3_result_error(context, "malformed histogram", -1);
+    return;
+  }
+
+  double percentile = sqlite3_value_double(argv[1]);
+  uint64_t total = 0;
+  for (int i = 0; i < DURATION_BUCKETS; i++) {
+    total += counts[i];
+  }
+
+  if (total == 0 || percentile < 0 || percentile > 100) {
+    sqlite3_result_null(context);
+    return;
+  }
+
+  uint64_t rank = percentile / 100 * total;
+  rank = rank == 0 ? 1 : rank;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < DURATION_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      sqlite3_result_int64(context, duration_bucket_value(i));
+      return;
+    }
+  }
+}
+
+void register_histogram_functions() {
+  int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+  if (sqlite3_create_function(db, "spycy_histogram_merge", 2, flags, NULL, histogram_merge_function, NULL, NULL) != SQLITE_OK ||
+      sqlite3_create_function(db, "spycy_histogram_sum", 1, flags, NULL, NULL, histogram_sum_step, histogram_sum_final) != SQLITE_OK ||
+      sqlite3_create_function(db, "spycy_histogram_percentile", 2, flags, NULL, histogram_percentile_function, NULL, NULL) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to register histogram functions: %s\n", sqlite3_errmsg(db));
+  }
+}
+
+// binds the usage columns to parameters `first`..`first + 8`
+int bind_usage(sqlite3_stmt* statement, int first, usage_t* usage) {
+  int rc = SQLITE_OK;
+
+  if (((rc = sqlite3_bind_int64(statement, first, usage->nanoseconds_spent)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(statement, first + 1, usage->cpu_user_ns)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(statement, first + 2, usage->cpu_system_ns)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(statement, first + 3, usage->read_bytes)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(statement, first + 4, usage->write_bytes)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(statement, first + 5, usage->max_rss_kb)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(statement, first + 6, usage->executions)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(statement, first + 7, usage->inclusive_ns)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(statement, first + 8, usage->flags)) != SQLITE_OK)) {
+    return rc;
+  }
+
+  return rc;
+}
+
+int bind_durations(sqlite3_stmt* statement, int index, uint32_t durations[DURATION_BUCKETS]) {
+  static uint64_t counts[DURATION_BUCKETS] = {};
+  static uint8_t blob[HISTOGRAM_BLOB_MAX] = {};
+
+  for (int i = 0; i < DURATION_BUCKETS; i++) {
+    counts[i] = durations[i];
+  }
+
+  return sqlite3_bind_blob(statement, index, blob, encode_histogram(counts, blob), SQLITE_TRANSIENT);
+}
+
+void update_executable(usage_t* usage, uint32_t durations[DURATION_BUCKETS],
+                       char* executable_path, char* username, int64_t bucket, int64_t cgroup_id) {
+  assert(db != NULL);
+
+  sqlite3_stmt* update_statement = NULL;
+  int rc = sqlite3_prepare_v2(db,
+                              "update spycy_data "
+                              "set nanoseconds_spent = nanoseconds_spent + ?, "
+                              "    cpu_user_ns = cpu_user_ns + ?, "
+                              "    cpu_system_ns = cpu_system_ns + ?, "
+                              "    read_bytes = read_bytes + ?, "
+                              "    write_bytes = write_bytes + ?, "
+                              "    max_rss_kb = max(max_rss_kb, ?), "
+                              "    executions = executions + ?, "
+                              "    inclusive_ns = inclusive_ns + ?, "
+                              "    flags = flags | ?, "
+                              "    change_seq = ?, "
+                              "    durations = spycy_histogram_merge(durations, ?) "
+                              "where executable_path = ? and username = ? and bucket = ? and cgroup_id = ?;",
+                              -1, &update_statement, NULL);
+  if (rc != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare update statement: %s\n", sqlite3_errmsg(db));
+  }
+
+  if (((rc = bind_usage(update_statement, 1, usage)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(update_statement, 10, change_seq)) != SQLITE_OK) ||
+      ((rc = bind_durations(update_statement, 11, durations)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_text(update_statement, 12, executable_path, -1, SQLITE_STATIC)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_text(update_statement, 13, username, -1, SQLITE_STATIC)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(update_statement, 14, bucket)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(update_statement, 15, cgroup_id)) != SQLITE_OK)) {
+    SQLITE3_FAIL("ERROR: failed to bind update statement: %s\n", sqlite3_errstr(rc));
+  }
+
+  while (sqlite3_step(update_statement) != SQLITE_DONE) ;
+  sqlite3_finalize(update_statement);
+}
+
+void insert_executable(usage_t* usage, uint32_t durations[DURATION_BUCKETS],
+                       char* executable_path, char* username, int64_t bucket, int64_t cgroup_id) {
+  assert(db != NULL);
+
+  sqlite3_stmt* insert_statement = NULL;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "insert into spycy_data (executable_path, username, bucket, cgroup_id, "
+                              "                        nanoseconds_spent, cpu_user_ns, cpu_system_ns, "
+                              "                        read_bytes, write_bytes, max_rss_kb, executions, inclusive_ns, flags, "
+                              "                        durations, change_seq) "
+                              "values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                              -1, &insert_statement, NULL);
+  if (rc != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare insert statement: %s\n", sqlite3_errmsg(db));
+  }
+
+
+  if (((rc = sqlite3_bind_text(insert_statement, 1, executable_path, -1, SQLITE_STATIC)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_text(insert_statement, 2, username, -1, SQLITE_STATIC)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(insert_statement, 3, bucket)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(insert_statement, 4, cgroup_id)) != SQLITE_OK) ||
+      ((rc = bind_usage(insert_statement, 5, usage)) != SQLITE_OK) ||
+      ((rc = bind_durations(insert_statement, 14, durations)) != SQLITE_OK) ||
+      ((rc = sqlite3_bind_int64(insert_statement, 15, change_seq)) != SQLITE_OK)) {
+    SQLITE3_FAIL("ERROR: failed to bind insert statement: %s\n", sqlite3_errstr(rc));
+  }
+
+  while (sqlite3_step(insert_statement) != SQLITE_DONE) ;
+  sqlite3_finalize(insert_statement);
+}
+
+// the database's id for one of our cgroups, added to spycy_cgroups the first time it is written.
+// processes without a cgroup are stored as 0
+int64_t cgroup_db_id(uint32_t cgroup_id) {
+  assert(db != NULL);
+
+  if (cgroup_paths[cgroup_id][0] == 0) {
+    return 0;
+  }
+
+  while (arrlenu(cgroup_db_ids) <= cgroup_id) {
+    arrput(cgroup_db_ids, 0);
+  }
+
+  if (cgroup_db_ids[cgroup_id] != 0) {
+    return cgroup_db_ids[cgroup_id];
+  }
+
+  sqlite3_stmt* insert_statement = NULL;
+  sqlite3_stmt* select_statement = NULL;
+  if (sqlite3_prepare_v2(db, "insert or ignore into spycy_cgroups (path) values (?)", -1, &insert_statement, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "select id from spycy_cgroups where path = ?", -1, &select_statement, NULL) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare cgroup statements: %s\n", sqlite3_errmsg(db));
+  }
+
+  if (sqlite3_bind_text(insert_statement, 1, cgroup_paths[cgroup_id], -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_text(select_statement, 1, cgroup_paths[cgroup_id], -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_step(insert_statement) != SQLITE_DONE ||
+      sqlite3_step(select_statement) != SQLITE_ROW) {
+    SQLITE3_FAIL("ERROR: failed to store cgroup %s: %s\n", cgroup_paths[cgroup_id], sqlite3_errmsg(db));
+  }
+
+  cgroup_db_ids[cgroup_id] = sqlite3_column_int64(select_statement, 0);
+
+  sqlite3_finalize(insert_statement);
+  sqlite3_finalize(select_statement);
+
+  return cgroup_db_ids[cgroup_id];
+}
+
+void save_to_db(usage_t* usage, uint32_t durations[DURATION_BUCKETS], aggregate_key_t* key) {
+  assert(db != NULL);
+
+  char* executable_path = executable_paths[key->executable_id];
+  char* username = username_by_uid(key->uid);
+  int64_t bucket = time(NULL) / BUCKET_SECONDS * BUCKET_SECONDS;
+  int64_t cgroup_id = cgroup_db_id(key->cgroup_id);
+
+  if (exists_in_db(executable_path, username, bucket, cgroup_id)) {
+    update_executable(usage, durations, executable_path, username, bucket, cgroup_id);
+  } else {
+    insert_executable(usage, durations, executable_path, username, bucket, cgroup_id);
+  }
+
+  if (should_close) {
+    destruct();
+  }
+}
+
+// writes every aggregate that changed since the last flush in a single transaction
+void flush_usage() {
+  if (arrlen(dirty_aggregates) == 0) {
+    return;
+  }
+
+  uint64_t flush_start_ns = monotonic_now_ns();
+  size_t flushed = arrlenu(dirty_aggregates);
+  PROBE2(flush_begin, flushed, hmlenu(aggregates));
+
+  rotate_shard();
+
+  // only the benchmark runs without a database, its aggregates are thrown away
+  bool to_db = db != NULL;
+
+  char* error_message = NULL;
+  if (to_db) {
+    sqlite3_exec(db, "begin;", NULL, NULL, &error_message);
+
+    // microseconds of wall clock, so the sequence keeps growing across restarts and shards, but never
+    // repeats or goes back when the clock does
+    struct timespec now = {};
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t now_us = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    change_seq = now_us > change_seq ? now_us : change_seq + 1;
+  }
+  if (error_message != NULL) {
+    SQLITE3_FAIL("ERROR: failed to begin flush: %s\n", error_message);
+  }
+
+  for (ptrdiff_t i = 0; i < arrlen(dirty_aggregates); i++) {
+    aggregate_item_t* item = &aggregates[dirty_aggregates[i]];
+
+    aggregate_key_t key = item->key;
+    key.executable_id = flushed_executable_id(key.executable_id);
+    if (to_db) {
+      save_to_db(&item->value.pending, item->value.pending_durations, &key);
+    }
+    if (export_address != NULL) {
+      export_usage(&item->value.pending, &key);
+    }
+    item->value.pending = (usage_t) {};
+    memset(item->value.pending_durations, 0, sizeof(item->value.pending_durations));
+    item->value.dirty = false;
+  }
+
+  collector_stats.flushed_aggregates += flushed;
+  arrdeln(dirty_aggregates, 0, arrlen(dirty_aggregates));
+
+  if (to_db) {
+    sqlite3_exec(db, "commit;", NULL, NULL, &error_message);
+  }
+  if (error_message != NULL) {
+    SQLITE3_FAIL("ERROR: failed to commit flush: %s\n", error_message);
+  }
+
+  release_evicted();
+
+  collector_stats.flushes++;
+  uint64_t flush_ns = monotonic_now_ns() - flush_start_ns;
+  collector_stats.flush_ns += flush_ns;
+  record_latency(LATENCY_FLUSH, flush_ns);
+  PROBE2(flush_end, flushed, flush_ns);
+}
+
+void destruct() {
+  // a failure while flushing on the way out must not try to flush again
+  static bool destructing = false;
+  if (destructing) {
+    sqlite3_close(db);
+    exit(code);
+  }
+
+  if (sqlite3_is_interrupted(db)) {
+    should_close = true;
+
+    if (connection != -1) {
+      close(connection);
+    }
+
+    return;
+  }
+
+  if (connection != -1) {
+    close(connection);
+  }
+
+  // the kernel forgets the registration along with the socket
+  if (connection_taskstats != -1) {
+    close(connection_taskstats);
+  }
+
+  stop_stats_server();
+  stop_metrics_server();
+  stop_handoff_server();
+
+  destructing = true;
+
+  // the ones still running go to --snapshot for the next start to carry on with
+  if (snapshot_path != NULL && !handed_off) {
+    save_snapshot(snapshot_path);
+  }
+
+  // after a handoff they are still running, just not ours to charge anymore
+  for (size_t i = 0; i < hmlenu(tgids) && !handed_off; i++) {
+    process_info_t* info = &tgids[i].value;
+    // a process we lost the exit of would otherwise be charged for all the time spycy ran
+    if (process_is_alive(tgids[i].key, info)) {
+      info->usage.nanoseconds_spent = last_timestamp_ns - info->start_time_ns;
+    } else {
+      info->usage.nanoseconds_spent = info->last_seen_ns - info->start_time_ns;
+      info->usage.flags |= USAGE_ESTIMATED;
+      collector_stats.evicted_processes++;
+    }
+    info->usage.inclusive_ns = forest_inclusive_ns(tgids[i].key, info->usage.nanoseconds_spent, info->weight);
+    scale_usage(&info->usage, info->weight);
+    account_usage(aggregate_key_of(info), &info->usage);
+  }
+
+  if (db != NULL) {
+    flush_usage();
+  }
+
+  // the instance that took over is waiting for the handoff connection to close before it opens the
+  // database and listens where we did. the export queue may take seconds to drain, not on its time
+  if (handoff_client != -1) {
+    if (sqlite3_close(db) == SQLITE_OK) {
+      db = NULL;
+    }
+    close(handoff_client);
+    handoff_client = -1;
+  }
+
+  if (export_address != NULL) {
+    drain_export();
+  }
+
+  hmfree(tgids);
+
+  if (sqlite3_close(db) != SQLITE_OK) {
+    should_close = true;
+    return;
+  }
+
+  exit(code);
+}
+
+typedef struct {
+  pid_t parent;
+  pid_t first_child;
+  pid_t next_sibling;
+  pid_t previous_sibling;
+  // inclusive time of the descendants that already exited, each scaled by its own weight, handed up
+  // when this one does
+  uint64_t descendants_ns;
+} tree_node_t;
+
+typedef struct {
+  pid_t key;
+  tree_node_t value;
+} tree_item_t;
+
+// every process forked since startup, linked to its parent. children that outlive their parent move
+// up to their grandparent, so there is exactly one node per live process. 0 means none
+tree_item_t* forest = NULL;
+
+void forest_unlink(pid_t tgid, tree_node_t* node) {
+  tree_item_t* previous = hmgetp_null(forest, node->previous_sibling);
+  tree_item_t* next = hmgetp_null(forest, node->next_sibling);
+  tree_item_t* parent = hmgetp_null(forest, node->parent);
+
+  if (previous != NULL) {
+    previous->value.next_sibling = node->next_sibling;
+  } else if (parent != NULL && parent->value.first_child == tgid) {
+    parent->value.first_child = node->next_sibling;
+  }
+
+  if (next != NULL) {
+    next->value.previous_sibling = node->previous_sibling;
+  }
+
+  node->next_sibling = 0;
+  node->previous_sibling = 0;
+}
+
+// takes a process out of the tree and returns its inclusive time, with its own time scaled up by the
+// weight it was sampled with; `own_ns` is 0 for processes we do not time
+uint64_t forest_exit(pid_t tgid, uint64_t own_ns, uint32_t weight) {
+  own_ns *= weight > 1 ? weight : 1;
+  tree_item_t* item = hmgetp_null(forest, tgid);
+  if (item == NULL) {
+    return own_ns;
+  }
+
+  tree_node_t node = item->value;
+  uint64_t inclusive_ns = own_ns + node.descendants_ns;
+
+  forest_unlink(tgid, &item->value);
+
+  tree_item_t* parent = hmgetp_null(forest, node.parent);
+  if (parent != NULL) {
+    parent->value.descendants_ns += inclusive_ns;
+  }
+
+  // the children move up a level, in front of their new siblings
+  pid_t last_child = 0;
+  for (pid_t child = node.first_child; child != 0;) {
+    tree_item_t* child_item = hmgetp_null(forest, child);
+    if (child_item == NULL) {
+      break;
+    }
+
+    child_item->value.parent = parent != NULL ? node.parent : 0;
+    if (parent == NULL) {
+      // roots are not in any list
+      pid_t next = child_item->value.next_sibling;
+      child_item->value.next_sibling = 0;
+      child_item->value.previous_sibling = 0;
+      child = next;
+      continue;
+    }
+
+    last_child = child;
+    child = child_item->value.next_sibling;
+  }
+
+  if (parent != NULL && last_child != 0) {
+    tree_item_t* first = hmgetp_null(forest, node.first_child);
+    tree_item_t* last = hmgetp_null(forest, last_child);
+    tree_item_t* next = hmgetp_null(forest, parent->value.first_child);
+
+    first->value.previous_sibling = 0;
+    last->value.next_sibling = parent->value.first_child;
+    if (next != NULL) {
+      next->value.previous_sibling = last_child;
+    }
+    parent->value.first_child = node.first_child;
+  }
+
+  hmdel(forest, tgid);
+  return inclusive_ns;
+}
+
+void handle_fork_event(struct proc_event *event) {
+  assert(event->what == PROC_EVENT_FORK);
+
+  pid_t parent_tgid = event->event_data.fork.parent_tgid;
+  pid_t child_tgid = event->event_data.fork.child_tgid;
+
+  // a new thread, not a new process
+  if (event->event_data.fork.child_pid != child_tgid) {
+    return;
+  }
+
+  // we missed the exit of whoever had this pid before
+  forest_exit(child_tgid, 0, 1);
+
+  tree_node_t node = {};
+  tree_item_t* parent = hmgetp_null(forest, parent_tgid);
+  if (parent != NULL) {
+    node.parent = parent_tgid;
+    node.next_sibling = parent->value.first_child;
+
+    tree_item_t* next = hmgetp_null(forest, node.next_sibling);
+    if (next != NULL) {
+      next->value.previous_sibling = child_tgid;
+    }
+    parent->value.first_child = child_tgid;
+  }
+
+  hmput(forest, child_tgid, node);
+}
+
+// the inclusive time of a process that is still running, for when spycy stops
+uint64_t forest_inclusive_ns(pid_t tgid, uint64_t own_ns, uint32_t weight) {
+  own_ns *= weight > 1 ? weight : 1;
+  tree_item_t* item = hmgetp_null(forest, tgid);
+  return own_ns + (item != NULL ? item->value.descendants_ns : 0);
+}
+
+// charges a finished process to its aggregate and stops tracking it
+void retire_process(pid_t tgid, process_info_t* info, uint64_t end_time_ns, uint64_t inclusive_ns) {
+  info->usage.nanoseconds_spent = end_time_ns - info->start_time_ns;
+  info->usage.inclusive_ns = inclusive_ns;
+  info->usage.executions = 1;
+  scale_usage(&info->usage, info->weight);
+  account_usage(aggregate_key_of(info), &info->usage);
+  sketch_add(info->executable_id, info->usage.nanoseconds_spent);
+  executable_refs[info->executable_id]--;
+  ring_publish(SPYCY_RING_EXIT, tgid, info, end_time_ns);
+  PROBE4(exit, tgid, info->executable_id, info->usage.nanoseconds_spent, info->usage.flags);
+  assert(hmdel(tgids, tgid) == 1);
+}
+
+void handle_exit_event(struct proc_event *event) {
+  (void) event;
+  assert(event->what == PROC_EVENT_EXIT);
+
+  pid_t tgid = event->event_data.exec.process_tgid;
+  pid_t pid = event->event_data.exec.process_pid;
+
+  if (pid != tgid) {
+    return;
+  }
+
+  item_t* item = hmgetp_null(tgids, tgid);
+  uint64_t own_ns = item != NULL ? event->timestamp_ns - item->value.start_time_ns : 0;
+  uint64_t inclusive_ns = forest_exit(tgid, own_ns, item != NULL ? item->value.weight : 1);
+
+  if (item == NULL) {
+    return;
+  }
+
+  remember_exited(tgid, &item->value);
+  retire_process(tgid, &item->value, event->timestamp_ns, inclusive_ns);
+}
+
+// when a process started in clock ticks since boot, false if there is no process with this pid and
+// 0 ticks if /proc would not say. the snapshot threads call it too, so nothing in here is static
+bool read_start_ticks(pid_t tgid, uint64_t* start_ticks) {
+  *start_ticks = 0;
+  if (kill(tgid, 0) == -1 && errno == ESRCH) {
+    return false;
+  }
+
+  char stat_path[64];
+  snprintf(stat_path, sizeof(stat_path), "/proc/%d/stat", tgid);
+
+  FILE* file = fopen(stat_path, "re");
+  if (file == NULL) {
+    // only a missing entry means the process is gone. out of file descriptors or memory, /proc would
+    // not say, and the process is checked again by the next sweep
+    return errno != ENOENT && errno != ESRCH;
+  }
+
+  char line[4096];
+  bool read = fgets(line, sizeof(line), file) != NULL;
+  fclose(file);
+
+  // the command name may contain anything, the fields we want come after its closing paren
+  char* fields = read ? strrchr(line, ')') : NULL;
+  unsigned long long ticks = 0;
+  if (fields != NULL &&
+      sscanf(fields, ") %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+             &ticks) == 1) {
+    *start_ticks = ticks;
+  }
+  return true;
+}
+
+// whether a process that started at start_ticks can be the one spycy saw exec
+bool started_before_exec(uint64_t start_ticks, process_info_t* info) {
+  if (start_ticks == 0) {
+    return true;
+  }
+
+  // /proc counts clock ticks since boot including suspend, proc events use the monotonic clock.
+  // the process forked before it exec'd, one that took the pid over forked after it exited
+  struct timespec boottime = {};
+  clock_gettime(CLOCK_BOOTTIME, &boottime);
+  uint64_t boot_offset_ns = (uint64_t) boottime.tv_sec * 1000000000 + boottime.tv_nsec - monotonic_now_ns();
+  uint64_t tick_ns = 1000000000 / sysconf(_SC_CLK_TCK);
+
+  return start_ticks * tick_ns <= info->start_time_ns + boot_offset_ns + tick_ns;
+}
+
+// whether the process spycy saw exec is still running under this pid
+bool process_is_alive(pid_t tgid, process_info_t* info) {
+  uint64_t start_ticks = 0;
+  return read_start_ticks(tgid, &start_ticks) && started_before_exec(start_ticks, info);
+}
+
+// charges a process whose exit we missed up to the last time it was seen and forgets it
+void evict_process(pid_t tgid, process_info_t* info) {
+  uint64_t own_ns = info->last_seen_ns - info->start_time_ns;
+  uint64_t inclusive_ns = forest_exit(tgid, own_ns, info->weight);
+
+  info->usage.flags |= USAGE_ESTIMATED;
+  collector_stats.evicted_processes++;
+  retire_process(tgid, info, info->last_seen_ns, inclusive_ns);
+}
+
+// checks the least recently seen processes and evicts the dead ones, true if that freed anything
+bool make_room_for_process() {
+  if (eviction_exhausted) {
+    return false;
+  }
+
+  pid_t oldest[EVICTION_BATCH];
+  size_t oldest_len = 0;
+
+  // insertion into a short sorted list, the table is only scanned when it is full
+  for (size_t i = 0; i < hmlenu(tgids); i++) {
+    uint64_t last_seen_ns = tgids[i].value.last_seen_ns;
+    if (oldest_len == EVICTION_BATCH && hmget(tgids, oldest[oldest_len - 1]).last_seen_ns <= last_seen_ns) {
+      continue;
+    }
+
+    size_t j = oldest_len < EVICTION_BATCH ? oldest_len++ : oldest_len - 1;
+    while (j > 0 && hmget(tgids, oldest[j - 1]).last_seen_ns > last_seen_ns) {
+      oldest[j] = oldest[j - 1];
+      j--;
+    }
+    oldest[j] = tgids[i].key;
+  }
+
+  uint64_t now_ns = monotonic_now_ns();
+  size_t evicted = 0;
+  for (size_t i = 0; i < oldest_len; i++) {
+    item_t* item = hmgetp(tgids, oldest[i]);
+    if (process_is_alive(item->key, &item->value)) {
+      item->value.last_seen_ns = now_ns;
+    } else {
+      evict_process(item->key, &item->value);
+      evicted++;
+    }
+  }
+
+  eviction_exhausted = evicted == 0;
+  return evicted > 0;
+}
+
+void sweep_processes() {
+  uint64_t now_ns = monotonic_now_ns();
+  size_t batch = sweep_batch < hmlenu(tgids) ? sweep_batch : hmlenu(tgids);
+
+  for (size_t checked = 0; checked < batch && hmlenu(tgids) > 0; checked++) {
+    if (sweep_cursor >= hmlenu(tgids)) {
+      sweep_cursor = 0;
+    }
+
+    item_t* item = &tgids[sweep_cursor];
+    collector_stats.swept_processes++;
+    if (process_is_alive(item->key, &item->value)) {
+      item->value.last_seen_ns = now_ns;
+      sweep_cursor++;
+    } else {
+      // the last entry moves into this slot, the cursor stays to check it next
+      evict_process(item->key, &item->value);
+    }
+  }
+}
+
+void handle_message(struct cn_msg *message) {
+  (void) message;
+  struct proc_event *event = (struct proc_event *)message->data;
+
+  last_timestamp_ns = event->timestamp_ns;
+
+  // forks are cheaper to handle than reading the clock twice, only execs and exits are timed
+  bool exec_or_exit = event->what == PROC_EVENT_EXEC || event->what == PROC_EVENT_EXIT;
+  latency_recorded = exec_or_exit && latency_sample();
+  latency_timed = latency_recorded || (exec_or_exit && latency_probes_enabled());
+  uint64_t start_ns = latency_now_ns();
+  if (latency_recorded) {
+    record_latency(LATENCY_LAG, start_ns > event->timestamp_ns ? start_ns - event->timestamp_ns : 0);
+  }
+
+  if (event->what == PROC_EVENT_EXEC) {
+    collector_stats.events[EVENT_EXEC]++;
+    handle_exec_event(event);
+    if (latency_timed) {
+      uint64_t handled_ns = latency_now_ns() - start_ns;
+      if (latency_recorded) {
+        record_latency(LATENCY_EXEC, handled_ns);
+      }
+      PROBE2(exec_handled, event->event_data.exec.process_tgid, handled_ns);
+    }
+  } else if (event->what == PROC_EVENT_EXIT) {
+    collector_stats.events[EVENT_EXIT]++;
+    handle_exit_event(event);
+    if (latency_timed) {
+      uint64_t handled_ns = latency_now_ns() - start_ns;
+      if (latency_recorded) {
+        record_latency(LATENCY_EXIT, handled_ns);
+      }
+      PROBE2(exit_handled, event->event_data.exit.process_tgid, handled_ns);
+    }
+  } else if (event->what == PROC_EVENT_FORK) {
+    collector_stats.events[EVENT_FORK]++;
+    handle_fork_event(event);
+  } else {
+    collector_stats.events[EVENT_OTHER]++;
+  }
+}
+
+typedef struct event_source_t event_source_t;
+
+// everything the event loop waits on; `data.ptr` of each epoll registration points at one of these
+struct event_source_t {
+  int fd;
+  void (*handle)(event_source_t* source, uint32_t events);
+};
+
+int event_loop = -1;
+
+void watch(event_source_t* source, uint32_t events) {
+  struct epoll_event event = {
+    .events = events,
+    .data.ptr = source,
+  };
+
+  if (epoll_ctl(event_loop, EPOLL_CTL_ADD, source->fd, &event) == -1) {
+    FAIL("epoll_ctl");
+  }
+}
+
+void rewatch(event_source_t* source, uint32_t events) {
+  struct epoll_event event = {
+    .events = events,
+    .data.ptr = source,
+  };
+
+  if (epoll_ctl(event_loop, EPOLL_CTL_MOD, source->fd, &event) == -1) {
+    FAIL("epoll_ctl");
+  }
+}
+
+void receive_events(event_source_t* source, uint32_t events) {
+  (void) events;
+
+  static uint8_t buffer[1024] = {};
+
+  // drain everything that queued up while we were busy, the socket is non-blocking
+  while (!quit) {
+    struct cn_msg* message = (struct cn_msg *) (buffer + sizeof(struct nlmsghdr));
+    struct proc_event* event = (struct proc_event *) (buffer + sizeof(struct nlmsghdr) + sizeof(struct cn_msg));
+    struct nlmsghdr* header = (struct nlmsghdr *) buffer;
+
+    memset(buffer, 0, sizeof(buffer));
+
+    struct sockaddr_nl from = {
+      .nl_family = AF_NETLINK,
+      .nl_groups = CN_IDX_PROC,
+      .nl_pid = 1,
+    };
+
+    socklen_t from_len = sizeof (from);
+    ssize_t received_len = recvfrom(source->fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
+    if (received_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return;
+    }
+
+    // the kernel had to throw events away because the socket buffer was full
+    if (received_len == -1 && errno == ENOBUFS) {
+      collector_stats.receive_overruns++;
+      continue;
+    }
+
+    if (from.nl_pid != 0 || received_len < 1) {
+      continue;
+    }
+
+    if (event->what == PROC_EVENT_NONE) {
+      continue;
+    }
+
+    if (event_seqs[event->cpu] && message->seq != event_seqs[event->cpu] + 1) {
+      fprintf(stderr, "WARNING: out of order message on cpu %d\n", event->cpu);
+      collector_stats.sequence_gaps++;
+    }
+    event_seqs[event->cpu] = message->seq;
+    PROBE3(receive, event->cpu, message->seq, received_len);
+
+    while (NLMSG_OK(header, (size_t) received_len)) {
+      if (header->nlmsg_type == NLMSG_NOOP) {
+        continue;
+      }
+
+      if (header->nlmsg_type == NLMSG_ERROR ||
+          header->nlmsg_type == NLMSG_OVERRUN) {
+        break;
+      }
+
+      handle_message(NLMSG_DATA(header));
+
+      if (header->nlmsg_type == NLMSG_DONE) {
+        break;
+      }
+      header = NLMSG_NEXT(header, received_len);
+    }
+  }
+}
+
+event_source_t netlink_source = {
+  .fd = -1,
+  .handle = receive_events,
+};
+
+void start_connector() {
+  if ((connection = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR)) == -1) {
+    FAIL("socket");
+  }
+
+  struct sockaddr_nl my = {
+    .nl_family = AF_NETLINK,
+    .nl_groups = CN_IDX_PROC,
+    .nl_pid = getpid(),
+  };
+
+  if (bind(connection, (struct sockaddr *)&my, sizeof(my)) == -1) {
+    FAIL("bind");
+  }
+
+  static uint8_t buffer[1024] = {};
+  memset(buffer, 0, sizeof(buffer));
+
+  struct nlmsghdr *netlink_header = (struct nlmsghdr *) buffer;
+  struct cn_msg *message_header = (struct cn_msg *) NLMSG_DATA(netlink_header);
+
+  enum proc_cn_mcast_op *message_operation = (enum proc_cn_mcast_op *) &message_header->data[0];
+  *message_operation = PROC_CN_MCAST_LISTEN;
+
+  netlink_header->nlmsg_len = NLMSG_LENGTH(sizeof(*message_header) + sizeof(*message_operation));
+  netlink_header->nlmsg_type = NLMSG_DONE;
+  netlink_header->nlmsg_flags = 0;
+  netlink_header->nlmsg_seq = 0;
+  netlink_header->nlmsg_pid = getpid();
+
+  message_header->id.idx = CN_IDX_PROC;
+  message_header->id.val = CN_VAL_PROC;
+  message_header->seq = 0;
+  message_header->ack = 0;
+  message_header->len = sizeof(*message_operation);
+
+  if (send(connection, netlink_header, netlink_header->nlmsg_len, 0) != netlink_header->nlmsg_len) {
+    FAIL("send");
+  }
+
+  if (*message_operation == PROC_CN_MCAST_IGNORE) {
+    code = 2;
+    destruct();
+  }
+
+  if (fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) | O_NONBLOCK) == -1) {
+    FAIL("fcntl");
+  }
+}
+
+uint64_t ticks = 0;
+
+void handle_tick(event_source_t* source, uint32_t events) {
+  (void) events;
+
+  uint64_t expirations = 0;
+  if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;
+  }
+
+  ticks += expirations;
+  eviction_exhausted = false;
+
+  update_sampling(expirations);
+  sweep_processes();
+
+  if (flush_interval > 0 && ticks % flush_interval == 0) {
+    flush_usage();
+  }
+
+  if (export_address != NULL) {
+    export_tick();
+  }
+}
+
+event_source_t timer_source = {
+  .fd = -1,
+  .handle = handle_tick,
+};
+
+void start_timer() {
+  if ((timer_source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+    FAIL("timerfd_create");
+  }
+
+  struct itimerspec every_second = {
+    .it_interval.tv_sec = 1,
+    .it_value.tv_sec = 1,
+  };
+
+  if (timerfd_settime(timer_source.fd, 0, &every_second, NULL) == -1) {
+    FAIL("timerfd_settime");
+  }
+
+  watch(&timer_source, EPOLLIN);
+}
+
+bool taskstats_enabled = true;
+
+// adds up the final usage of every exiting thread into its process, or straight into the aggregate
+// if the process is already gone
+void handle_taskstats(struct taskstats* stats, size_t stats_len) {
+  pid_t tgid = stats->ac_pid;
+  if (stats_len >= offsetof(struct taskstats, ac_tgid) + sizeof(stats->ac_tgid) && stats->ac_tgid != 0) {
+    tgid = stats->ac_tgid;
+  }
+
+  usage_t usage = {
+    .cpu_user_ns = stats->ac_utime * 1000,
+    .cpu_system_ns = stats->ac_stime * 1000,
+    .read_bytes = stats->read_bytes,
+    .write_bytes = stats->write_bytes,
+    .max_rss_kb = stats->hiwater_rss,
+  };
+
+  item_t* item = hmgetp_null(tgids, tgid);
+  if (item != NULL) {
+    add_usage(&item->value.usage, &usage);
+    return;
+  }
+
+  exited_process_t* exited = &exited_processes[tgid % EXITED_PROCESSES_COUNT];
+  if (exited->tgid == tgid) {
+    scale_usage(&usage, exited->weight);
+    account_usage(exited->key, &usage);
+  }
+}
+
+// sends a generic netlink request and waits for the kernel to acknowledge it, the reply (if any)
+// lands in `reply`. returns the length of the reply, or -1 with errno set
+ssize_t genetlink_request(int fd, uint16_t family, uint8_t command, uint16_t attribute, void* value, size_t value_len,
+                          uint8_t* reply, size_t reply_capacity) {
+  static uint8_t request[256] = {};
+  static uint32_t sequence = 0;
+  memset(request, 0, sizeof(request));
+
+  struct nlmsghdr* header = (struct nlmsghdr *) request;
+  struct genlmsghdr* generic_header = NLMSG_DATA(header);
+  struct nlattr* attr = (struct nlattr *) ((uint8_t *) generic_header + GENL_HDRLEN);
+
+  attr->nla_type = attribute;
+  attr->nla_len = NLA_HDRLEN + value_len;
+  memcpy((uint8_t *) attr + NLA_HDRLEN, value, value_len);
+
+  header->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_ALIGN(attr->nla_len));
+  header->nlmsg_type = family;
+  header->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  header->nlmsg_pid = 0;
+  header->nlmsg_seq = ++sequence;
+  generic_header->cmd = command;
+  generic_header->version = 1;
+
+  if (send(fd, request, header->nlmsg_len, 0) != header->nlmsg_len) {
+    return -1;
+  }
+
+  ssize_t reply_len = 0;
+  for (;;) {
+    // with MSG_TRUNC recv says how long the message was, one that did not fit is an error instead of
+    // being cut off (or, with a full buffer, received as nothing forever)
+    uint8_t* buffer = reply + reply_len;
+    size_t room = (size_t) reply_len < reply_capacity ? reply_capacity - reply_len : 0;
+    ssize_t received_len = recv(fd, buffer, room, MSG_TRUNC);
+    if (received_len == -1) {
+      return -1;
+    }
+    if ((size_t) received_len > room) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+    for (struct nlmsghdr* message = (struct nlmsghdr *) buffer;
+         NLMSG_OK(message, (size_t) received_len);
+         message = NLMSG_NEXT(message, received_len)) {
+      // taskstats of exits can arrive in between once the cpus are registered, they are not the reply
+      if (message->nlmsg_seq != sequence) {
+        continue;
+      }
+
+      if (message->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr* error = NLMSG_DATA(message);
+        if (error->error != 0) {
+          errno = -error->error;
+          return -1;
+        }
+        return reply_len;
+      }
+
+      // packed together in front of whatever was skipped
+      memmove(reply + reply_len, message, message->nlmsg_len);
+      reply_len += NLMSG_ALIGN(message->nlmsg_len);
+    }
+  }
+}
+
+bool attribute_ok(struct nlattr* attr, size_t attrs_len) {
+  return attrs_len >= NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN && attr->nla_len <= attrs_len;
+}
+
+struct nlattr* attribute_next(struct nlattr* attr, size_t* attrs_len) {
+  size_t aligned_len = NLA_ALIGN((size_t) attr->nla_len);
+  *attrs_len -= aligned_len < *attrs_len ? aligned_len : *attrs_len;
+  return (struct nlattr *) ((uint8_t *) attr + aligned_len);
+}
+
+uint16_t taskstats_family() {
+  static uint8_t reply[4096] = {};
+  ssize_t reply_len = genetlink_request(connection_taskstats, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME,
+                                        TASKSTATS_GENL_NAME, sizeof(TASKSTATS_GENL_NAME), reply, sizeof(reply));
+
+  for (struct nlmsghdr* message = (struct nlmsghdr *) reply;
+       reply_len > 0 && NLMSG_OK(message, (size_t) reply_len);
+       message = NLMSG_NEXT(message, reply_len)) {
+    struct nlattr* attr = (struct nlattr *) ((uint8_t *) NLMSG_DATA(message) + GENL_HDRLEN);
+    size_t attrs_len = message->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+    for (; attribute_ok(attr, attrs_len); attr = attribute_next(attr, &attrs_len)) {
+      if (attr->nla_type == CTRL_ATTR_FAMILY_ID) {
+        return *(uint16_t *) ((uint8_t *) attr + NLA_HDRLEN);
+      }
+    }
+  }
+
+  return 0;
+}
+
+void receive_taskstats(event_source_t* source, uint32_t events) {
+  (void) events;
+
+  static uint8_t buffer[16 * 1024] = {};
+
+  while (!quit) {
+    ssize_t received_len = recv(source->fd, buffer, sizeof(buffer), 0);
+    if (received_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return;
+    }
+
+    // lost exits only cost us their cpu time, the wall clock still comes from the connector
+    if (received_len == -1 && errno == ENOBUFS) {
+      collector_stats.taskstats_overruns++;
+      continue;
+    }
+
+    if (received_len == -1) {
+      FAIL("recv");
+    }
+
+    for (struct nlmsghdr* message = (struct nlmsghdr *) buffer;
+         NLMSG_OK(message, (size_t) received_len);
+         message = NLMSG_NEXT(message, received_len)) {
+      if (message->nlmsg_type == NLMSG_ERROR || message->nlmsg_type < NLMSG_MIN_TYPE) {
+        continue;
+      }
+
+      // a thread exit carries TASKSTATS_TYPE_AGGR_PID, the last one of a process also carries
+      // TASKSTATS_TYPE_AGGR_TGID, which only adds up delay accounting and so is of no use here
+      struct nlattr* attr = (struct nlattr *) ((uint8_t *) NLMSG_DATA(message) + GENL_HDRLEN);
+      size_t attrs_len = message->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+      for (; attribute_ok(attr, attrs_len); attr = attribute_next(attr, &attrs_len)) {
+        if (attr->nla_type == TASKSTATS_TYPE_AGGR_PID) {
+          struct nlattr* nested = (struct nlattr *) ((uint8_t *) attr + NLA_HDRLEN);
+          size_t nested_len = attr->nla_len - NLA_HDRLEN;
+
+          for (; attribute_ok(nested, nested_len); nested = attribute_next(nested, &nested_len)) {
+            if (nested->nla_type == TASKSTATS_TYPE_STATS) {
+              static struct taskstats stats = {};
+              size_t stats_len = nested->nla_len - NLA_HDRLEN;
+              stats_len = stats_len < sizeof(stats) ? stats_len : sizeof(stats);
+
+              memset(&stats, 0, sizeof(stats));
+              memcpy(&stats, (uint8_t *) nested + NLA_HDRLEN, stats_len);
+              handle_taskstats(&stats, stats_len);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+event_source_t taskstats_source = {
+  .fd = -1,
+  .handle = receive_taskstats,
+};
+
+// cpu time is a nice to have, if the kernel has no taskstats (or we may not listen to them) spycy
+// carries on with wall clock time only
+void start_taskstats() {
+  if ((connection_taskstats = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC)) == -1) {
+    fprintf(stderr, "WARNING: no taskstats, not recording cpu time: socket: %s\n", strerror(errno));
+    return;
+  }
+
+  // every exiting thread is a message, bursts of short lived processes fill the default buffer quickly
+  int buffer_size = 4 * 1024 * 1024;
+  setsockopt(connection_taskstats, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  setsockopt(connection_taskstats, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size, sizeof(buffer_size));
+
+  struct sockaddr_nl my = {
+    .nl_family = AF_NETLINK,
+  };
+
+  if (bind(connection_taskstats, (struct sockaddr *)&my, sizeof(my)) == -1) {
+    fprintf(stderr, "WARNING: no taskstats, not recording cpu time: bind: %s\n", strerror(errno));
+    close(connection_taskstats);
+    connection_taskstats = -1;
+    return;
+  }
+
+  uint16_t family = taskstats_family();
+  if (family == 0) {
+    fprintf(stderr, "WARNING: no taskstats, not recording cpu time: the kernel has no %s family\n", TASKSTATS_GENL_NAME);
+    close(connection_taskstats);
+    connection_taskstats = -1;
+    return;
+  }
+
+  static char cpumask[32] = {};
+  snprintf(cpumask, sizeof(cpumask), "0-%ld", sysconf(_SC_NPROCESSORS_CONF) - 1);
+
+  static uint8_t reply[4096] = {};
+  if (genetlink_request(connection_taskstats, family, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK,
+                        cpumask, strlen(cpumask) + 1, reply, sizeof(reply)) == -1) {
+    fprintf(stderr, "WARNING: no taskstats, not recording cpu time: register: %s\n", strerror(errno));
+    close(connection_taskstats);
+    connection_taskstats = -1;
+    return;
+  }
+
+  if (fcntl(connection_taskstats, F_SETFL, fcntl(connection_taskstats, F_GETFL) | O_NONBLOCK) == -1) {
+    FAIL("fcntl");
+  }
+
+  taskstats_source.fd = connection_taskstats;
+  watch(&taskstats_source, EPOLLIN);
+
+  printf("LOG: recording cpu time from taskstats on cpus %s\n", cpumask);
+}
+
+// --export=ADDRESS: ships usage deltas to a `spycy aggregate` listening at HOST:PORT or a unix socket
+// PATH. every flush adds what it wrote locally to the open batch, which is sealed every
+// --export-interval seconds. sealed batches stay queued until the aggregator acknowledges them and are
+// sent again after a reconnect, their sequence numbers let the aggregator apply each one only once.
+//
+// every frame is a native uint32_t length and a payload starting with its type:
+//   hello  'H' magic[8] varint(epoch) varint(host length) host
+//   batch  'B' varint(seq) varint(strings) [varint(shared) varint(length) bytes]... varint(rows)
+//              [varint(executable) varint(username) varint(cgroup) varint(bucket hour) varint(ns)
+//               varint(executions)]...
+//   ack    'A' varint(seq), everything up to seq is applied
+//   reject 'R', the oldest batch not acknowledged yet could not be read. sent again it would be
+//              rejected again, so it is dropped
+// executables, usernames and cgroups are sent once per batch, sorted and front coded: each string is
+// the first `shared` bytes of the one before it and `length` bytes of its own. rows refer to them by
+// their position. agents with the older magic send every string whole and no cgroup, the aggregator
+// takes their rows as the empty one
+#define EXPORT_MAGIC "spycyex2"
+#define EXPORT_MAGIC_V1 "spycyex1"
+#define EXPORT_QUEUE_MAX (16 * 1024 * 1024)
+#define EXPORT_FRAME_MAX (64 * 1024 * 1024)
+#define EXPORT_ROWS_MAX (64 * 1024)
+#define EXPORT_DRAIN_MS 2000
+// seconds between connection attempts double up to this while the aggregator acknowledges nothing,
+// resolving its name blocks the event loop
+#define EXPORT_BACKOFF_MAX 60
+
+typedef enum {
+  EXPORT_FRAME_HELLO = 'H',
+  EXPORT_FRAME_BATCH = 'B',
+  EXPORT_FRAME_ACK = 'A',
+  EXPORT_FRAME_REJECT = 'R',
+} export_frame_type_t;
+
+// hashed as raw bytes, so no padding
+typedef struct {
+  uint32_t executable;
+  uint32_t username;
+  uint32_t cgroup;
+  uint32_t bucket_hour;
+} export_row_key_t;
+
+typedef struct {
+  uint64_t nanoseconds_spent;
+  uint64_t executions;
+} export_row_value_t;
+
+typedef struct {
+  export_row_key_t key;
+  export_row_value_t value;
+} export_row_t;
+
+typedef struct {
+  char* key;
+  uint32_t value;
+} export_string_t;
+
+typedef struct {
+  uint64_t seq;
+  // the whole frame, length included
+  uint8_t* frame;
+} export_batch_t;
+
+int export_interval = 10;
+char export_host[256] = {};
+// a new one every start, the aggregator keeps sequence numbers per host and epoch
+uint64_t export_epoch = 0;
+uint64_t export_seq = 0;
+
+// the open batch, its strings are numbered in the order they were added
+export_string_t* export_strings = NULL;
+export_row_t* export_rows = NULL;
+
+export_batch_t* export_queue = NULL;
+size_t export_queued_bytes = 0;
+
+// what of the hello and the queue went out on the current connection
+bool export_connected = false;
+uint8_t* export_hello = NULL;
+size_t export_hello_sent = 0;
+size_t export_batches_sent = 0;
+size_t export_batch_bytes_sent = 0;
+uint8_t* export_input = NULL;
+uint64_t export_retry_tick = 0;
+uint64_t export_backoff = 0;
+
+typedef struct {
+  uint64_t batches;
+  uint64_t acked_batches;
+  uint64_t dropped_batches;
+  uint64_t rejected_batches;
+  uint64_t connects;
+  uint64_t sent_bytes;
+} export_stats_t;
+
+export_stats_t export_stats = {};
+
+void handle_export(event_source_t* source, uint32_t events);
+
+event_source_t export_source = {
+  .fd = -1,
+  .handle = handle_export,
+};
+
+void put_export_varint(uint8_t** out, uint64_t value) {
+  uint8_t bytes[10];
+  size_t len = put_varint(bytes, value);
+  memcpy(arraddnptr(*out, len), bytes, len);
+}
+
+void put_export_string(uint8_t** out, const char* string) {
+  size_t len = strlen(string);
+  put_export_varint(out, len);
+  memcpy(arraddnptr(*out, len), string, len);
+}
+
+// a frame starts with room for its length, filled in once the payload is complete
+uint8_t* start_export_frame(export_frame_type_t type) {
+  uint8_t* frame = NULL;
+  arraddnptr(frame, sizeof(uint32_t));
+  arrput(frame, type);
+  return frame;
+}
+
+void finish_export_frame(uint8_t* frame) {
+  uint32_t len = arrlenu(frame) - sizeof(uint32_t);
+  memcpy(frame, &len, sizeof(len));
+}
+
+int compare_export_strings(const void* a, const void* b) {
+  return strcmp(((export_string_t*) a)->key, ((export_string_t*) b)->key);
+}
+
+uint32_t export_string_index(char* string) {
+  ptrdiff_t index = shgeti(export_strings, string);
+  if (index >= 0) {
+    return export_strings[index].value;
+  }
+
+  uint32_t value = shlenu(export_strings);
+  shput(export_strings, string, value);
+  return value;
+}
+
+void seal_export_batch() {
+  if (hmlenu(export_rows) == 0) {
+    return;
+  }
+
+  export_batch_t batch = {
+    .seq = ++export_seq,
+    .frame = start_export_frame(EXPORT_FRAME_BATCH),
+  };
+  put_export_varint(&batch.frame, batch.seq);
+
+  // paths mostly differ in their last components, sorted neighbours share the rest. the map is only
+  // freed after this, sorting it breaks its index
+  size_t strings_count = shlenu(export_strings);
+  qsort(export_strings, strings_count, sizeof(export_strings[0]), compare_export_strings);
+  uint32_t* positions = NULL;
+  arrsetlen(positions, strings_count);
+
+  put_export_varint(&batch.frame, strings_count);
+  const char* previous = "";
+  for (size_t i = 0; i < strings_count; i++) {
+    const char* string = export_strings[i].key;
+    size_t shared = 0;
+    while (string[shared] != 0 && string[shared] == previous[shared]) {
+      shared++;
+    }
+    put_export_varint(&batch.frame, shared);
+    put_export_string(&batch.frame, string + shared);
+
+    positions[export_strings[i].value] = i;
+    previous = string;
+  }
+
+  put_export_varint(&batch.frame, hmlenu(export_rows));
+  for (size_t i = 0; i < hmlenu(export_rows); i++) {
+    export_row_t* row = &export_rows[i];
+    put_export_varint(&batch.frame, positions[row->key.executable]);
+    put_export_varint(&batch.frame, positions[row->key.username]);
+    put_export_varint(&batch.frame, positions[row->key.cgroup]);
+    put_export_varint(&batch.frame, row->key.bucket_hour);
+    put_export_varint(&batch.frame, row->value.nanoseconds_spent);
+    put_export_varint(&batch.frame, row->value.executions);
+  }
+  finish_export_frame(batch.frame);
+
+  arrfree(positions);
+  shfree(export_strings);
+  sh_new_arena(export_strings);
+  hmfree(export_rows);
+
+  // an aggregator that is gone for long costs the oldest batches rather than unbounded memory. the
+  // one being written stays, half a frame would garble the stream
+  size_t oldest = 0;
+  uint64_t dropped = 0;
+  while (export_queued_bytes + arrlenu(batch.frame) > EXPORT_QUEUE_MAX && oldest < arrlenu(export_queue)) {
+    if (oldest == export_batches_sent && export_batch_bytes_sent > 0) {
+      oldest++;
+      continue;
+    }
+
+    export_queued_bytes -= arrlenu(export_queue[oldest].frame);
+    arrfree(export_queue[oldest].frame);
+    arrdel(export_queue, oldest);
+    export_batches_sent -= oldest < export_batches_sent ? 1 : 0;
+    dropped++;
+  }
+
+  // their usage is lost for the fleet, only the local database still has it
+  if (dropped > 0) {
+    export_stats.dropped_batches += dropped;
+    fprintf(stderr, "WARNING: export queue is over %d MB, dropped %" PRIu64 " unacknowledged batches (%" PRIu64 " so far)\n",
+            EXPORT_QUEUE_MAX / (1024 * 1024), dropped, export_stats.dropped_batches);
+  }
+
+  export_queued_bytes += arrlenu(batch.frame);
+  arrput(export_queue, batch);
+  export_stats.batches++;
+
+  if (export_connected) {
+    rewatch(&export_source, EPOLLIN | EPOLLOUT);
+  }
+}
+
+// called for every aggregate a flush writes, with the key it is written under
+void export_usage(usage_t* usage, aggregate_key_t* key) {
+  if (export_strings == NULL) {
+    sh_new_arena(export_strings);
+  }
+
+  export_row_key_t row_key = {
+    .executable = export_string_index(executable_paths[key->executable_id]),
+    .username = export_string_index(username_by_uid(key->uid)),
+    .cgroup = export_string_index(cgroup_paths[key->cgroup_id]),
+    .bucket_hour = time(NULL) / BUCKET_SECONDS,
+  };
+
+  export_row_t* row = hmgetp_null(export_rows, row_key);
+  if (row == NULL) {
+    hmput(export_rows, row_key, ((export_row_value_t) {}));
+    row = hmgetp_null(export_rows, row_key);
+  }
+  row->value.nanoseconds_spent += usage->nanoseconds_spent;
+  row->value.executions += usage->executions;
+
+  if (hmlenu(export_rows) >= EXPORT_ROWS_MAX) {
+    seal_export_batch();
+  }
+}
+
+int connect_address(char* address) {
+  if (strchr(address, '/') != NULL) {
+    struct sockaddr_un unix_address = {
+      .sun_family = AF_UNIX,
+    };
+    snprintf(unix_address.sun_path, sizeof(unix_address.sun_path), "%s", address);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *) &unix_address, sizeof(unix_address)) == -1 &&
+        errno != EINPROGRESS && errno != EAGAIN) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  static char host[256] = {};
+  char* port = strrchr(address, ':');
+  if (port == NULL || (size_t) (port - address) >= sizeof(host)) {
+    errno = EINVAL;
+    return -1;
+  }
+  snprintf(host, sizeof(host), "%.*s", (int) (port - address), address);
+
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo* addresses = NULL;
+  if (getaddrinfo(host[0] != 0 ? host : NULL, port + 1, &hints, &addresses) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+
+  int fd = socket(addresses->ai_family, addresses->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd != -1 && connect(fd, addresses->ai_addr, addresses->ai_addrlen) == -1 && errno != EINPROGRESS) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+void close_export() {
+  if (export_source.fd != -1) {
+    epoll_ctl(event_loop, EPOLL_CTL_DEL, export_source.fd, NULL);
+    close(export_source.fd);
+    export_source.fd = -1;
+  }
+
+  export_connected = false;
+  arrfree(export_input);
+}
+
+void start_export() {
+  if (export_hello == NULL) {
+    if (gethostname(export_host, sizeof(export_host) - 1) == -1) {
+      snprintf(export_host, sizeof(export_host), "unknown");
+    }
+
+    struct timespec now = {};
+    clock_gettime(CLOCK_REALTIME, &now);
+    export_epoch = ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec) ^ ((uint64_t) getpid() << 48);
+
+    export_hello = start_export_frame(EXPORT_FRAME_HELLO);
+    memcpy(arraddnptr(export_hello, strlen(EXPORT_MAGIC)), EXPORT_MAGIC, strlen(EXPORT_MAGIC));
+    put_export_varint(&export_hello, export_epoch);
+    put_export_string(&export_hello, export_host);
+    finish_export_frame(export_hello);
+  }
+
+  export_retry_tick = ticks + export_backoff;
+  export_backoff = export_backoff == 0 ? 1 : export_backoff * 2;
+  export_backoff = export_backoff < EXPORT_BACKOFF_MAX ? export_backoff : EXPORT_BACKOFF_MAX;
+
+  if ((export_source.fd = connect_address(export_address)) == -1) {
+    return;
+  }
+
+  // everything not acknowledged goes out again, the aggregator skips what it already has
+  export_hello_sent = 0;
+  export_batches_sent = 0;
+  export_batch_bytes_sent = 0;
+  export_stats.connects++;
+  watch(&export_source, EPOLLIN | EPOLLOUT);
+}
+
+bool write_export() {
+  while (true) {
+    uint8_t* frame = NULL;
+    size_t* sent = NULL;
+    if (export_hello_sent < arrlenu(export_hello)) {
+      frame = export_hello;
+      sent = &export_hello_sent;
+    } else if (export_batches_sent < arrlenu(export_queue)) {
+      frame = export_queue[export_batches_sent].frame;
+      sent = &export_batch_bytes_sent;
+    } else {
+      rewatch(&export_source, EPOLLIN);
+      return true;
+    }
+
+    ssize_t rc = send(export_source.fd, frame + *sent, arrlenu(frame) - *sent, MSG_NOSIGNAL);
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return true;
+    }
+    if (rc == -1) {
+      return false;
+    }
+
+    *sent += rc;
+    export_stats.sent_bytes += rc;
+    if (frame != export_hello && *sent == arrlenu(frame)) {
+      export_batches_sent++;
+      export_batch_bytes_sent = 0;
+    }
+  }
+}
+
+void acknowledge_export(uint64_t seq) {
+  size_t acked = 0;
+  while (acked < arrlenu(export_queue) && acked < export_batches_sent && export_queue[acked].seq <= seq) {
+    export_queued_bytes -= arrlenu(export_queue[acked].frame);
+    arrfree(export_queue[acked].frame);
+    acked++;
+  }
+
+  arrdeln(export_queue, 0, acked);
+  export_batches_sent -= acked;
+  export_stats.acked_batches += acked;
+  export_backoff = 0;
+}
+
+void reject_export() {
+  if (export_batches_sent == 0) {
+    return;
+  }
+
+  export_stats.rejected_batches++;
+  fprintf(stderr, "WARNING: the aggregator could not read export batch %" PRIu64 ", dropped it (%" PRIu64 " so far)\n",
+          export_queue[0].seq, export_stats.rejected_batches);
+  export_queued_bytes -= arrlenu(export_queue[0].frame);
+  arrfree(export_queue[0].frame);
+  arrdel(export_queue, 0);
+  export_batches_sent--;
+  export_backoff = 0;
+}
+
+bool read_export() {
+  static uint8_t buffer[4096];
+  while (true) {
+    ssize_t rc = recv(export_source.fd, buffer, sizeof(buffer), 0);
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      break;
+    }
+    if (rc <= 0) {
+      return false;
+    }
+    memcpy(arraddnptr(export_input, rc), buffer, rc);
+  }
+
+  size_t offset = 0;
+  uint32_t len = 0;
+  while (arrlenu(export_input) - offset >= sizeof(len)) {
+    memcpy(&len, export_input + offset, sizeof(len));
+    if (len > EXPORT_FRAME_MAX) {
+      return false;
+    }
+    if (arrlenu(export_input) - offset - sizeof(len) < len) {
+      break;
+    }
+
+    uint8_t* payload = export_input + offset + sizeof(len);
+    size_t payload_offset = 1;
+    uint64_t seq = 0;
+    if (len >= 1 && payload[0] == EXPORT_FRAME_REJECT) {
+      reject_export();
+    } else if (len >= 1 && payload[0] == EXPORT_FRAME_ACK && get_varint(payload, len, &payload_offset, &seq)) {
+      acknowledge_export(seq);
+    } else {
+      return false;
+    }
+    offset += sizeof(len) + len;
+  }
+
+  arrdeln(export_input, 0, offset);
+  return true;
+}
+
+void handle_export(event_source_t* source, uint32_t events) {
+  if (!export_connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(source->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0) {
+      close_export();
+      return;
+    }
+    export_connected = true;
+  }
+
+  if (!export_connected) {
+    return;
+  }
+
+  if (((events & EPOLLIN) && !read_export()) || !write_export() || (events & (EPOLLERR | EPOLLHUP))) {
+    close_export();
+  }
+}
+
+void export_tick() {
+  if (ticks % export_interval == 0) {
+    seal_export_batch();
+  }
+
+  if (export_source.fd == -1 && arrlenu(export_queue) > 0 && ticks >= export_retry_tick) {
+    start_export();
+  }
+}
+
+// on the way out: whatever is left goes out with a short deadline, anything not acknowledged by then
+// is lost
+void drain_export() {
+  seal_export_batch();
+
+  uint64_t deadline_ns = monotonic_now_ns() + EXPORT_DRAIN_MS * 1000000ULL;
+  while (arrlenu(export_queue) > 0 && monotonic_now_ns() < deadline_ns) {
+    if (export_source.fd == -1) {
+      start_export();
+    }
+    if (export_source.fd == -1) {
+      break;
+    }
+
+    bool writing = !export_connected || export_hello_sent < arrlenu(export_hello) ||
+                   export_batches_sent < arrlenu(export_queue);
+    struct pollfd poll_fd = {
+      .fd = export_source.fd,
+      .events = POLLIN | (writing ? POLLOUT : 0),
+    };
+    int wait_ms = (deadline_ns - monotonic_now_ns()) / 1000000 + 1;
+    if (poll(&poll_fd, 1, wait_ms) <= 0) {
+      continue;
+    }
+
+    uint32_t events = (poll_fd.revents & POLLIN ? EPOLLIN : 0) | (poll_fd.revents & POLLOUT ? EPOLLOUT : 0) |
+                      (poll_fd.revents & POLLERR ? EPOLLERR : 0) | (poll_fd.revents & POLLHUP ? EPOLLHUP : 0);
+    handle_export(&export_source, events);
+  }
+
+  if (arrlenu(export_queue) > 0) {
+    fprintf(stderr, "WARNING: %zu batches were not exported to %s\n", arrlenu(export_queue), export_address);
+  }
+}
+
+#define STATS_REQUEST_MAX (PATH_MAX + 16)
+
+typedef struct {
+  event_source_t source;
+  char request[STATS_REQUEST_MAX];
+  size_t request_len;
+  char* response;
+  size_t response_sent;
+  // watched for EPOLLOUT alone until the response that did not fit in the socket is sent
+  bool sending;
+} stats_client_t;
+
+char* stats_socket_path = NULL;
+size_t stats_clients_count = 0;
+
+void stats_printf(stats_client_t* client, char* format, ...) {
+  va_list arguments;
+
+  va_start(arguments, format);
+  int len = vsnprintf(NULL, 0, format, arguments);
+  va_end(arguments);
+
+  size_t offset = arrlenu(client->response);
+  arrsetlen(client->response, offset + len + 1);
+
+  va_start(arguments, format);
+  vsnprintf(client->response + offset, len + 1, format, arguments);
+  va_end(arguments);
+
+  arrsetlen(client->response, offset + len);
+}
+
+void close_stats_client(stats_client_t* client) {
+  close(client->source.fd);
+  arrfree(client->response);
+  free(client);
+  stats_clients_count--;
+}
+
+uint64_t* live_totals = NULL;
+uint32_t* live_running = NULL;
+ptrdiff_t* live_order = NULL;
+
+int compare_live_totals(const void* a, const void* b) {
+  uint64_t total_a = live_totals[*(const ptrdiff_t*) a];
+  uint64_t total_b = live_totals[*(const ptrdiff_t*) b];
+  return total_a < total_b ? 1 : total_a > total_b ? -1 : 0;
+}
+
+// flushed and pending totals plus the time every running process has accumulated so far
+void collect_live_totals() {
+  uint64_t now_ns = monotonic_now_ns();
+
+  arrsetlen(live_totals, hmlenu(aggregates));
+  arrsetlen(live_running, hmlenu(aggregates));
+  for (size_t i = 0; i < hmlenu(aggregates); i++) {
+    live_totals[i] = aggregates[i].value.total.nanoseconds_spent;
+    live_running[i] = 0;
+  }
+
+  for (size_t i = 0; i < hmlenu(tgids); i++) {
+    ptrdiff_t index = hmgeti(aggregates, aggregate_key_of(&tgids[i].value));
+    if (index >= 0 && now_ns > tgids[i].value.start_time_ns) {
+      live_totals[index] += now_ns - tgids[i].value.start_time_ns;
+      live_running[index]++;
+    }
+  }
+}
+
+void answer_top(stats_client_t* client, size_t limit) {
+  collect_live_totals();
+
+  arrsetlen(live_order, hmlenu(aggregates));
+  for (size_t i = 0; i < hmlenu(aggregates); i++) {
+    live_order[i] = i;
+  }
+  qsort(live_order, arrlenu(live_order), sizeof(live_order[0]), compare_live_totals);
+
+  for (size_t i = 0; i < arrlenu(live_order) && i < limit; i++) {
+    aggregate_item_t* item = &aggregates[live_order[i]];
+    stats_printf(client, "%" PRIu64 "\t%u\t%s\t%s\t%s\n",
+                 live_totals[live_order[i]], live_running[live_order[i]],
+                 username_by_uid(item->key.uid), executable_paths[item->key.executable_id],
+                 cgroup_paths[item->key.cgroup_id]);
+  }
+}
+
+void answer_executable(stats_client_t* client, char* executable_path) {
+  if (executable_ids == NULL || shgeti(executable_ids, executable_path) < 0) {
+    return;
+  }
+
+  uint32_t executable_id = shget(executable_ids, executable_path);
+  collect_live_totals();
+
+  for (size_t i = 0; i < hmlenu(aggregates); i++) {
+    if (aggregates[i].key.executable_id == executable_id) {
+      stats_printf(client, "%" PRIu64 "\t%u\t%s\t%s\n",
+                   live_totals[i], live_running[i], username_by_uid(aggregates[i].key.uid),
+                   cgroup_paths[aggregates[i].key.cgroup_id]);
+    }
+  }
+}
+
+void answer_live(stats_client_t* client) {
+  uint64_t now_ns = monotonic_now_ns();
+
+  for (size_t i = 0; i < hmlenu(tgids); i++) {
+    process_info_t* info = &tgids[i].value;
+    stats_printf(client, "%d\t%" PRIu64 "\t%s\t%s\n",
+                 tgids[i].key, now_ns > info->start_time_ns ? now_ns - info->start_time_ns : 0,
+                 username_by_uid(info->uid), executable_paths[info->executable_id]);
+  }
+}
+
+void answer_stats(stats_client_t* client) {
+  stats_printf(client, "tracked_processes\t%zu\n", hmlenu(tgids));
+  stats_printf(client, "executables\t%zu\n", arrlenu(executable_paths) - arrlenu(free_executable_ids));
+  stats_printf(client, "aggregates\t%zu\n", hmlenu(aggregates));
+  stats_printf(client, "pending_aggregates\t%zu\n", arrlenu(dirty_aggregates));
+  stats_printf(client, "clients\t%zu\n", stats_clients_count);
+  for (size_t i = 0; i < EVENT_KINDS_COUNT; i++) {
+    stats_printf(client, "events_%s\t%" PRIu64 "\n", event_kind_names[i], collector_stats.events[i]);
+  }
+  stats_printf(client, "sequence_gaps\t%" PRIu64 "\n", collector_stats.sequence_gaps);
+  stats_printf(client, "receive_overruns\t%" PRIu64 "\n", collector_stats.receive_overruns);
+  stats_printf(client, "proc_lookup_failures\t%" PRIu64 "\n", collector_stats.proc_lookup_failures);
+  stats_printf(client, "excluded_execs\t%" PRIu64 "\n", collector_stats.excluded_execs);
+  stats_printf(client, "sketch_evictions\t%" PRIu64 "\n", collector_stats.sketch_evictions);
+  stats_printf(client, "process_tree_nodes\t%zu\n", hmlenu(forest));
+  stats_printf(client, "sampling_rate\t1/%u\n", 1U << sampling_shift);
+  stats_printf(client, "sampled_out_execs\t%" PRIu64 "\n", collector_stats.sampled_out_execs);
+  stats_printf(client, "evicted_processes\t%" PRIu64 "\n", collector_stats.evicted_processes);
+  stats_printf(client, "swept_processes\t%" PRIu64 "\n", collector_stats.swept_processes);
+  stats_printf(client, "process_table_full_execs\t%" PRIu64 "\n", collector_stats.process_table_full_execs);
+  stats_printf(client, "process_table_peak\t%zu\n", collector_stats.process_table_peak);
+  stats_printf(client, "flushes\t%" PRIu64 "\n", collector_stats.flushes);
+  if (export_address != NULL) {
+    stats_printf(client, "export_batches\t%" PRIu64 "\n", export_stats.batches);
+    stats_printf(client, "export_acked_batches\t%" PRIu64 "\n", export_stats.acked_batches);
+    stats_printf(client, "export_dropped_batches\t%" PRIu64 "\n", export_stats.dropped_batches);
+    stats_printf(client, "export_rejected_batches\t%" PRIu64 "\n", export_stats.rejected_batches);
+    stats_printf(client, "export_queued_bytes\t%zu\n", export_queued_bytes);
+    stats_printf(client, "export_sent_bytes\t%" PRIu64 "\n", export_stats.sent_bytes);
+    stats_printf(client, "export_connects\t%" PRIu64 "\n", export_stats.connects);
+  }
+}
+
+void answer_latency(stats_client_t* client) {
+  for (size_t i = 0; i < LATENCY_KINDS_COUNT; i++) {
+    latency_t* latency = &latencies[i];
+    stats_printf(client, "%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+                 latency_kind_names[i], latency->count, latency->count > 0 ? latency->sum_ns / latency->count : 0,
+                 latency_percentile(i, 50), latency_percentile(i, 90), latency_percentile(i, 99), latency->max_ns);
+  }
+}
+
+// SIGUSR1 prints what `stats` and `latency` would answer
+void dump_self_metrics() {
+  stats_client_t dump = {};
+  answer_stats(&dump);
+  stats_printf(&dump, "\n");
+  answer_latency(&dump);
+
+  fwrite(dump.response, 1, arrlenu(dump.response), stderr);
+  fflush(stderr);
+  arrfree(dump.response);
+}
+
+// one request per line, every response is a run of tab separated lines closed by an empty one:
+//   top [N]      <ns>  <running>  <user>  <executable> for the N (default 10) busiest aggregates
+//   exe <path>   <ns>  <running>  <user>                for every user of one executable
+//   live         <tgid>  <ns>  <user>  <executable>     for every running process
+//   stats        <name>  <value>                        about the collector itself
+//   latency      <stage>  <count>  <mean>  <p50>  <p90>  <p99>  <max>, in nanoseconds
+void answer_request(stats_client_t* client, char* request) {
+  char* argument = strchr(request, ' ');
+  if (argument != NULL) {
+    *argument++ = 0;
+  }
+
+  if (strcmp(request, "top") == 0) {
+    answer_top(client, argument != NULL && atoi(argument) > 0 ? (size_t) atoi(argument) : 10);
+  } else if (strcmp(request, "exe") == 0 && argument != NULL) {
+    answer_executable(client, argument);
+  } else if (strcmp(request, "live") == 0) {
+    answer_live(client);
+  } else if (strcmp(request, "stats") == 0) {
+    answer_stats(client);
+  } else if (strcmp(request, "latency") == 0) {
+    answer_latency(client);
+  } else {
+    stats_printf(client, "error\tunknown request\n");
+  }
+
+  stats_printf(client, "\n");
+}
+
+// returns false once the client is gone
+bool send_response(stats_client_t* client) {
+  while (client->response_sent < arrlenu(client->response)) {
+    ssize_t sent = send(client->source.fd, client->response + client->response_sent,
+                        arrlenu(client->response) - client->response_sent, MSG_NOSIGNAL);
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!client->sending) {
+        rewatch(&client->source, EPOLLOUT);
+        client->sending = true;
+      }
+      return true;
+    }
+    if (sent == -1) {
+      return false;
+    }
+
+    client->response_sent += sent;
+  }
+
+  arrdeln(client->response, 0, arrlen(client->response));
+  client->response_sent = 0;
+  if (client->sending) {
+    rewatch(&client->source, EPOLLIN);
+    client->sending = false;
+  }
+  return true;
+}
+
+void handle_stats_client(event_source_t* source, uint32_t events) {
+  stats_client_t* client = (stats_client_t*) source;
+
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    close_stats_client(client);
+    return;
+  }
+
+  if ((events & EPOLLOUT) && !send_response(client)) {
+    close_stats_client(client);
+    return;
+  }
+
+  // a client that does not read its responses gets no new ones until it catches up
+  if (!(events & EPOLLIN) || arrlenu(client->response) > 0) {
+    return;
+  }
+
+  ssize_t received = recv(source->fd, client->request + client->request_len,
+                          STATS_REQUEST_MAX - client->request_len, 0);
+  if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (received <= 0) {
+    close_stats_client(client);
+    return;
+  }
+  client->request_len += received;
+
+  char* line = client->request;
+  char* newline = NULL;
+  while ((newline = memchr(line, '\n', client->request + client->request_len - line)) != NULL) {
+    *newline = 0;
+    if (newline > line && newline[-1] == '\r') {
+      newline[-1] = 0;
+    }
+
+    answer_request(client, line);
+    line = newline + 1;
+  }
+
+  client->request_len -= line - client->request;
+  memmove(client->request, line, client->request_len);
+
+  if (client->request_len == STATS_REQUEST_MAX || !send_response(client)) {
+    close_stats_client(client);
+  }
+}
+
+void accept_stats_clients(event_source_t* source, uint32_t events) {
+  (void) events;
+
+  int client_fd = -1;
+  while ((client_fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    stats_client_t* client = calloc(1, sizeof(*client));
+    assert(client != NULL);
+
+    client->source.fd = client_fd;
+    client->source.handle = handle_stats_client;
+    stats_clients_count++;
+
+    watch(&client->source, EPOLLIN);
+  }
+}
+
+event_source_t stats_source = {
+  .fd = -1,
+  .handle = accept_stats_clients,
+};
+
+int listen_unix(char* path) {
+  struct sockaddr_un address = {
+    .sun_family = AF_UNIX,
+  };
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "ERROR: socket path %s is too long\n", path);
+    code = 1;
+    destruct();
+  }
+  strcpy(address.sun_path, path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    FAIL("socket");
+  }
+
+  // a socket left behind by an instance that did not shut down cleanly
+  unlink(path);
+
+  if (bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1) {
+    FAIL("bind");
+  }
+
+  if (listen(listener, SOMAXCONN) == -1) {
+    FAIL("listen");
+  }
+
+  return listener;
+}
+
+// `host:port`, the host may be empty to listen on every address
+int listen_tcp(char* host_and_port) {
+  static char host[256] = {};
+  char* port = strrchr(host_and_port, ':');
+  if (port == NULL || (size_t) (port - host_and_port) >= sizeof(host)) {
+    fprintf(stderr, "ERROR: %s is not a host:port address\n", host_and_port);
+    code = 1;
+    destruct();
+  }
+  snprintf(host, sizeof(host), "%.*s", (int) (port - host_and_port), host_and_port);
+
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags = AI_PASSIVE,
+  };
+  struct addrinfo* addresses = NULL;
+
+  int rc = getaddrinfo(host[0] != 0 ? host : NULL, port + 1, &hints, &addresses);
+  if (rc != 0) {
+    fprintf(stderr, "ERROR: failed to resolve %s: %s\n", host_and_port, gai_strerror(rc));
+    code = 1;
+    destruct();
+  }
+
+  int listener = socket(addresses->ai_family, addresses->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    FAIL("socket");
+  }
+
+  int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  if (bind(listener, addresses->ai_addr, addresses->ai_addrlen) == -1) {
+    FAIL("bind");
+  }
+
+  freeaddrinfo(addresses);
+
+  if (listen(listener, SOMAXCONN) == -1) {
+    FAIL("listen");
+  }
+
+  return listener;
+}
+
+void start_stats_server(char* path) {
+  stats_source.fd = listen_unix(path);
+  stats_socket_path = path;
+
+  watch(&stats_source, EPOLLIN);
+
+  printf("LOG: serving live stats on %s\n", path);
+}
+
+void stop_stats_server() {
+  if (stats_source.fd != -1) {
+    close(stats_source.fd);
+    stats_source.fd = -1;
+  }
+
+  if (stats_socket_path != NULL) {
+    unlink(stats_socket_path);
+    stats_socket_path = NULL;
+  }
+}
+
+#define METRICS_BUFFER_SIZE (32 * 1024)
+#define METRICS_CHUNKS_PER_WAKEUP 4
+
+typedef enum {
+  METRICS_READING_REQUEST,
+  METRICS_COLLECTOR,
+  METRICS_EXECUTABLES,
+  METRICS_DONE,
+} metrics_phase_t;
+
+typedef struct {
+  event_source_t source;
+  metrics_phase_t phase;
+  // the aggregates there were when the scrape started. the table is compacted as aggregates are evicted
+  // in between chunks, so they are looked up again by key
+  aggregate_key_t* keys;
+  size_t cursor;
+  char buffer[METRICS_BUFFER_SIZE];
+  size_t buffer_len;
+  size_t buffer_sent;
+} metrics_client_t;
+
+char* metrics_address = NULL;
+bool metrics_address_is_unix = false;
+
+// appends all of it or nothing, so a series never gets cut in half between two chunks
+bool metrics_printf(metrics_client_t* client, char* format, ...) {
+  va_list arguments;
+  va_start(arguments, format);
+  size_t space = METRICS_BUFFER_SIZE - client->buffer_len;
+  int len = vsnprintf(client->buffer + client->buffer_len, space, format, arguments);
+  va_end(arguments);
+
+  if (len < 0 || (size_t) len >= space) {
+    return false;
+  }
+
+  client->buffer_len += len;
+  return true;
+}
+
+#define ESCAPED_LABEL_MAX (2 * PATH_MAX + 1)
+
+char* escape_label(char* value, char escaped[ESCAPED_LABEL_MAX]) {
+  size_t escaped_len = 0;
+
+  for (char* c = value; *c != 0 && escaped_len < ESCAPED_LABEL_MAX - 2; c++) {
+    if (*c == '\\' || *c == '"' || *c == '\n') {
+      escaped[escaped_len++] = '\\';
+    }
+    escaped[escaped_len++] = *c == '\n' ? 'n' : *c;
+  }
+
+  escaped[escaped_len] = 0;
+  return escaped;
+}
+
+void render_collector_metrics(metrics_client_t* client) {
+  metrics_printf(client,
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                 "Connection: close\r\n"
+                 "\r\n");
+
+  metrics_printf(client,
+                 "# HELP spycy_events_total Process events received from the kernel.\n"
+                 "# TYPE spycy_events_total counter\n");
+  for (size_t i = 0; i < EVENT_KINDS_COUNT; i++) {
+    metrics_printf(client, "spycy_events_total{type=\"%s\"} %" PRIu64 "\n",
+                   event_kind_names[i], collector_stats.events[i]);
+  }
+
+  metrics_printf(client,
+                 "# HELP spycy_event_sequence_gaps_total Times a message arrived out of order on a cpu.\n"
+                 "# TYPE spycy_event_sequence_gaps_total counter\n"
+                 "spycy_event_sequence_gaps_total %" PRIu64 "\n"
+                 "# HELP spycy_receive_overruns_total Times the kernel dropped events because the socket buffer was full.\n"
+                 "# TYPE spycy_receive_overruns_total counter\n"
+                 "spycy_receive_overruns_total %" PRIu64 "\n"
+                 "# HELP spycy_proc_lookup_failures_total Executed processes that could not be resolved through /proc.\n"
+                 "# TYPE spycy_proc_lookup_failures_total counter\n"
+                 "spycy_proc_lookup_failures_total %" PRIu64 "\n"
+                 "# HELP spycy_excluded_execs_total Executed processes the rules told us not to track.\n"
+                 "# TYPE spycy_excluded_execs_total counter\n"
+                 "spycy_excluded_execs_total %" PRIu64 "\n"
+                 "# HELP spycy_sketch_evictions_total Executables --top-k folded into their directory.\n"
+                 "# TYPE spycy_sketch_evictions_total counter\n"
+                 "spycy_sketch_evictions_total %" PRIu64 "\n"
+                 "# HELP spycy_sampling_ratio Share of executed processes being tracked, below 1 under --sample-above.\n"
+                 "# TYPE spycy_sampling_ratio gauge\n"
+                 "spycy_sampling_ratio %.6f\n"
+                 "# HELP spycy_sampled_out_execs_total Executed processes skipped while sampling.\n"
+                 "# TYPE spycy_sampled_out_execs_total counter\n"
+                 "spycy_sampled_out_execs_total %" PRIu64 "\n"
+                 "# HELP spycy_evicted_processes_total Tracked processes found dead without an exit event, see --max-processes.\n"
+                 "# TYPE spycy_evicted_processes_total counter\n"
+                 "spycy_evicted_processes_total %" PRIu64 "\n"
+                 "# HELP spycy_swept_processes_total Tracked processes checked for a missed exit on a tick.\n"
+                 "# TYPE spycy_swept_processes_total counter\n"
+                 "spycy_swept_processes_total %" PRIu64 "\n"
+                 "# HELP spycy_process_table_full_execs_total Executed processes not tracked because the process table was full.\n"
+                 "# TYPE spycy_process_table_full_execs_total counter\n"
+                 "spycy_process_table_full_execs_total %" PRIu64 "\n"
+                 "# HELP spycy_process_table_peak Most running processes tracked at once.\n"
+                 "# TYPE spycy_process_table_peak gauge\n"
+                 "spycy_process_table_peak %zu\n"
+                 "# HELP spycy_flush_duration_seconds Time spent writing aggregates to the database.\n"
+                 "# TYPE spycy_flush_duration_seconds summary\n"
+                 "spycy_flush_duration_seconds_sum %.9f\n"
+                 "spycy_flush_duration_seconds_count %" PRIu64 "\n"
+                 "# HELP spycy_flushed_aggregates_total Aggregates written to the database.\n"
+                 "# TYPE spycy_flushed_aggregates_total counter\n"
+                 "spycy_flushed_aggregates_total %" PRIu64 "\n"
+                 "# HELP spycy_tracked_processes Running processes being timed.\n"
+                 "# TYPE spycy_tracked_processes gauge\n"
+                 "spycy_tracked_processes %zu\n"
+                 "# HELP spycy_executables Distinct executables seen since startup.\n"
+                 "# TYPE spycy_executables gauge\n"
+                 "spycy_executables %zu\n"
+                 "# HELP spycy_aggregates Distinct (executable, user) pairs kept in memory.\n"
+                 "# TYPE spycy_aggregates gauge\n"
+                 "spycy_aggregates %zu\n"
+                 "# HELP spycy_taskstats_overruns_total Times the kernel dropped taskstats because the socket buffer was full.\n"
+                 "# TYPE spycy_taskstats_overruns_total counter\n"
+                 "spycy_taskstats_overruns_total %" PRIu64 "\n"
+                 "# HELP spycy_executable_seconds_total Wall clock time finished processes ran for.\n"
+                 "# TYPE spycy_executable_seconds_total counter\n"
+                 "# HELP spycy_executable_cpu_seconds_total CPU time finished processes used, from taskstats.\n"
+                 "# TYPE spycy_executable_cpu_seconds_total counter\n"
+                 "# HELP spycy_executable_executions_total Processes of the executable that finished.\n"
+                 "# TYPE spycy_executable_executions_total counter\n"
+                 "# HELP spycy_executable_inclusive_seconds_total Wall clock time of finished processes and their descendants.\n"
+                 "# TYPE spycy_executable_inclusive_seconds_total counter\n",
+                 collector_stats.sequence_gaps,
+                 collector_stats.receive_overruns,
+                 collector_stats.proc_lookup_failures,
+                 collector_stats.excluded_execs,
+                 collector_stats.sketch_evictions,
+                 1.0 / (1U << sampling_shift),
+                 collector_stats.sampled_out_execs,
+                 collector_stats.evicted_processes,
+                 collector_stats.swept_processes,
+                 collector_stats.process_table_full_execs,
+                 collector_stats.process_table_peak,
+                 collector_stats.flush_ns / 1e9,
+                 collector_stats.flushes,
+                 collector_stats.flushed_aggregates,
+                 hmlenu(tgids),
+                 arrlenu(executable_paths) - arrlenu(free_executable_ids),
+                 hmlenu(aggregates),
+                 collector_stats.taskstats_overruns);
+
+  if (export_address != NULL) {
+    metrics_printf(client,
+                   "# HELP spycy_export_batches_total Batches sealed for the aggregator.\n"
+                   "# TYPE spycy_export_batches_total counter\n"
+                   "spycy_export_batches_total %" PRIu64 "\n"
+                   "# HELP spycy_export_acked_batches_total Batches the aggregator acknowledged.\n"
+                   "# TYPE spycy_export_acked_batches_total counter\n"
+                   "spycy_export_acked_batches_total %" PRIu64 "\n"
+                   "# HELP spycy_export_dropped_batches_total Unacknowledged batches dropped because the queue was full, their usage never reaches the aggregator.\n"
+                   "# TYPE spycy_export_dropped_batches_total counter\n"
+                   "spycy_export_dropped_batches_total %" PRIu64 "\n"
+                   "# HELP spycy_export_rejected_batches_total Batches dropped because the aggregator could not read them.\n"
+                   "# TYPE spycy_export_rejected_batches_total counter\n"
+                   "spycy_export_rejected_batches_total %" PRIu64 "\n"
+                   "# HELP spycy_export_queued_bytes Bytes of batches waiting for an acknowledgement.\n"
+                   "# TYPE spycy_export_queued_bytes gauge\n"
+                   "spycy_export_queued_bytes %zu\n",
+                   export_stats.batches,
+                   export_stats.acked_batches,
+                   export_stats.dropped_batches,
+                   export_stats.rejected_batches,
+                   export_queued_bytes);
+  }
+
+  metrics_printf(client,
+                 "# HELP spycy_latency_seconds Time spycy spends per event, per /proc lookup and per flush, and how far behind the kernel it is.\n"
+                 "# TYPE spycy_latency_seconds summary\n");
+  for (size_t i = 0; i < LATENCY_KINDS_COUNT; i++) {
+    metrics_printf(client,
+                   "spycy_latency_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n"
+                   "spycy_latency_seconds{stage=\"%s\",quantile=\"0.9\"} %.9f\n"
+                   "spycy_latency_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n"
+                   "spycy_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                   "spycy_latency_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+                   latency_kind_names[i], latency_percentile(i, 50) / 1e9,
+                   latency_kind_names[i], latency_percentile(i, 90) / 1e9,
+                   latency_kind_names[i], latency_percentile(i, 99) / 1e9,
+                   latency_kind_names[i], latencies[i].sum_ns / 1e9,
+                   latency_kind_names[i], latencies[i].count);
+  }
+}
+
+// fills the buffer with as many series as fit, picking up where the previous chunk stopped
+void render_metrics(metrics_client_t* client) {
+  if (client->phase == METRICS_COLLECTOR) {
+    render_collector_metrics(client);
+    client->phase = METRICS_EXECUTABLES;
+    client->cursor = 0;
+
+    for (size_t i = 0; i < hmlenu(aggregates); i++) {
+      if (aggregates[i].value.total.nanoseconds_spent > 0) {
+        arrput(client->keys, aggregates[i].key);
+      }
+    }
+  }
+
+  if (client->phase != METRICS_EXECUTABLES) {
+    return;
+  }
+
+  static char executable[ESCAPED_LABEL_MAX] = {};
+  static char user[ESCAPED_LABEL_MAX] = {};
+  static char cgroup[ESCAPED_LABEL_MAX] = {};
+
+  for (; client->cursor < arrlenu(client->keys); client->cursor++) {
+    aggregate_item_t* item = hmgetp_null(aggregates, client->keys[client->cursor]);
+    if (item == NULL) {
+      continue;
+    }
+
+    escape_label(executable_paths[item->key.executable_id], executable);
+    escape_label(username_by_uid(item->key.uid), user);
+    escape_label(cgroup_paths[item->key.cgroup_id], cgroup);
+
+    if (!metrics_printf(client,
+                        "spycy_executable_seconds_total{executable=\"%s\",user=\"%s\",cgroup=\"%s\"} %.9f\n"
+                        "spycy_executable_cpu_seconds_total{executable=\"%s\",user=\"%s\",cgroup=\"%s\",mode=\"user\"} %.9f\n"
+                        "spycy_executable_cpu_seconds_total{executable=\"%s\",user=\"%s\",cgroup=\"%s\",mode=\"system\"} %.9f\n"
+                        "spycy_executable_executions_total{executable=\"%s\",user=\"%s\",cgroup=\"%s\"} %" PRIu64 "\n"
+                        "spycy_executable_inclusive_seconds_total{executable=\"%s\",user=\"%s\",cgroup=\"%s\"} %.9f\n",
+                        executable, user, cgroup, item->value.total.nanoseconds_spent / 1e9,
+                        executable, user, cgroup, item->value.total.cpu_user_ns / 1e9,
+                        executable, user, cgroup, item->value.total.cpu_system_ns / 1e9,
+                        executable, user, cgroup, item->value.total.executions,
+                        executable, user, cgroup, item->value.total.inclusive_ns / 1e9)) {
+      return;
+    }
+  }
+
+  client->phase = METRICS_DONE;
+}
+
+void close_metrics_client(metrics_client_t* client) {
+  close(client->source.fd);
+  arrfree(client->keys);
+  free(client);
+}
+
+void handle_metrics_client(event_source_t* source, uint32_t events) {
+  metrics_client_t* client = (metrics_client_t*) source;
+
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    close_metrics_client(client);
+    return;
+  }
+
+  if (client->phase == METRICS_READING_REQUEST) {
+    ssize_t received = recv(source->fd, client->buffer + client->buffer_len,
+                            METRICS_BUFFER_SIZE - client->buffer_len - 1, 0);
+    if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (received <= 0) {
+      close_metrics_client(client);
+      return;
+    }
+
+    client->buffer_len += received;
+    client->buffer[client->buffer_len] = 0;
+
+    if (strstr(client->buffer, "\r\n\r\n") == NULL && strstr(client->buffer, "\n\n") == NULL) {
+      if (client->buffer_len == METRICS_BUFFER_SIZE - 1) {
+        close_metrics_client(client);
+      }
+      return;
+    }
+
+    bool wants_metrics = strncmp(client->buffer, "GET /metrics ", strlen("GET /metrics ")) == 0 ||
+                         strncmp(client->buffer, "GET / ", strlen("GET / ")) == 0;
+
+    client->buffer_len = 0;
+    client->phase = METRICS_COLLECTOR;
+
+    if (!wants_metrics) {
+      metrics_printf(client, "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n");
+      client->phase = METRICS_DONE;
+    }
+  }
+
+  // a big exposition goes out over several wakeups so events keep being processed in between
+  for (int chunk = 0; chunk < METRICS_CHUNKS_PER_WAKEUP; chunk++) {
+    if (client->buffer_sent == client->buffer_len) {
+      client->buffer_len = 0;
+      client->buffer_sent = 0;
+
+      if (client->phase == METRICS_DONE) {
+        close_metrics_client(client);
+        return;
+      }
+
+      render_metrics(client);
+    }
+
+    while (client->buffer_sent < client->buffer_len) {
+      ssize_t sent = send(source->fd, client->buffer + client->buffer_sent,
+                          client->buffer_len - client->buffer_sent, MSG_NOSIGNAL);
+      if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        rewatch(source, EPOLLOUT);
+        return;
+      }
+      if (sent == -1) {
+        close_metrics_client(client);
+        return;
+      }
+
+      client->buffer_sent += sent;
+    }
+  }
+
+  rewatch(source, EPOLLOUT);
+}
+
+void accept_metrics_clients(event_source_t* source, uint32_t events) {
+  (void) events;
+
+  int client_fd = -1;
+  while ((client_fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    metrics_client_t* client = calloc(1, sizeof(*client));
+    assert(client != NULL);
+
+    client->source.fd = client_fd;
+    client->source.handle = handle_metrics_client;
+
+    watch(&client->source, EPOLLIN);
+  }
+}
+
+event_source_t metrics_source = {
+  .fd = -1,
+  .handle = accept_metrics_clients,
+};
+
+// a path serves metrics over a unix socket, anything else is taken as host:port
+void start_metrics_server(char* address) {
+  metrics_address_is_unix = strchr(address, '/') != NULL;
+  metrics_source.fd = metrics_address_is_unix ? listen_unix(address) : listen_tcp(address);
+  metrics_address = address;
+
+  watch(&metrics_source, EPOLLIN);
+
+  printf("LOG: serving metrics on %s\n", address);
+}
+
+void stop_metrics_server() {
+  if (metrics_source.fd != -1) {
+    close(metrics_source.fd);
+    metrics_source.fd = -1;
+  }
+
+  if (metrics_address != NULL && metrics_address_is_unix) {
+    unlink(metrics_address);
+  }
+  metrics_address = NULL;
+}
+
+// --handoff=PATH: a new spycy started with the same PATH takes over from the running one. the old one
+// flushes, passes its netlink sockets over PATH and sends every tracked process along; events keep
+// queueing in the sockets meanwhile, so the new one carries on where the old one stopped reading,
+// without a gap and without charging anything twice
+#define HANDOFF_VERSION 3
+#define HANDOFF_ACK_TIMEOUT_SECONDS 10
+
+// both ends are spycy on the same machine, so the structs go over as they are. any change to them or
+// to process_info_t, usage_t and tree_node_t has to bump the version
+typedef struct {
+  uint32_t version;
+  uint32_t processes_count;
+  uint32_t tree_nodes_count;
+  uint32_t exited_count;
+  uint64_t last_timestamp_ns;
+  // carried on with, so a gap right at the handoff is still noticed
+  uint32_t event_seqs[EVENT_SEQS_COUNT];
+  // the processes, tree nodes and exited processes that follow the header
+  uint64_t body_len;
+} handoff_header_t;
+
+// followed by the executable and cgroup paths, ids are only meaningful to the instance that made them
+typedef struct {
+  pid_t tgid;
+  uint16_t executable_path_len;
+  uint16_t cgroup_path_len;
+  process_info_t info;
+} handoff_process_t;
+
+// the exits late taskstats are still charged to, followed by their paths like processes
+typedef struct {
+  pid_t tgid;
+  uid_t uid;
+  uint32_t weight;
+  uint16_t executable_path_len;
+  uint16_t cgroup_path_len;
+} handoff_exited_t;
+
+char* handoff_path = NULL;
+
+bool send_all(int fd, void* data, size_t len) {
+  for (size_t sent = 0; sent < len; ) {
+    ssize_t rc = send(fd, (uint8_t *) data + sent, len - sent, MSG_NOSIGNAL);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rc == -1) {
+      return false;
+    }
+    sent += rc;
+  }
+  return true;
+}
+
+bool receive_all(int fd, void* data, size_t len) {
+  for (size_t received = 0; received < len; ) {
+    ssize_t rc = recv(fd, (uint8_t *) data + received, len - received, 0);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      return false;
+    }
+    received += rc;
+  }
+  return true;
+}
+
+uint8_t* handoff_snapshot(handoff_header_t* header) {
+  uint8_t* body = NULL;
+
+  for (size_t i = 0; i < hmlenu(tgids); i++) {
+    char* executable_path = executable_paths[tgids[i].value.executable_id];
+    char* cgroup_path = cgroup_paths[tgids[i].value.cgroup_id];
+    handoff_process_t process = {
+      .tgid = tgids[i].key,
+      .executable_path_len = strlen(executable_path),
+      .cgroup_path_len = strlen(cgroup_path),
+      .info = tgids[i].value,
+    };
+
+    memcpy(arraddnptr(body, sizeof(process)), &process, sizeof(process));
+    memcpy(arraddnptr(body, process.executable_path_len), executable_path, process.executable_path_len);
+    memcpy(arraddnptr(body, process.cgroup_path_len), cgroup_path, process.cgroup_path_len);
+  }
+
+  for (size_t i = 0; i < hmlenu(forest); i++) {
+    memcpy(arraddnptr(body, sizeof(tree_item_t)), &forest[i], sizeof(tree_item_t));
+  }
+
+  uint32_t exited_count = 0;
+  for (size_t i = 0; i < EXITED_PROCESSES_COUNT; i++) {
+    exited_process_t* exited = &exited_processes[i];
+    if (exited->tgid == 0) {
+      continue;
+    }
+
+    char* executable_path = executable_paths[exited->key.executable_id];
+    char* cgroup_path = cgroup_paths[exited->key.cgroup_id];
+    handoff_exited_t record = {
+      .tgid = exited->tgid,
+      .uid = exited->key.uid,
+      .weight = exited->weight,
+      .executable_path_len = strlen(executable_path),
+      .cgroup_path_len = strlen(cgroup_path),
+    };
+
+    memcpy(arraddnptr(body, sizeof(record)), &record, sizeof(record));
+    memcpy(arraddnptr(body, record.executable_path_len), executable_path, record.executable_path_len);
+    memcpy(arraddnptr(body, record.cgroup_path_len), cgroup_path, record.cgroup_path_len);
+    exited_count++;
+  }
+
+  *header = (handoff_header_t) {
+    .version = HANDOFF_VERSION,
+    .processes_count = hmlenu(tgids),
+    .tree_nodes_count = hmlenu(forest),
+    .exited_count = exited_count,
+    .last_timestamp_ns = last_timestamp_ns,
+    .body_len = arrlenu(body),
+  };
+  memcpy(header->event_seqs, event_seqs, sizeof(event_seqs));
+  return body;
+}
+
+// the old instance's side. nothing is read from the connector while this runs, so whatever the
+// snapshot misses is still queued in the socket for the new instance
+void hand_off(int client) {
+  uint64_t start_ns = monotonic_now_ns();
+
+  // pending usage is written by us, the new instance starts with empty aggregates
+  flush_usage();
+
+  handoff_header_t header = {};
+  uint8_t* body = handoff_snapshot(&header);
+
+  int fds[2] = {connection, connection_taskstats};
+  size_t fds_count = connection_taskstats != -1 ? 2 : 1;
+  static uint8_t control[CMSG_SPACE(sizeof(fds))] = {};
+  memset(control, 0, sizeof(control));
+
+  struct iovec vector = {
+    .iov_base = &header,
+    .iov_len = sizeof(header),
+  };
+  struct msghdr message = {
+    .msg_iov = &vector,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = CMSG_SPACE(fds_count * sizeof(int)),
+  };
+
+  struct cmsghdr* rights = CMSG_FIRSTHDR(&message);
+  rights->cmsg_level = SOL_SOCKET;
+  rights->cmsg_type = SCM_RIGHTS;
+  rights->cmsg_len = CMSG_LEN(fds_count * sizeof(int));
+  memcpy(CMSG_DATA(rights), fds, fds_count * sizeof(int));
+
+  struct timeval timeout = {
+    .tv_sec = HANDOFF_ACK_TIMEOUT_SECONDS,
+  };
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // until the new instance says it has everything, we are still the one collecting
+  uint8_t ack = 0;
+  bool sent = sendmsg(client, &message, MSG_NOSIGNAL) == sizeof(header) &&
+              send_all(client, body, arrlenu(body));
+  arrfree(body);
+  if (!sent || !receive_all(client, &ack, sizeof(ack))) {
+    fprintf(stderr, "WARNING: handoff failed, carrying on: %s\n", strerror(errno));
+    close(client);
+    return;
+  }
+
+  printf("LOG: handed off %u processes in %.3f ms\n", header.processes_count,
+         (monotonic_now_ns() - start_ns) / 1e6);
+  fflush(stdout);
+
+  // the new instance waits for this connection to close, by then our sockets and the database are
+  // closed and it can take their places
+  handed_off = true;
+  handoff_client = client;
+  destruct();
+}
+
+void accept_handoff(event_source_t* source, uint32_t events) {
+  (void) events;
+
+  int client = accept4(source->fd, NULL, NULL, SOCK_CLOEXEC);
+  if (client != -1) {
+    hand_off(client);
+  }
+}
+
+event_source_t handoff_source = {
+  .fd = -1,
+  .handle = accept_handoff,
+};
+
+void start_handoff_server(char* path) {
+  handoff_source.fd = listen_unix(path);
+  handoff_path = path;
+
+  watch(&handoff_source, EPOLLIN);
+}
+
+void stop_handoff_server() {
+  if (handoff_source.fd != -1) {
+    close(handoff_source.fd);
+    handoff_source.fd = -1;
+  }
+
+  // the instance that took over is about to listen at the same path
+  if (handoff_path != NULL && !handed_off) {
+    unlink(handoff_path);
+  }
+  handoff_path = NULL;
+}
+
+// the next `len` bytes of a handoff body, NULL when the body is shorter than its header says
+uint8_t* take_handoff_bytes(uint8_t* body, uint64_t body_len, size_t* offset, size_t len) {
+  if (body_len - *offset < len) {
+    return NULL;
+  }
+
+  uint8_t* bytes = body + *offset;
+  *offset += len;
+  return bytes;
+}
+
+bool take_handoff_path(uint8_t* body, uint64_t body_len, size_t* offset, size_t len, char path[PATH_MAX]) {
+  uint8_t* bytes = take_handoff_bytes(body, body_len, offset, len);
+  if (bytes == NULL || len >= PATH_MAX) {
+    return false;
+  }
+
+  memcpy(path, bytes, len);
+  path[len] = 0;
+  return true;
+}
+
+// the new instance's side, false when there is nobody to take over from
+bool take_over(char* path) {
+  struct sockaddr_un address = {
+    .sun_family = AF_UNIX,
+  };
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+  int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server == -1) {
+    perror("ERROR: socket");
+    exit(1);
+  }
+
+  // no socket or a stale one: the first start, or the last instance did not stop cleanly
+  if (connect(server, (struct sockaddr *) &address, sizeof(address)) == -1) {
+    close(server);
+    return false;
+  }
+
+  // an old instance that hangs does not get to hold us up forever
+  struct timeval timeout = {
+    .tv_sec = HANDOFF_ACK_TIMEOUT_SECONDS,
+  };
+  setsockopt(server, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  uint64_t start_ns = monotonic_now_ns();
+
+  handoff_header_t header = {};
+  static uint8_t control[CMSG_SPACE(2 * sizeof(int))] = {};
+  struct iovec vector = {
+    .iov_base = &header,
+    .iov_len = sizeof(header),
+  };
+  struct msghdr message = {
+    .msg_iov = &vector,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+
+  ssize_t received = recvmsg(server, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  struct cmsghdr* rights = CMSG_FIRSTHDR(&message);
+  if (received != sizeof(header) || rights == NULL || rights->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "ERROR: no handoff from the instance at %s\n", path);
+    exit(1);
+  }
+
+  int fds[2] = {-1, -1};
+  memcpy(fds, CMSG_DATA(rights), rights->cmsg_len - CMSG_LEN(0));
+
+  // the old instance keeps running when we do not ack, so does not running along with it
+  if (header.version != HANDOFF_VERSION) {
+    fprintf(stderr, "ERROR: the instance at %s hands off version %u, we take version %u\n",
+            path, header.version, HANDOFF_VERSION);
+    exit(1);
+  }
+
+  uint8_t* body = malloc(header.body_len);
+  if (body == NULL && header.body_len > 0) {
+    perror("ERROR: malloc");
+    exit(1);
+  }
+  if (!receive_all(server, body, header.body_len)) {
+    fprintf(stderr, "ERROR: handoff from %s was cut short\n", path);
+    exit(1);
+  }
+
+  static char executable_path[PATH_MAX] = {};
+  static char cgroup_path[PATH_MAX] = {};
+  size_t offset = 0;
+  bool valid = true;
+  for (uint32_t i = 0; i < header.processes_count && valid; i++) {
+    handoff_process_t process = {};
+    uint8_t* bytes = take_handoff_bytes(body, header.body_len, &offset, sizeof(process));
+    if (bytes != NULL) {
+      memcpy(&process, bytes, sizeof(process));
+    }
+    valid = bytes != NULL &&
+            take_handoff_path(body, header.body_len, &offset, process.executable_path_len, executable_path) &&
+            take_handoff_path(body, header.body_len, &offset, process.cgroup_path_len, cgroup_path);
+
+    if (valid) {
+      track_process(process.tgid, &process.info, executable_path, cgroup_path);
+    }
+  }
+
+  for (uint32_t i = 0; i < header.tree_nodes_count && valid; i++) {
+    tree_item_t item = {};
+    uint8_t* bytes = take_handoff_bytes(body, header.body_len, &offset, sizeof(item));
+    if ((valid = bytes != NULL)) {
+      memcpy(&item, bytes, sizeof(item));
+      hmputs(forest, item);
+    }
+  }
+
+  for (uint32_t i = 0; i < header.exited_count && valid; i++) {
+    handoff_exited_t record = {};
+    uint8_t* bytes = take_handoff_bytes(body, header.body_len, &offset, sizeof(record));
+    if (bytes != NULL) {
+      memcpy(&record, bytes, sizeof(record));
+    }
+    valid = bytes != NULL &&
+            take_handoff_path(body, header.body_len, &offset, record.executable_path_len, executable_path) &&
+            take_handoff_path(body, header.body_len, &offset, record.cgroup_path_len, cgroup_path);
+
+    // with --top-k an executable nobody runs anymore is not worth a counter, its late taskstats go
+    ptrdiff_t index = valid && top_k > 0 && executable_ids != NULL ? shgeti(executable_ids, executable_path) : -1;
+    if (valid && (top_k == 0 || index >= 0)) {
+      exited_processes[record.tgid % EXITED_PROCESSES_COUNT] = (exited_process_t) {
+        .tgid = record.tgid,
+        .key = {
+          .executable_id = top_k == 0 ? intern_executable(executable_path) : executable_ids[index].value,
+          .uid = record.uid,
+          .cgroup_id = intern_cgroup(cgroup_path),
+        },
+        .weight = record.weight,
+      };
+    }
+  }
+  free(body);
+
+  // the old instance carries on when we do not ack
+  if (!valid || offset != header.body_len) {
+    fprintf(stderr, "ERROR: handoff from %s is malformed\n", path);
+    exit(1);
+  }
+
+  connection = fds[0];
+  connection_taskstats = fds[1];
+  last_timestamp_ns = header.last_timestamp_ns;
+  memcpy(event_seqs, header.event_seqs, sizeof(event_seqs));
+
+  // from here on the old instance stops for good, its connection closes once it has
+  uint8_t ack = 1;
+  uint8_t rest = 0;
+  if (!send_all(server, &ack, sizeof(ack))) {
+    perror("ERROR: send");
+    exit(1);
+  }
+  ssize_t rc = 0;
+  while ((rc = recv(server, &rest, sizeof(rest), 0)) > 0 || (rc == -1 && errno == EINTR)) {
+  }
+  if (rc == -1) {
+    fprintf(stderr, "WARNING: the instance at %s did not stop in time, carrying on: %s\n", path, strerror(errno));
+  }
+  close(server);
+
+  printf("LOG: took over %u processes from %s in %.3f ms\n", header.processes_count, path,
+         (monotonic_now_ns() - start_ns) / 1e6);
+  return true;
+}
+
+// --snapshot=PATH: on a clean shutdown the processes still running are written to PATH instead of
+// being charged up to then, and the next start carries on timing the ones that are still there.
+// every process comes with its /proc start time, a different process that got the pid in between
+// has another one
+#define SNAPSHOT_MAGIC "spycysnp"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_THREADS 16
+#define SNAPSHOT_PROCESSES_PER_THREAD 256
+
+// followed by the executable and cgroup path tables, each path a uint16_t length and the bytes, and
+// then the processes. like the handoff, the structs are written as they are and a change to them
+// bumps the version
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t processes_count;
+  uint32_t executables_count;
+  uint32_t cgroups_count;
+  // timestamps and start ticks only mean something within the boot they were taken in
+  char boot_id[40];
+  uint64_t saved_ns;
+} snapshot_header_t;
+
+typedef struct {
+  pid_t tgid;
+  uid_t uid;
+  // indexes into the path tables above
+  uint32_t executable;
+  uint32_t cgroup;
+  uint32_t weight;
+  uint64_t start_time_ns;
+  uint64_t start_ticks;
+  // what taskstats reported for threads that already exited
+  usage_t usage;
+} snapshot_process_t;
+
+typedef struct {
+  snapshot_process_t* processes;
+  size_t first;
+  size_t last;
+  bool* alive;
+} snapshot_check_t;
+
+bool read_boot_id(char boot_id[40]) {
+  memset(boot_id, 0, 40);
+
+  FILE* file = fopen("/proc/sys/kernel/random/boot_id", "re");
+  if (file == NULL) {
+    return false;
+  }
+
+  bool read = fgets(boot_id, 40, file) != NULL;
+  fclose(file);
+  boot_id[strcspn(boot_id, "\n")] = 0;
+  return read;
+}
+
+void put_snapshot_paths(uint8_t** out, char** paths) {
+  for (size_t i = 0; i < arrlenu(paths); i++) {
+    // ids of released executables are empty
+    uint16_t len = paths[i] != NULL ? strlen(paths[i]) : 0;
+    memcpy(arraddnptr(*out, sizeof(len)), &len, sizeof(len));
+    memcpy(arraddnptr(*out, len), paths[i], len);
+  }
+}
+
+// writes the processes that are still running and stops tracking them, the dead ones are left for
+// destruct to charge
+void save_snapshot(char* path) {
+  if (hmlenu(tgids) == 0) {
+    return;
+  }
+
+  snapshot_header_t header = {
+    .version = SNAPSHOT_VERSION,
+    .executables_count = arrlenu(executable_paths),
+    .cgroups_count = arrlenu(cgroup_paths),
+    .saved_ns = monotonic_now_ns(),
+  };
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  if (!read_boot_id(header.boot_id)) {
+    fprintf(stderr, "WARNING: not writing a snapshot, no boot id: %s\n", strerror(errno));
+    return;
+  }
+
+  uint8_t* body = NULL;
+  put_snapshot_paths(&body, executable_paths);
+  put_snapshot_paths(&body, cgroup_paths);
+
+  pid_t* saved = NULL;
+  for (size_t i = 0; i < hmlenu(tgids); i++) {
+    process_info_t* info = &tgids[i].value;
+    // one /proc would not give the start time of could not be told from whatever has its pid on the
+    // next start, it is charged now as without a snapshot
+    uint64_t start_ticks = 0;
+    if (!read_start_ticks(tgids[i].key, &start_ticks) || start_ticks == 0 || !started_before_exec(start_ticks, info)) {
+      continue;
+    }
+
+    snapshot_process_t process = {
+      .tgid = tgids[i].key,
+      .uid = info->uid,
+      .executable = info->executable_id,
+      .cgroup = info->cgroup_id,
+      .weight = info->weight,
+      .start_time_ns = info->start_time_ns,
+      .start_ticks = start_ticks,
+      .usage = info->usage,
+    };
+    memcpy(arraddnptr(body, sizeof(process)), &process, sizeof(process));
+    arrput(saved, tgids[i].key);
+  }
+  header.processes_count = arrlenu(saved);
+
+  // written next to it and renamed, a crash halfway leaves the last complete snapshot or none
+  static char temporary_path[PATH_MAX] = {};
+  snprintf(temporary_path, PATH_MAX, "%s.tmp", path);
+
+  FILE* file = fopen(temporary_path, "we");
+  bool written = file != NULL &&
+                 fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 fwrite(body, 1, arrlenu(body), file) == arrlenu(body) &&
+                 fflush(file) == 0 &&
+                 fsync(fileno(file)) == 0;
+  if (file != NULL) {
+    written = fclose(file) == 0 && written;
+  }
+  arrfree(body);
+
+  if (!written || rename(temporary_path, path) == -1) {
+    fprintf(stderr, "WARNING: failed to write a snapshot to %s: %s\n", path, strerror(errno));
+    unlink(temporary_path);
+    arrfree(saved);
+    return;
+  }
+
+  for (size_t i = 0; i < arrlenu(saved); i++) {
+    hmdel(tgids, saved[i]);
+  }
+  printf("LOG: saved %zu running processes to %s\n", arrlenu(saved), path);
+  arrfree(saved);
+}
+
+void* check_snapshot_processes(void* argument) {
+  snapshot_check_t* check = argument;
+  for (size_t i = check->first; i < check->last; i++) {
+    // one /proc would not say about is kept, the sweep checks it again
+    uint64_t start_ticks = 0;
+    check->alive[i] = check->processes[i].start_ticks != 0 &&
+                      read_start_ticks(check->processes[i].tgid, &start_ticks) &&
+                      (start_ticks == 0 || start_ticks == check->processes[i].start_ticks);
+  }
+  return NULL;
+}
+
+// a /proc read per process adds up for a few hundred thousand of them, so they are split across
+// threads. nothing but reading /proc happens on them
+void check_snapshot(snapshot_process_t* processes, size_t count, bool* alive) {
+  size_t threads_count = 1 + count / SNAPSHOT_PROCESSES_PER_THREAD;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  threads_count = threads_count < (size_t) cpus ? threads_count : (size_t) cpus;
+  threads_count = threads_count < SNAPSHOT_MAX_THREADS ? threads_count : SNAPSHOT_MAX_THREADS;
+
+  pthread_t threads[SNAPSHOT_MAX_THREADS];
+  snapshot_check_t checks[SNAPSHOT_MAX_THREADS];
+  size_t started = 0;
+  for (size_t i = 0; i < threads_count; i++) {
+    checks[i] = (snapshot_check_t) {
+      .processes = processes,
+      .first = count * i / threads_count,
+      .last = count * (i + 1) / threads_count,
+      .alive = alive,
+    };
+
+    // whatever could not get a thread of its own is checked right here
+    if (threads_count == 1 || pthread_create(&threads[started], NULL, check_snapshot_processes, &checks[i]) != 0) {
+      check_snapshot_processes(&checks[i]);
+    } else {
+      started++;
+    }
+  }
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// copies the next len bytes of the snapshot out, false once it runs short
+bool take_snapshot_bytes(uint8_t* data, size_t data_len, size_t* offset, void* out, size_t len) {
+  if (data_len - *offset < len) {
+    return false;
+  }
+  memcpy(out, data + *offset, len);
+  *offset += len;
+  return true;
+}
+
+bool take_snapshot_paths(uint8_t* data, size_t data_len, size_t* offset, uint32_t count, char*** paths) {
+  for (uint32_t i = 0; i < count; i++) {
+    uint16_t len = 0;
+    if (!take_snapshot_bytes(data, data_len, offset, &len, sizeof(len)) || data_len - *offset < len) {
+      return false;
+    }
+    arrput(*paths, strndup((char *) data + *offset, len));
+    *offset += len;
+  }
+  return true;
+}
+
+// picks up the processes a clean shutdown left behind. the ones that exited in between are charged up
+// to the shutdown, when they were last known to run
+void load_snapshot(char* path) {
+  FILE* file = fopen(path, "re");
+  if (file == NULL) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "WARNING: failed to open snapshot %s: %s\n", path, strerror(errno));
+    }
+    return;
+  }
+
+  uint64_t start_ns = monotonic_now_ns();
+
+  uint8_t* data = NULL;
+  size_t data_len = 0;
+  static uint8_t chunk[64 * 1024];
+  size_t chunk_len = 0;
+  while ((chunk_len = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    memcpy(arraddnptr(data, chunk_len), chunk, chunk_len);
+  }
+  fclose(file);
+  data_len = arrlenu(data);
+
+  // read once, a crash later on must not bring them back a second time
+  unlink(path);
+
+  snapshot_header_t header = {};
+  size_t offset = 0;
+  char** executables = NULL;
+  char** cgroups = NULL;
+  snapshot_process_t* processes = NULL;
+
+  bool valid = take_snapshot_bytes(data, data_len, &offset, &header, sizeof(header)) &&
+               memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+               header.version == SNAPSHOT_VERSION &&
+               take_snapshot_paths(data, data_len, &offset, header.executables_count, &executables) &&
+               take_snapshot_paths(data, data_len, &offset, header.cgroups_count, &cgroups) &&
+               data_len - offset == (size_t) header.processes_count * sizeof(snapshot_process_t);
+  // the paths before them leave the processes unaligned
+  if (valid) {
+    processes = malloc(header.processes_count * sizeof(*processes) + 1);
+    memcpy(processes, data + offset, header.processes_count * sizeof(*processes));
+  }
+  for (uint32_t i = 0; valid && i < header.processes_count; i++) {
+    valid = processes[i].executable < header.executables_count && executables[processes[i].executable][0] != 0 &&
+            processes[i].cgroup < header.cgroups_count;
+  }
+
+  if (!valid) {
+    fprintf(stderr, "WARNING: ignoring snapshot %s, it is damaged or from another version\n", path);
+  } else {
+    // after a reboot none of them can still be running
+    static char boot_id[40];
+    bool same_boot = read_boot_id(boot_id) && strcmp(boot_id, header.boot_id) == 0;
+
+    bool* alive = calloc(header.processes_count + 1, sizeof(*alive));
+    if (same_boot) {
+      check_snapshot(processes, header.processes_count, alive);
+    }
+
+    size_t restored = 0;
+    for (uint32_t i = 0; i < header.processes_count; i++) {
+      snapshot_process_t* process = &processes[i];
+      process_info_t info = {
+        .start_time_ns = process->start_time_ns,
+        .last_seen_ns = header.saved_ns,
+        .uid = process->uid,
+        .weight = process->weight,
+        .usage = process->usage,
+      };
+
+      // a pid that exited right before it exec'd again is already tracked anew
+      if (hmgeti(tgids, process->tgid) >= 0) {
+        continue;
+      }
+
+      track_process(process->tgid, &info, executables[process->executable], cgroups[process->cgroup]);
+      if (alive[i]) {
+        restored++;
+      } else {
+        evict_process(process->tgid, &info);
+      }
+    }
+    free(alive);
+
+    printf("LOG: restored %zu of %u processes from %s in %.3f ms%s\n", restored, header.processes_count, path,
+           (monotonic_now_ns() - start_ns) / 1e6, same_boot ? "" : ", the machine rebooted since");
+  }
+
+  for (size_t i = 0; i < arrlenu(executables); i++) {
+    free(executables[i]);
+  }
+  for (size_t i = 0; i < arrlenu(cgroups); i++) {
+    free(cgroups[i]);
+  }
+  arrfree(executables);
+  arrfree(cgroups);
+  free(processes);
+  arrfree(data);
+}
+
+char* default_data_home() {
+  struct passwd *passwd = getpwuid(getuid());
+  if (passwd == NULL) {
+    FAIL("getpwuid");
+  }
+
+  static char data_home_path[PATH_MAX] = {};
+  snprintf(data_home_path, PATH_MAX, "%s/.local/share/", passwd->pw_dir);
+  return data_home_path;
+}
+
+void recursive_mkdir(char* path) {
+  char* separator = strrchr(path, '/');
+
+  if (separator == path) {
+    separator = strrchr(path + 1, '/');
+  }
+
+  if (separator != NULL) {
+    *separator = 0;
+    recursive_mkdir(path);
+    *separator = '/';
+  }
+
+  if (mkdir(path, 0777) && errno != EEXIST) {
+    FAIL("mkdir");
+  }
+}
+
+char* default_db_path() {
+  char* xdg_data_home = getenv("XDG_DATA_HOME");
+  if (xdg_data_home == NULL) {
+    xdg_data_home = default_data_home();
+  }
+
+  assert(xdg_data_home != NULL);
+
+  static char db_path[PATH_MAX] = {};
+  snprintf(db_path, PATH_MAX, "%s/spycy/", xdg_data_home);
+
+  recursive_mkdir(db_path);
+
+  snprintf(db_path, PATH_MAX, "%s/spycy/spycy.db", xdg_data_home);
+
+  return db_path;
+}
+
+void signal_handler(int asdf) {
+  (void) asdf;
+  quit = 1;
+}
+
+void dump_signal_handler(int asdf) {
+  (void) asdf;
+  dump_requested = 1;
+}
+
+// each entry upgrades the schema from user_version <index> to <index + 1>
+char* migrations[] = {
+  "create table if not exists spycy_data ("
+  " executable_path text not null unique,"
+  " nanoseconds_spent integer not null,"
+  " username text not null,"
+  " primary key(executable_path)"
+  ");",
+
+  "create table spycy_data_v2 ("
+  " executable_path text not null,"
+  " username text not null,"
+  " bucket integer not null,"
+  " nanoseconds_spent integer not null,"
+  " primary key(executable_path, username, bucket)"
+  ");"
+  "insert into spycy_data_v2 (executable_path, username, bucket, nanoseconds_spent) "
+  " select executable_path, username, 0, nanoseconds_spent from spycy_data;"
+  "drop table spycy_data;"
+  "alter table spycy_data_v2 rename to spycy_data;"
+  "create index spycy_data_by_user on spycy_data (username, bucket, nanoseconds_spent);"
+  "create index spycy_data_by_bucket on spycy_data (bucket);",
+
+  "alter table spycy_data add column cpu_user_ns integer not null default 0;"
+  "alter table spycy_data add column cpu_system_ns integer not null default 0;"
+  "alter table spycy_data add column read_bytes integer not null default 0;"
+  "alter table spycy_data add column write_bytes integer not null default 0;"
+  "alter table spycy_data add column max_rss_kb integer not null default 0;",
+
+  "create table spycy_cgroups ("
+  " id integer primary key,"
+  " path text not null unique"
+  ");"
+  "create table spycy_data_v4 ("
+  " executable_path text not null,"
+  " username text not null,"
+  " bucket integer not null,"
+  " cgroup_id integer not null default 0,"
+  " nanoseconds_spent integer not null,"
+  " cpu_user_ns integer not null default 0,"
+  " cpu_system_ns integer not null default 0,"
+  " read_bytes integer not null default 0,"
+  " write_bytes integer not null default 0,"
+  " max_rss_kb integer not null default 0,"
+  " primary key(executable_path, username, bucket, cgroup_id)"
+  ");"
+  "insert into spycy_data_v4 (executable_path, username, bucket, nanoseconds_spent, "
+  "                           cpu_user_ns, cpu_system_ns, read_bytes, write_bytes, max_rss_kb) "
+  " select executable_path, username, bucket, nanoseconds_spent, "
+  "        cpu_user_ns, cpu_system_ns, read_bytes, write_bytes, max_rss_kb from spycy_data;"
+  "drop table spycy_data;"
+  "alter table spycy_data_v4 rename to spycy_data;"
+  "create index spycy_data_by_user on spycy_data (username, bucket, nanoseconds_spent);"
+  "create index spycy_data_by_bucket on spycy_data (bucket);"
+  "create index spycy_data_by_cgroup on spycy_data (cgroup_id, bucket);",
+
+  "alter table spycy_data add column executions integer not null default 0;"
+  "alter table spycy_data add column durations blob;",
+
+  "alter table spycy_data add column inclusive_ns integer not null default 0;",
+
+  "alter table spycy_data add column flags integer not null default 0;",
+
+  "alter table spycy_data add column change_seq integer not null default 0;"
+  "create index spycy_data_by_change on spycy_data (change_seq);",
+
+  // rows from before change_seq all have 0, which no cursor is below. they get sequences after the
+  // ones written since
+  "update spycy_data set change_seq = (select max(change_seq) from spycy_data) + rowid where change_seq = 0;",
+};
+
+#define MIGRATIONS_COUNT (sizeof(migrations) / sizeof(migrations[0]))
+
+void prepare_db() {
+  assert(db != NULL);
+
+  char* error_message = NULL;
+  sqlite3_exec(db, "pragma journal_mode = wal;", NULL, NULL, &error_message);
+
+  sqlite3_stmt* version_statement = NULL;
+  int version = 0;
+  if (error_message == NULL &&
+      sqlite3_prepare_v2(db, "pragma user_version;", -1, &version_statement, NULL) == SQLITE_OK &&
+      sqlite3_step(version_statement) == SQLITE_ROW) {
+    version = sqlite3_column_int(version_statement, 0);
+  }
+  sqlite3_finalize(version_statement);
+
+  for (size_t i = version; i < MIGRATIONS_COUNT && error_message == NULL; i++) {
+    static char version_sql[64] = {};
+    snprintf(version_sql, sizeof(version_sql), "pragma user_version = %zu;", i + 1);
+
+    sqlite3_exec(db, "begin;", NULL, NULL, &error_message);
+    if (error_message == NULL) {
+      sqlite3_exec(db, migrations[i], NULL, NULL, &error_message);
+    }
+    if (error_message == NULL) {
+      sqlite3_exec(db, version_sql, NULL, NULL, &error_message);
+    }
+    if (error_message == NULL) {
+      sqlite3_exec(db, "commit;", NULL, NULL, &error_message);
+    }
+  }
+
+  if (error_message != NULL) {
+    fprintf(stderr, "ERROR: failed to prepare database: %s\n", error_message);
+    sqlite3_free(error_message);
+    code = 1;
+    destruct();
+  }
+}
+
+void open_db(char* path) {
+  arrfree(cgroup_db_ids);
+
+  if (sqlite3_open(path, &db)) {
+    SQLITE3_FAIL("ERROR: failed to open database at %s: %s\n", path, sqlite3_errmsg(db));
+  }
+
+  printf("LOG: using database %s\n", path);
+
+  register_histogram_functions();
+  prepare_db();
+
+  // a clock that went back while we were stopped must not hand out sequences already used
+  sqlite3_stmt* change_statement = NULL;
+  if (sqlite3_prepare_v2(db, "select coalesce(max(change_seq), 0) from spycy_data", -1, &change_statement, NULL) == SQLITE_OK &&
+      sqlite3_step(change_statement) == SQLITE_ROW &&
+      sqlite3_column_int64(change_statement, 0) > change_seq) {
+    change_seq = sqlite3_column_int64(change_statement, 0);
+  }
+  sqlite3_finalize(change_statement);
+}
+
+void shard_stem(char* path, char stem[PATH_MAX]) {
+  snprintf(stem, PATH_MAX, "%s", path);
+
+  size_t stem_len = strlen(stem);
+  if (stem_len > 3 && strcmp(stem + stem_len - 3, ".db") == 0) {
+    stem[stem_len - 3] = 0;
+  }
+}
+
+// fills in the shard file that covers `now` and returns the moment that shard stops being current
+time_t shard_path_at(time_t now, char path[PATH_MAX]) {
+  assert(shard_mode != SHARD_NONE);
+
+  static char stem[PATH_MAX] = {};
+  shard_stem(base_db_path, stem);
+
+  struct tm local = {};
+  localtime_r(&now, &local);
+
+  // ISO dates and ISO weeks both sort chronologically as plain strings, which expire_shards relies on
+  char period[32] = {};
+  strftime(period, sizeof(period), shard_mode == SHARD_DAY ? "%Y-%m-%d" : "%G-W%V", &local);
+  snprintf(path, PATH_MAX, "%.*s-%s.db", PATH_MAX - 48, stem, period);
+
+  local.tm_hour = 0;
+  local.tm_min = 0;
+  local.tm_sec = 0;
+  local.tm_isdst = -1;
+  local.tm_mday += shard_mode == SHARD_DAY ? 1 : 7 - (local.tm_wday + 6) % 7;
+
+  return mktime(&local);
+}
+
+void remove_shard(char* path) {
+  static char sibling_path[PATH_MAX + 16] = {};
+  char* suffixes[] = {"", "-wal", "-shm", "-journal"};
+
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    snprintf(sibling_path, sizeof(sibling_path), "%s%s", path, suffixes[i]);
+    if (unlink(sibling_path) == -1 && errno != ENOENT) {
+      fprintf(stderr, "WARNING: failed to remove %s: %s\n", sibling_path, strerror(errno));
+    }
+  }
+
+  printf("LOG: removed expired shard %s\n", path);
+}
+
+void expire_shards(time_t now) {
+  if (shard_retention <= 0) {
+    return;
+  }
+
+  static char cutoff_path[PATH_MAX] = {};
+  time_t period = (shard_mode == SHARD_DAY ? 1 : 7) * 24 * 60 * 60;
+  shard_path_at(now - (shard_retention - 1) * period, cutoff_path);
+
+  static char stem[PATH_MAX] = {};
+  static char pattern[PATH_MAX + 8] = {};
+  shard_stem(base_db_path, stem);
+  snprintf(pattern, sizeof(pattern), "%s-*.db", stem);
+
+  glob_t shards = {};
+  if (glob(pattern, 0, NULL, &shards) != 0) {
+    return;
+  }
+
+  // shards of the other mode have names of a different length and are left alone
+  size_t cutoff_len = strlen(cutoff_path);
+  for (size_t i = 0; i < shards.gl_pathc; i++) {
+    char* path = shards.gl_pathv[i];
+    if (strlen(path) == cutoff_len && strcmp(path, cutoff_path) < 0) {
+      remove_shard(path);
+    }
+  }
+
+  globfree(&shards);
+}
+
+void rotate_shard() {
+  if (shard_mode == SHARD_NONE) {
+    return;
+  }
+
+  time_t now = time(NULL);
+  if (db != NULL && now < shard_expires_at) {
+    return;
+  }
+
+  if (db != NULL && sqlite3_close(db) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to close shard %s: %s\n", shard_path, sqlite3_errmsg(db));
+  }
+  db = NULL;
+
+  shard_expires_at = shard_path_at(now, shard_path);
+  open_db(shard_path);
+
+  expire_shards(now);
+}
+
+typedef struct {
+  char* name;
+  char* fallback;
+  // set for columns that are computed from `source` rather than read as is, `%s` is the schema
+  char* source;
+  char* expression;
+} usage_column_t;
+
+// columns every shard is read through; shards written by older versions get the fallback value
+usage_column_t usage_columns[] = {
+  {"executable_path", "''", NULL, NULL},
+  {"nanoseconds_spent", "0", NULL, NULL},
+  {"username", "''", NULL, NULL},
+  {"bucket", "0", NULL, NULL},
+  {"cpu_user_ns", "0", NULL, NULL},
+  {"cpu_system_ns", "0", NULL, NULL},
+  {"read_bytes", "0", NULL, NULL},
+  {"write_bytes", "0", NULL, NULL},
+  {"max_rss_kb", "0", NULL, NULL},
+  {"executions", "0", NULL, NULL},
+  {"durations", "null", NULL, NULL},
+  {"inclusive_ns", "0", NULL, NULL},
+  {"flags", "0", NULL, NULL},
+  {"change_seq", "0", NULL, NULL},
+  {"cgroup", "''", "cgroup_id", "coalesce((select path from %s.spycy_cgroups where id = cgroup_id), '')"},
+};
+
+#define USAGE_COLUMNS_COUNT (sizeof(usage_columns) / sizeof(usage_columns[0]))
+
+// only rows of this cgroup are read when set, through the cgroup index instead of the path
+// every row's cgroup_id resolves to
+char* reader_cgroup = NULL;
+
+bool select_usage_from(FILE* sql, char* schema) {
+  sqlite3_stmt* columns_statement = NULL;
+  int rc = sqlite3_prepare_v2(db, "select name from pragma_table_info('spycy_data', ?)",
+                              -1, &columns_statement, NULL);
+  if (rc != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare table info statement: %s\n", sqlite3_errmsg(db));
+  }
+
+  if ((rc = sqlite3_bind_text(columns_statement, 1, schema, -1, SQLITE_STATIC)) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to bind table info statement: %s\n", sqlite3_errstr(rc));
+  }
+
+  bool present[USAGE_COLUMNS_COUNT] = {};
+  bool has_table = false;
+  while (sqlite3_step(columns_statement) == SQLITE_ROW) {
+    has_table = true;
+
+    const char* name = (const char*) sqlite3_column_text(columns_statement, 0);
+    for (size_t i = 0; i < USAGE_COLUMNS_COUNT; i++) {
+      char* column = usage_columns[i].source != NULL ? usage_columns[i].source : usage_columns[i].name;
+      present[i] |= strcmp(name, column) == 0;
+    }
+  }
+
+  sqlite3_finalize(columns_statement);
+
+  if (!has_table) {
+    return false;
+  }
+
+  fprintf(sql, "select ");
+  for (size_t i = 0; i < USAGE_COLUMNS_COUNT; i++) {
+    fprintf(sql, "%s", i == 0 ? "" : ", ");
+
+    if (!present[i]) {
+      fprintf(sql, "%s", usage_columns[i].fallback);
+    } else if (usage_columns[i].expression != NULL) {
+      fprintf(sql, usage_columns[i].expression, schema);
+    } else {
+      fprintf(sql, "%s", usage_columns[i].name);
+    }
+
+    fprintf(sql, " as %s", usage_columns[i].name);
+  }
+  fprintf(sql, " from %s.spycy_data", schema);
+
+  // ids are only meaningful within one database, so the name is resolved once in every one of them.
+  // shards from before cgroups were recorded hold nothing but the empty one
+  if (reader_cgroup != NULL) {
+    bool has_cgroup_id = false;
+    for (size_t i = 0; i < USAGE_COLUMNS_COUNT; i++) {
+      has_cgroup_id |= present[i] && usage_columns[i].source != NULL && strcmp(usage_columns[i].source, "cgroup_id") == 0;
+    }
+
+    char* filter = !has_cgroup_id ? sqlite3_mprintf(" where %d", reader_cgroup[0] == 0) :
+                   reader_cgroup[0] == 0 ? sqlite3_mprintf(" where cgroup_id = 0") :
+                   sqlite3_mprintf(" where cgroup_id = (select id from %s.spycy_cgroups where path = %Q)",
+                                   schema, reader_cgroup);
+    fprintf(sql, "%s", filter);
+    sqlite3_free(filter);
+  }
+
+  return true;
+}
+
+void exec_or_fail(char* sql) {
+  char* error_message = NULL;
+  sqlite3_exec(db, sql, NULL, NULL, &error_message);
+
+  if (error_message != NULL) {
+    SQLITE3_FAIL("ERROR: failed to execute '%s': %s\n", sql, error_message);
+  }
+}
+
+void attach_shard(char* path, size_t index) {
+  static char attach_sql[64] = {};
+  snprintf(attach_sql, sizeof(attach_sql), "attach ? as shard_%zu", index);
+
+  sqlite3_stmt* attach_statement = NULL;
+  if (sqlite3_prepare_v2(db, attach_sql, -1, &attach_statement, NULL) != SQLITE_OK ||
+      sqlite3_bind_text(attach_statement, 1, path, -1, SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_step(attach_statement) != SQLITE_DONE) {
+    SQLITE3_FAIL("ERROR: failed to attach shard %s: %s\n", path, sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(attach_statement);
+}
+
+// unions (optionally) main and shard_0..shard_<count - 1> into one select,
+// returns false if none of them has a usage table
+bool select_usage_union(FILE* sql, bool with_main, size_t count) {
+  bool any = with_main && select_usage_from(sql, "main");
+
+  for (size_t i = 0; i < count; i++) {
+    static char schema[32] = {};
+    snprintf(schema, sizeof(schema), "shard_%zu", i);
+
+    if (any) {
+      fprintf(sql, " union all ");
+    }
+    any |= select_usage_from(sql, schema);
+  }
+
+  if (!any) {
+    fprintf(sql, "select ");
+    for (size_t i = 0; i < USAGE_COLUMNS_COUNT; i++) {
+      fprintf(sql, "%s%s as %s", i == 0 ? "" : ", ", usage_columns[i].fallback, usage_columns[i].name);
+    }
+    fprintf(sql, " where 0");
+  }
+
+  return any;
+}
+
+// exposes the base database and every shard next to it as the temporary `spycy_all` source.
+// shards get attached and glued together with a union view; when there are more of them than
+// sqlite can attach at once they are folded batch by batch into a temporary table instead
+void attach_shards(char* path) {
+  static char stem[PATH_MAX] = {};
+  static char pattern[PATH_MAX + 8] = {};
+  shard_stem(path, stem);
+  snprintf(pattern, sizeof(pattern), "%s-*.db", stem);
+
+  glob_t shards = {};
+  glob(pattern, 0, NULL, &shards);
+
+  size_t attach_limit = sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1);
+
+  char* sql = NULL;
+  size_t sql_len = 0;
+  FILE* sql_stream = open_memstream(&sql, &sql_len);
+
+  if (shards.gl_pathc <= attach_limit) {
+    for (size_t i = 0; i < shards.gl_pathc; i++) {
+      attach_shard(shards.gl_pathv[i], i);
+    }
+
+    fprintf(sql_stream, "create temp view spycy_all as ");
+    select_usage_union(sql_stream, true, shards.gl_pathc);
+    fclose(sql_stream);
+    exec_or_fail(sql);
+  } else {
+    fprintf(sql_stream, "create temp table spycy_all as ");
+    select_usage_union(sql_stream, true, 0);
+    fclose(sql_stream);
+    exec_or_fail(sql);
+    free(sql);
+
+    for (size_t batch = 0; batch < shards.gl_pathc; batch += attach_limit) {
+      size_t batch_len = shards.gl_pathc - batch < attach_limit ? shards.gl_pathc - batch : attach_limit;
+
+      for (size_t i = 0; i < batch_len; i++) {
+        attach_shard(shards.gl_pathv[batch + i], i);
+      }
+
+      sql_stream = open_memstream(&sql, &sql_len);
+      fprintf(sql_stream, "insert into temp.spycy_all ");
+      select_usage_union(sql_stream, false, batch_len);
+      fclose(sql_stream);
+      exec_or_fail(sql);
+      free(sql);
+
+      for (size_t i = 0; i < batch_len; i++) {
+        static char detach_sql[64] = {};
+        snprintf(detach_sql, sizeof(detach_sql), "detach shard_%zu", i);
+        exec_or_fail(detach_sql);
+      }
+    }
+    sql = NULL;
+  }
+
+  free(sql);
+  globfree(&shards);
+}
+
+void open_reader(char* path) {
+  // a sharded setup may never have written the base database itself
+  struct stat info = {};
+  char* main_path = stat(path, &info) == 0 ? path : ":memory:";
+
+  if (sqlite3_open_v2(main_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to open database at %s: %s\n", main_path, sqlite3_errmsg(db));
+  }
+
+  register_histogram_functions();
+
+  attach_shards(path);
+}
+
+int dump_main(int argc, char** argv) {
+  if (argc > 2) {
+    fprintf(stderr, "USAGE: %s dump [path to database file]\n", argv[0]);
+    return 1;
+  }
+
+  open_reader(argc == 2 ? argv[1] : default_db_path());
+
+  sqlite3_stmt* select_statement = NULL;
+  if (sqlite3_prepare_v2(db,
+                         "select executable_path, username, nanoseconds_spent from spycy_all",
+                         -1, &select_statement, NULL) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare dump statement: %s\n", sqlite3_errmsg(db));
+  }
+
+  while (sqlite3_step(select_statement) == SQLITE_ROW) {
+    printf("%s\t%s\t%lld\n",
+           sqlite3_column_text(select_statement, 0),
+           sqlite3_column_text(select_statement, 1),
+           sqlite3_column_int64(select_statement, 2));
+  }
+
+  sqlite3_finalize(select_statement);
+  sqlite3_close(db);
+  return 0;
+}
+
+// quotes a field only when it needs it, the way RFC 4180 readers expect
+void put_csv_field(FILE* out, const char* field) {
+  if (strpbrk(field, ",\"\r\n") == NULL) {
+    fputs(field, out);
+    return;
+  }
+
+  fputc('"', out);
+  for (const char* c = field; *c != 0; c++) {
+    if (*c == '"') {
+      fputc('"', out);
+    }
+    fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+void put_changes_varint(FILE* out, uint64_t value) {
+  uint8_t encoded[10] = {};
+  fwrite(encoded, 1, put_varint(encoded, value), out);
+}
+
+void put_changes_bytes(FILE* out, const void* bytes, size_t len) {
+  put_changes_varint(out, len);
+  fwrite(bytes, 1, len, out);
+}
+
+#define CHANGES_MAGIC "spycychg"
+
+// columns of a change row, in the order both formats write them
+char* change_columns[] = {
+  "change_seq", "executable_path", "username", "cgroup", "bucket", "nanoseconds_spent",
+  "cpu_user_ns", "cpu_system_ns", "read_bytes", "write_bytes", "max_rss_kb", "executions",
+  "inclusive_ns", "flags", "durations",
+};
+
+#define CHANGE_COLUMNS_COUNT (sizeof(change_columns) / sizeof(change_columns[0]))
+
+// streams every row written after --since, each with its current totals, in change_seq order. the
+// last change_seq written is the cursor for the next run. without a cursor every row is, even those
+// of shards from before change_seq that read as 0
+int changes_main(char* program, int argc, char** argv) {
+  static struct option options[] = {
+    {"since", required_argument, NULL, 's'},
+    {"cursor-file", required_argument, NULL, 'c'},
+    {"format", required_argument, NULL, 'f'},
+    {},
+  };
+
+  int64_t since = -1;
+  char* cursor_path = NULL;
+  bool binary = false;
+  bool valid = true;
+
+  int option = 0;
+  while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    if (option == 's' && atoll(optarg) >= 0) {
+      since = atoll(optarg);
+    } else if (option == 'c') {
+      cursor_path = optarg;
+    } else if (option == 'f' && (strcmp(optarg, "csv") == 0 || strcmp(optarg, "binary") == 0)) {
+      binary = strcmp(optarg, "binary") == 0;
+    } else {
+      valid = false;
+    }
+  }
+
+  if (!valid || argc - optind > 1) {
+    fprintf(stderr, "USAGE: %s changes [--since=CURSOR] [--cursor-file=PATH] [--format=csv|binary] "
+                    "[path to database file]\n", program);
+    return 1;
+  }
+
+  // without --since we carry on from where the cursor file says the last run stopped
+  if (since == -1 && cursor_path != NULL) {
+    FILE* cursor_file = fopen(cursor_path, "re");
+    if (cursor_file != NULL && fscanf(cursor_file, "%" SCNd64, &since) != 1) {
+      fprintf(stderr, "ERROR: failed to read cursor from %s\n", cursor_path);
+      return 1;
+    }
+    if (cursor_file != NULL) {
+      fclose(cursor_file);
+    }
+  }
+
+  open_reader(optind < argc ? argv[optind] : default_db_path());
+
+  sqlite3_stmt* select_statement = NULL;
+  if (sqlite3_prepare_v2(db,
+                         "select change_seq, executable_path, username, cgroup, bucket, nanoseconds_spent, "
+                         "       cpu_user_ns, cpu_system_ns, read_bytes, write_bytes, max_rss_kb, executions, "
+                         "       inclusive_ns, flags, durations "
+                         "from spycy_all where change_seq > ? order by change_seq",
+                         -1, &select_statement, NULL) != SQLITE_OK ||
+      sqlite3_bind_int64(select_statement, 1, since) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare changes statement: %s\n", sqlite3_errmsg(db));
+  }
+
+  if (binary) {
+    fwrite(CHANGES_MAGIC, 1, strlen(CHANGES_MAGIC), stdout);
+  } else {
+    for (size_t i = 0; i < CHANGE_COLUMNS_COUNT; i++) {
+      printf("%s%s", i == 0 ? "" : ",", change_columns[i]);
+    }
+    printf("\n");
+  }
+
+  int64_t cursor = since < 0 ? 0 : since;
+  uint64_t rows = 0;
+  int rc = SQLITE_OK;
+  while ((rc = sqlite3_step(select_statement)) == SQLITE_ROW) {
+    cursor = sqlite3_column_int64(select_statement, 0);
+    rows++;
+
+    for (size_t i = 0; i < CHANGE_COLUMNS_COUNT; i++) {
+      bool text = i >= 1 && i <= 3;
+      bool blob = i == CHANGE_COLUMNS_COUNT - 1;
+
+      if (binary && text) {
+        put_changes_bytes(stdout, sqlite3_column_text(select_statement, i), sqlite3_column_bytes(select_statement, i));
+      } else if (binary && blob) {
+        put_changes_bytes(stdout, sqlite3_column_blob(select_statement, i), sqlite3_column_bytes(select_statement, i));
+      } else if (binary) {
+        put_changes_varint(stdout, sqlite3_column_int64(select_statement, i));
+      } else if (blob) {
+        // the histogram's bytes in hex, empty when nothing finished
+        const uint8_t* durations = sqlite3_column_blob(select_statement, i);
+        printf(",");
+        for (int j = 0; j < sqlite3_column_bytes(select_statement, i); j++) {
+          printf("%02x", durations[j]);
+        }
+        printf("\n");
+      } else {
+        printf("%s", i == 0 ? "" : ",");
+        if (text) {
+          put_csv_field(stdout, (const char*) sqlite3_column_text(select_statement, i));
+        } else {
+          printf("%lld", sqlite3_column_int64(select_statement, i));
+        }
+      }
+    }
+  }
+
+  sqlite3_finalize(select_statement);
+  sqlite3_close(db);
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "ERROR: failed to read changes: %s\n", sqlite3_errstr(rc));
+    return 1;
+  }
+
+  // the cursor only moves once everything before it made it out
+  if (fflush(stdout) != 0 || ferror(stdout)) {
+    fprintf(stderr, "ERROR: failed to write changes: %s\n", strerror(errno));
+    return 1;
+  }
+
+  fprintf(stderr, "LOG: %" PRIu64 " changed rows, next cursor %" PRId64 "\n", rows, cursor);
+
+  if (cursor_path != NULL) {
+    static char temporary_path[PATH_MAX] = {};
+    snprintf(temporary_path, PATH_MAX, "%.*s.tmp", PATH_MAX - 8, cursor_path);
+
+    FILE* cursor_file = fopen(temporary_path, "we");
+    bool written = cursor_file != NULL &&
+                   fprintf(cursor_file, "%" PRId64 "\n", cursor) > 0 &&
+                   fflush(cursor_file) == 0 &&
+                   fsync(fileno(cursor_file)) == 0;
+    if (cursor_file != NULL) {
+      written = fclose(cursor_file) == 0 && written;
+    }
+
+    if (!written || rename(temporary_path, cursor_path) == -1) {
+      fprintf(stderr, "ERROR: failed to save cursor to %s: %s\n", cursor_path, strerror(errno));
+      unlink(temporary_path);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+typedef enum {
+  REPORT_TOP,
+  REPORT_USERS,
+  REPORT_DIRS,
+  REPORT_CPU,
+  REPORT_CGROUPS,
+  REPORT_DURATIONS,
+  REPORT_TREE,
+} report_kind_t;
+
+typedef struct {
+  report_kind_t kind;
+  int limit;
+  int depth;
+  char* user;
+  char* cgroup;
+  char* prefix;
+  time_t since;
+  time_t until;
+} report_t;
+
+// accepts `YYYY-MM-DD`, `YYYY-MM-DD HH:MM` or a relative `<N>s|m|h|d|w` meaning that long ago
+bool parse_time(char* text, time_t* result) {
+  char* unit = NULL;
+  long long amount = strtoll(text, &unit, 10);
+  if (unit != text && unit[0] != 0 && unit[1] == 0 && strchr("smhdw", unit[0]) != NULL) {
+    long long seconds[] = {['s' - 'a'] = 1, ['m' - 'a'] = 60, ['h' - 'a'] = 60 * 60,
+                           ['d' - 'a'] = 24 * 60 * 60, ['w' - 'a'] = 7 * 24 * 60 * 60};
+    *result = time(NULL) - amount * seconds[unit[0] - 'a'];
+    return true;
+  }
+
+  struct tm local = {};
+  char* end = strptime(text, "%Y-%m-%d", &local);
+  if (end != NULL && *end != 0) {
+    end = strptime(end, " %H:%M", &local);
+  }
+  if (end == NULL || *end != 0) {
+    return false;
+  }
+
+  local.tm_isdst = -1;
+  *result = mktime(&local);
+  return true;
+}
+
+// only the conditions that are actually set get emitted, so sqlite can pick the matching index
+void write_report_filter(FILE* sql, report_t* report) {
+  char* separator = " where ";
+
+  if (report->since != 0) {
+    fprintf(sql, "%sbucket >= :since", separator);
+    separator = " and ";
+  }
+  if (report->until != 0) {
+    fprintf(sql, "%sbucket < :until", separator);
+    separator = " and ";
+  }
+  if (report->user != NULL) {
+    fprintf(sql, "%susername = :user", separator);
+    separator = " and ";
+  }
+  // readers already left out the other cgroups, only a scan's totals still need it
+  if (report->cgroup != NULL && reader_cgroup == NULL) {
+    fprintf(sql, "%scgroup = :cgroup", separator);
+    separator = " and ";
+  }
+  if (report->prefix != NULL) {
+    // a range instead of `like` keeps the primary key usable for the lookup
+    fprintf(sql, "%sexecutable_path >= :prefix and executable_path < :prefix_end", separator);
+  }
+}
+
+void bind_report_filter(sqlite3_stmt* statement, report_t* report) {
+  static char prefix_end[PATH_MAX] = {};
+
+  if (report->prefix != NULL) {
+    snprintf(prefix_end, PATH_MAX, "%s", report->prefix);
+
+    size_t prefix_len = strlen(prefix_end);
+    while (prefix_len > 0 && (uint8_t) prefix_end[prefix_len - 1] == 0xff) {
+      prefix_end[--prefix_len] = 0;
+    }
+    if (prefix_len > 0) {
+      prefix_end[prefix_len - 1]++;
+    }
+  }
+
+  int rc = SQLITE_OK;
+  if (((rc = sqlite3_bind_int64(statement, sqlite3_bind_parameter_index(statement, ":since"), report->since)) != SQLITE_OK &&
+       rc != SQLITE_RANGE) ||
+      ((rc = sqlite3_bind_int64(statement, sqlite3_bind_parameter_index(statement, ":until"), report->until)) != SQLITE_OK &&
+       rc != SQLITE_RANGE) ||
+      ((rc = sqlite3_bind_text(statement, sqlite3_bind_parameter_index(statement, ":user"), report->user, -1, SQLITE_STATIC)) != SQLITE_OK &&
+       rc != SQLITE_RANGE) ||
+      ((rc = sqlite3_bind_text(statement, sqlite3_bind_parameter_index(statement, ":cgroup"), report->cgroup, -1, SQLITE_STATIC)) != SQLITE_OK &&
+       rc != SQLITE_RANGE) ||
+      ((rc = sqlite3_bind_text(statement, sqlite3_bind_parameter_index(statement, ":prefix"), report->prefix, -1, SQLITE_STATIC)) != SQLITE_OK &&
+       rc != SQLITE_RANGE) ||
+      ((rc = sqlite3_bind_text(statement, sqlite3_bind_parameter_index(statement, ":prefix_end"), prefix_end, -1, SQLITE_STATIC)) != SQLITE_OK &&
+       rc != SQLITE_RANGE)) {
+    SQLITE3_FAIL("ERROR: failed to bind report statement: %s\n", sqlite3_errstr(rc));
+  }
+}
+
+void print_report_row(int64_t nanoseconds_spent, const char* key) {
+  printf("%.3f\t%s\n", nanoseconds_spent / 1e9, key);
+}
+
+// number of bytes of `path` that make up its first `depth` directories, the whole path if it is shallower
+size_t directory_prefix_len(const char* path, int depth) {
+  const char* separator = path;
+
+  for (int i = 0; i < depth; i++) {
+    separator = strchr(separator + 1, '/');
+    if (separator == NULL) {
+      return strrchr(path, '/') - path + 1;
+    }
+  }
+
+  return separator - path + 1;
+}
+
+typedef struct {
+  char* key;
+  int64_t value;
+} directory_total_t;
+
+int compare_directory_totals(const void* a, const void* b) {
+  return strcmp(((directory_total_t*) a)->key, ((directory_total_t*) b)->key);
+}
+
+void run_report(report_t* report) {
+  char* sql = NULL;
+  size_t sql_len = 0;
+  FILE* sql_stream = open_memstream(&sql, &sql_len);
+
+  if (report->kind == REPORT_TOP) {
+    fprintf(sql_stream, "select sum(nanoseconds_spent) as total, executable_path from spycy_all");
+    write_report_filter(sql_stream, report);
+    fprintf(sql_stream, " group by executable_path order by total desc limit %d", report->limit);
+  } else if (report->kind == REPORT_CPU) {
+    fprintf(sql_stream, "select sum(cpu_user_ns + cpu_system_ns) as total, executable_path from spycy_all");
+    write_report_filter(sql_stream, report);
+    fprintf(sql_stream, " group by executable_path order by total desc limit %d", report->limit);
+  } else if (report->kind == REPORT_USERS) {
+    fprintf(sql_stream, "select sum(nanoseconds_spent) as total, username from spycy_all");
+    write_report_filter(sql_stream, report);
+    fprintf(sql_stream, " group by username order by total desc");
+  } else if (report->kind == REPORT_DURATIONS) {
+    // percentiles of the histograms merged over every matching row, slowest p99 first
+    fprintf(sql_stream,
+            "select executions, spycy_histogram_percentile(durations, 50), spycy_histogram_percentile(durations, 90), "
+            "       spycy_histogram_percentile(durations, 99), executable_path from ("
+            " select sum(executions) as executions, spycy_histogram_sum(durations) as durations, executable_path"
+            " from spycy_all");
+    write_report_filter(sql_stream, report);
+    fprintf(sql_stream, " group by executable_path) where executions > 0 order by 4 desc limit %d", report->limit);
+  } else if (report->kind == REPORT_TREE) {
+    fprintf(sql_stream, "select sum(inclusive_ns) as total, sum(nanoseconds_spent), executable_path from spycy_all");
+    write_report_filter(sql_stream, report);
+    fprintf(sql_stream, " group by executable_path order by total desc limit %d", report->limit);
+  } else if (report->kind == REPORT_CGROUPS) {
+    fprintf(sql_stream, "select sum(nanoseconds_spent) as total, cgroup from spycy_all");
+    write_report_filter(sql_stream, report);
+    fprintf(sql_stream, " group by cgroup order by total desc");
+  } else {
+    fprintf(sql_stream, "select sum(nanoseconds_spent), executable_path from spycy_all");
+    write_report_filter(sql_stream, report);
+    fprintf(sql_stream, " group by executable_path");
+  }
+
+  fclose(sql_stream);
+
+  sqlite3_stmt* report_statement = NULL;
+  if (sqlite3_prepare_v2(db, sql, -1, &report_statement, NULL) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare report statement: %s\n", sqlite3_errmsg(db));
+  }
+  free(sql);
+
+  bind_report_filter(report_statement, report);
+
+  // a path shallower than --depth is cut at its own directory, which can sort apart from the deeper
+  // paths sharing that prefix, so directories are added up by name rather than by runs of rows
+  static char directory[PATH_MAX] = {};
+  directory_total_t* directories = NULL;
+  sh_new_arena(directories);
+
+  while (sqlite3_step(report_statement) == SQLITE_ROW) {
+    if (report->kind == REPORT_DURATIONS) {
+      printf("%lld\t%.6f\t%.6f\t%.6f\t%s\n",
+             sqlite3_column_int64(report_statement, 0),
+             sqlite3_column_int64(report_statement, 1) / 1e9,
+             sqlite3_column_int64(report_statement, 2) / 1e9,
+             sqlite3_column_int64(report_statement, 3) / 1e9,
+             sqlite3_column_text(report_statement, 4));
+      continue;
+    }
+
+    if (report->kind == REPORT_TREE) {
+      printf("%.3f\t%.3f\t%s\n",
+             sqlite3_column_int64(report_statement, 0) / 1e9,
+             sqlite3_column_int64(report_statement, 1) / 1e9,
+             sqlite3_column_text(report_statement, 2));
+      continue;
+    }
+
+    int64_t total = sqlite3_column_int64(report_statement, 0);
+    const char* key = (const char*) sqlite3_column_text(report_statement, 1);
+
+    if (report->kind != REPORT_DIRS) {
+      print_report_row(total, key);
+      continue;
+    }
+
+    if (key[0] != '/') {
+      continue;
+    }
+
+    snprintf(directory, PATH_MAX, "%.*s", (int) directory_prefix_len(key, report->depth), key);
+    ptrdiff_t index = shgeti(directories, directory);
+    if (index >= 0) {
+      directories[index].value += total;
+    } else {
+      shput(directories, directory, total);
+    }
+  }
+
+  // sorting breaks the map's index, it is only iterated and freed after this
+  qsort(directories, shlenu(directories), sizeof(*directories), compare_directory_totals);
+  for (size_t i = 0; i < shlenu(directories); i++) {
+    print_report_row(directories[i].value, directories[i].key);
+  }
+
+  shfree(directories);
+  sqlite3_finalize(report_statement);
+}
+
+noreturn void report_usage(char* program) {
+  fprintf(stderr,
+          "USAGE: %s report top|users|dirs|cpu|cgroups|durations|tree [options] [path to database file]\n"
+          "       %s scan top|users|dirs|cpu|cgroups|durations|tree [options] <archive file>...\n"
+          "OPTIONS:\n"
+          "  -n, --limit=N        show at most N executables (top, cpu, durations and tree, default 10)\n"
+          "  -d, --depth=N        roll executables up into directories N levels deep (dirs, default 2)\n"
+          "  -u, --user=NAME      only count usage of NAME\n"
+          "  -c, --cgroup=PATH    only count usage of processes in the cgroup PATH\n"
+          "  -p, --prefix=PATH    only count executables whose path starts with PATH\n"
+          "  -S, --since=TIME     only count usage from TIME on\n"
+          "  -U, --until=TIME     only count usage before TIME\n"
+          "TIME is either YYYY-MM-DD [HH:MM] or a relative <N>s|m|h|d|w\n",
+          program, program);
+  exit(1);
+}
+
+// fills in `report` from `report <kind> [options]` and returns the index of the first argument after them
+int parse_report(char* program, int argc, char** argv, report_t* report) {
+  if (argc < 2) {
+    report_usage(program);
+  }
+
+  *report = (report_t) {
+    .limit = 10,
+    .depth = 2,
+  };
+
+  if (strcmp(argv[1], "top") == 0) {
+    report->kind = REPORT_TOP;
+  } else if (strcmp(argv[1], "users") == 0) {
+    report->kind = REPORT_USERS;
+  } else if (strcmp(argv[1], "dirs") == 0) {
+    report->kind = REPORT_DIRS;
+  } else if (strcmp(argv[1], "cpu") == 0) {
+    report->kind = REPORT_CPU;
+  } else if (strcmp(argv[1], "cgroups") == 0) {
+    report->kind = REPORT_CGROUPS;
+  } else if (strcmp(argv[1], "durations") == 0) {
+    report->kind = REPORT_DURATIONS;
+  } else if (strcmp(argv[1], "tree") == 0) {
+    report->kind = REPORT_TREE;
+  } else {
+    report_usage(program);
+  }
+
+  static struct option options[] = {
+    {"limit", required_argument, NULL, 'n'},
+    {"depth", required_argument, NULL, 'd'},
+    {"user", required_argument, NULL, 'u'},
+    {"cgroup", required_argument, NULL, 'c'},
+    {"prefix", required_argument, NULL, 'p'},
+    {"since", required_argument, NULL, 'S'},
+    {"until", required_argument, NULL, 'U'},
+    {},
+  };
+
+  int option = 0;
+  argc--;
+  argv++;
+  while ((option = getopt_long(argc, argv, "n:d:u:c:p:S:U:", options, NULL)) != -1) {
+    if (option == 'n' && atoi(optarg) > 0) {
+      report->limit = atoi(optarg);
+    } else if (option == 'd' && atoi(optarg) > 0) {
+      report->depth = atoi(optarg);
+    } else if (option == 'u') {
+      report->user = optarg;
+    } else if (option == 'c') {
+      report->cgroup = optarg;
+    } else if (option == 'p') {
+      report->prefix = optarg;
+    } else if (option == 'S') {
+      if (!parse_time(optarg, &report->since)) {
+        report_usage(program);
+      }
+    } else if (option == 'U') {
+      if (!parse_time(optarg, &report->until)) {
+        report_usage(program);
+      }
+    } else {
+      report_usage(program);
+    }
+  }
+
+  return optind + 1;
+}
+
+int report_main(char* program, int argc, char** argv) {
+  report_t report = {};
+  int first_path = parse_report(program, argc, argv, &report);
+  if (argc - first_path > 1) {
+    report_usage(program);
+  }
+
+  reader_cgroup = report.cgroup;
+  open_reader(first_path < argc ? argv[first_path] : default_db_path());
+  run_report(&report);
+
+  sqlite3_close(db);
+  return 0;
+}
+
+#define ARCHIVE_MAGIC "spycyarc"
+#define ARCHIVE_VERSION 2
+// version 1 stored the time columns as they are
+#define ARCHIVE_VERSION_V1 1
+
+// an archive stores every field of the usage rows in a column of its own, one varint per row
+typedef enum {
+  // the difference to the bucket of the row before, rows are sorted by bucket
+  ARCHIVE_BUCKET,
+  // index into the series table
+  ARCHIVE_SERIES,
+  ARCHIVE_NANOSECONDS,
+  ARCHIVE_CPU_USER,
+  ARCHIVE_CPU_SYSTEM,
+  ARCHIVE_READ_BYTES,
+  ARCHIVE_WRITE_BYTES,
+  ARCHIVE_MAX_RSS,
+  ARCHIVE_EXECUTIONS,
+  ARCHIVE_INCLUSIVE,
+  ARCHIVE_FLAGS,
+  // length and bytes of the histogram, itself delta encoded
+  ARCHIVE_DURATIONS,
+  ARCHIVE_COLUMNS,
+} archive_column_t;
+
+// an hour of a series tends to take about as long as its previous one, these columns hold the zigzag
+// encoded difference to the series' row before
+#define ARCHIVE_SERIES_DELTA_COLUMNS \
+  (1 << ARCHIVE_NANOSECONDS | 1 << ARCHIVE_CPU_USER | 1 << ARCHIVE_CPU_SYSTEM | 1 << ARCHIVE_INCLUSIVE)
+
+uint64_t zigzag_encode(int64_t value) {
+  return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+int64_t zigzag_decode(uint64_t value) {
+  return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+// followed by the dictionary (paths, users and cgroups as a varint length and bytes each), the
+// series (varint indexes into the dictionary for path, user and cgroup) and then the columns
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t strings_count;
+  uint32_t series_count;
+  uint32_t columns_count;
+  uint64_t rows_count;
+  int64_t first_bucket;
+  int64_t last_bucket;
+  uint64_t column_bytes[ARCHIVE_COLUMNS];
+} archive_header_t;
+
+// every combination of executable, user and cgroup is stored once and rows only refer to it
+typedef struct {
+  uint32_t path;
+  uint32_t user;
+  uint32_t cgroup;
+} archive_series_t;
+
+typedef struct {
+  archive_series_t key;
+  uint32_t value;
+} archive_series_item_t;
+
+typedef struct {
+  char* key;
+  uint32_t value;
+} archive_string_item_t;
+
+uint32_t archive_string_index(archive_string_item_t** strings, const char* string) {
+  ptrdiff_t index = shgeti(*strings, string);
+  if (index >= 0) {
+    return (*strings)[index].value;
+  }
+
+  uint32_t value = shlenu(*strings);
+  shput(*strings, string, value);
+  return value;
+}
+
+uint32_t archive_series_index(archive_series_item_t** series, archive_series_t key) {
+  ptrdiff_t index = hmgeti(*series, key);
+  if (index >= 0) {
+    return (*series)[index].value;
+  }
+
+  uint32_t value = hmlenu(*series);
+  hmput(*series, key, value);
+  return value;
+}
+
+// writes the closed buckets between --since and --until into a single archive file
+int archive_main(char* program, int argc, char** argv) {
+  static struct option options[] = {
+    {"output", required_argument, NULL, 'o'},
+    {"since", required_argument, NULL, 'S'},
+    {"until", required_argument, NULL, 'U'},
+    {},
+  };
+
+  char* output_path = NULL;
+  // the bucket being written to is not closed yet
+  time_t closed = time(NULL) / BUCKET_SECONDS * BUCKET_SECONDS;
+  time_t since = 0;
+  time_t until = closed;
+  bool valid = true;
+
+  int option = 0;
+  while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    if (option == 'o') {
+      output_path = optarg;
+    } else if (option == 'S') {
+      valid &= parse_time(optarg, &since);
+    } else if (option == 'U') {
+      valid &= parse_time(optarg, &until);
+    } else {
+      valid = false;
+    }
+  }
+
+  if (!valid || output_path == NULL || argc - optind > 1) {
+    fprintf(stderr, "USAGE: %s archive --output=PATH [--since=TIME] [--until=TIME] [path to database file]\n", program);
+    return 1;
+  }
+
+  until = until < closed ? until : closed;
+
+  open_reader(optind < argc ? argv[optind] : default_db_path());
+
+  sqlite3_stmt* select_statement = NULL;
+  if (sqlite3_prepare_v2(db,
+                         "select bucket, executable_path, username, cgroup, nanoseconds_spent, cpu_user_ns, "
+                         "       cpu_system_ns, read_bytes, write_bytes, max_rss_kb, executions, inclusive_ns, "
+                         "       flags, durations "
+                         "from spycy_all where bucket >= ? and bucket < ? order by bucket",
+                         -1, &select_statement, NULL) != SQLITE_OK ||
+      sqlite3_bind_int64(select_statement, 1, since) != SQLITE_OK ||
+      sqlite3_bind_int64(select_statement, 2, until) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare archive statement: %s\n", sqlite3_errmsg(db));
+  }
+
+  archive_string_item_t* strings = NULL;
+  sh_new_arena(strings);
+  archive_series_item_t* series = NULL;
+  uint8_t* columns[ARCHIVE_COLUMNS] = {};
+  // per series, the value of the delta encoded columns in its row before
+  int64_t* previous[ARCHIVE_COLUMNS] = {};
+
+  archive_header_t header = {
+    .version = ARCHIVE_VERSION,
+    .columns_count = ARCHIVE_COLUMNS,
+  };
+  memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+
+  int64_t previous_bucket = 0;
+  int rc = SQLITE_OK;
+  while ((rc = sqlite3_step(select_statement)) == SQLITE_ROW) {
+    int64_t bucket = sqlite3_column_int64(select_statement, 0);
+    if (header.rows_count == 0) {
+      header.first_bucket = bucket;
+      previous_bucket = bucket;
+    }
+    header.last_bucket = bucket;
+    header.rows_count++;
+
+    put_export_varint(&columns[ARCHIVE_BUCKET], bucket - previous_bucket);
+    previous_bucket = bucket;
+
+    archive_series_t key = {
+      .path = archive_string_index(&strings, (const char*) sqlite3_column_text(select_statement, 1)),
+      .user = archive_string_index(&strings, (const char*) sqlite3_column_text(select_statement, 2)),
+      .cgroup = archive_string_index(&strings, (const char*) sqlite3_column_text(select_statement, 3)),
+    };
+    uint32_t series_index = archive_series_index(&series, key);
+    put_export_varint(&columns[ARCHIVE_SERIES], series_index);
+
+    for (int column = ARCHIVE_NANOSECONDS; column <= ARCHIVE_FLAGS; column++) {
+      int64_t value = sqlite3_column_int64(select_statement, column + 2);
+      if ((ARCHIVE_SERIES_DELTA_COLUMNS & 1 << column) == 0) {
+        put_export_varint(&columns[column], value);
+        continue;
+      }
+
+      while (arrlenu(previous[column]) <= series_index) {
+        arrput(previous[column], 0);
+      }
+      put_export_varint(&columns[column], zigzag_encode(value - previous[column][series_index]));
+      previous[column][series_index] = value;
+    }
+
+    size_t durations_len = sqlite3_column_bytes(select_statement, 13);
+    put_export_varint(&columns[ARCHIVE_DURATIONS], durations_len);
+    if (durations_len > 0) {
+      memcpy(arraddnptr(columns[ARCHIVE_DURATIONS], durations_len), sqlite3_column_blob(select_statement, 13), durations_len);
+    }
+  }
+
+  sqlite3_finalize(select_statement);
+  sqlite3_close(db);
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "ERROR: failed to read usage: %s\n", sqlite3_errstr(rc));
+    return 1;
+  }
+
+  uint8_t* body = NULL;
+  for (size_t i = 0; i < shlenu(strings); i++) {
+    put_export_string(&body, strings[i].key);
+  }
+  for (size_t i = 0; i < hmlenu(series); i++) {
+    put_export_varint(&body, series[i].key.path);
+    put_export_varint(&body, series[i].key.user);
+    put_export_varint(&body, series[i].key.cgroup);
+  }
+  header.strings_count = shlenu(strings);
+  header.series_count = hmlenu(series);
+
+  for (int column = 0; column < ARCHIVE_COLUMNS; column++) {
+    header.column_bytes[column] = arrlenu(columns[column]);
+  }
+
+  // written next to it and renamed like snapshots, a crash halfway never leaves a torn archive
+  static char temporary_path[PATH_MAX] = {};
+  snprintf(temporary_path, PATH_MAX, "%.*s.tmp", PATH_MAX - 8, output_path);
+
+  // empty arrays are NULL and fwrite may not be handed NULL, gcc drops arrlenu's own check after it
+  FILE* file = fopen(temporary_path, "we");
+  bool written = file != NULL &&
+                 fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 (body == NULL || fwrite(body, 1, arrlenu(body), file) == arrlenu(body));
+  for (int column = 0; column < ARCHIVE_COLUMNS && written; column++) {
+    written = columns[column] == NULL || fwrite(columns[column], 1, arrlenu(columns[column]), file) == arrlenu(columns[column]);
+  }
+  written = written && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if (file != NULL) {
+    written = fclose(file) == 0 && written;
+  }
+
+  if (!written || rename(temporary_path, output_path) == -1) {
+    fprintf(stderr, "ERROR: failed to write archive %s: %s\n", output_path, strerror(errno));
+    unlink(temporary_path);
+    return 1;
+  }
+
+  size_t size = sizeof(header) + arrlenu(body);
+  for (int column = 0; column < ARCHIVE_COLUMNS; column++) {
+    size += arrlenu(columns[column]);
+    arrfree(columns[column]);
+    arrfree(previous[column]);
+  }
+  printf("LOG: archived %" PRIu64 " rows of %u series into %s, %zu bytes\n",
+         header.rows_count, header.series_count, output_path, size);
+
+  arrfree(body);
+  shfree(strings);
+  hmfree(series);
+  return 0;
+}
+
+// what a scan adds up for every series across all archives, only the columns its report reads.
+// for max_rss it is the largest value and for flags all of them or'ed together
+typedef struct {
+  int64_t sums[ARCHIVE_COLUMNS];
+  uint64_t rows;
+  uint64_t* durations;
+} scan_totals_t;
+
+uint32_t scan_columns(report_kind_t kind) {
+  switch (kind) {
+  case REPORT_CPU:
+    return 1 << ARCHIVE_CPU_USER | 1 << ARCHIVE_CPU_SYSTEM;
+  case REPORT_DURATIONS:
+    return 1 << ARCHIVE_EXECUTIONS | 1 << ARCHIVE_DURATIONS;
+  case REPORT_TREE:
+    return 1 << ARCHIVE_NANOSECONDS | 1 << ARCHIVE_INCLUSIVE;
+  default:
+    return 1 << ARCHIVE_NANOSECONDS;
+  }
+}
+
+typedef struct {
+  archive_string_item_t* strings;
+  archive_series_item_t* series;
+  scan_totals_t* totals;
+  uint64_t rows;
+} scan_t;
+
+// decodes `count` varints of a column, false if it runs out or holds garbage
+bool get_archive_column(const uint8_t* column, size_t column_len, size_t count, int64_t* values) {
+  size_t offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    // deltas and small counts fit in a single byte and skip the general decoder
+    if (offset < column_len && column[offset] < 0x80) {
+      values[i] = column[offset++];
+      continue;
+    }
+
+    uint64_t value = 0;
+    if (!get_varint(column, column_len, &offset, &value)) {
+      return false;
+    }
+    values[i] = value;
+  }
+  return true;
+}
+
+bool get_archive_string(const uint8_t* in, size_t in_len, size_t* offset, char string[PATH_MAX]) {
+  uint64_t len = 0;
+  if (!get_varint(in, in_len, offset, &len) || len >= PATH_MAX || len > in_len - *offset) {
+    return false;
+  }
+
+  memcpy(string, in + *offset, len);
+  string[len] = 0;
+  *offset += len;
+  return true;
+}
+
+// first row whose bucket is at least `bucket`, rows are sorted by it
+size_t archive_lower_bound(int64_t* buckets, size_t rows, int64_t bucket) {
+  size_t low = 0;
+  size_t high = rows;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (buckets[middle] < bucket) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// adds the rows of one archive that fall between since and until to the scan's totals. the bucket
+// column narrows them down to a range of rows, of the others only the ones the report reads are
+// decoded and only up to the end of that range. archives outside the time range are skipped after
+// reading their header
+bool scan_archive(scan_t* scan, char* path, report_t* report) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat info = {};
+  if (fd == -1 || fstat(fd, &info) == -1) {
+    fprintf(stderr, "ERROR: failed to open archive %s: %s\n", path, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+
+  size_t size = info.st_size;
+  const uint8_t* data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+
+  archive_header_t header = {};
+  if (data == MAP_FAILED || size < sizeof(header)) {
+    fprintf(stderr, "ERROR: %s is not an archive\n", path);
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+
+  if (memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) != 0 ||
+      (header.version != ARCHIVE_VERSION && header.version != ARCHIVE_VERSION_V1) ||
+      header.columns_count != ARCHIVE_COLUMNS) {
+    fprintf(stderr, "ERROR: %s is not a version %d archive\n", path, ARCHIVE_VERSION);
+    munmap((void*) data, size);
+    return false;
+  }
+
+  if (header.rows_count == 0 ||
+      (report->since != 0 && header.last_bucket < report->since) ||
+      (report->until != 0 && header.first_bucket >= report->until)) {
+    munmap((void*) data, size);
+    return true;
+  }
+
+  bool valid = true;
+  size_t offset = sizeof(header);
+
+  // the archive's dictionary and series, translated to the ones shared by every archive of the scan
+  static char string[PATH_MAX] = {};
+  uint32_t* strings = NULL;
+  for (uint32_t i = 0; i < header.strings_count && valid; i++) {
+    valid = get_archive_string(data, size, &offset, string);
+    arrput(strings, valid ? archive_string_index(&scan->strings, string) : 0);
+  }
+
+  uint32_t* series = NULL;
+  for (uint32_t i = 0; i < header.series_count && valid; i++) {
+    uint64_t ids[3] = {};
+    for (int j = 0; j < 3 && valid; j++) {
+      valid = get_varint(data, size, &offset, &ids[j]) && ids[j] < header.strings_count;
+    }
+    if (!valid) {
+      break;
+    }
+
+    archive_series_t key = {.path = strings[ids[0]], .user = strings[ids[1]], .cgroup = strings[ids[2]]};
+    arrput(series, archive_series_index(&scan->series, key));
+  }
+
+  const uint8_t* columns[ARCHIVE_COLUMNS] = {};
+  for (int column = 0; column < ARCHIVE_COLUMNS && valid; column++) {
+    valid = header.column_bytes[column] <= size - offset;
+    columns[column] = data + offset;
+    offset += valid ? header.column_bytes[column] : 0;
+  }
+
+  // one buffer every column is decoded into in turn
+  int64_t* values = valid ? malloc(header.rows_count * sizeof(*values)) : NULL;
+  valid = valid && values != NULL;
+
+  size_t first = 0;
+  size_t last = header.rows_count;
+  if (valid && (report->since != 0 || report->until != 0)) {
+    valid = get_archive_column(columns[ARCHIVE_BUCKET], header.column_bytes[ARCHIVE_BUCKET], header.rows_count, values);
+
+    if (valid) {
+      values[0] += header.first_bucket;
+      for (size_t i = 1; i < header.rows_count; i++) {
+        values[i] += values[i - 1];
+      }
+
+      first = report->since != 0 ? archive_lower_bound(values, header.rows_count, report->since) : 0;
+      last = report->until != 0 ? archive_lower_bound(values, header.rows_count, report->until) : header.rows_count;
+    }
+  }
+
+  // the archive's own series of every row up to the range's end, the delta encoded columns are
+  // decoded from the start
+  uint32_t* row_series = NULL;
+  int64_t* previous = NULL;
+  if (valid && last > first) {
+    row_series = malloc(last * sizeof(*row_series));
+    previous = malloc((header.series_count + 1) * sizeof(*previous));
+    valid = row_series != NULL && previous != NULL &&
+            get_archive_column(columns[ARCHIVE_SERIES], header.column_bytes[ARCHIVE_SERIES], last, values);
+  }
+
+  for (size_t i = 0; i < last && valid; i++) {
+    valid = (uint64_t) values[i] < header.series_count;
+    row_series[i] = valid ? values[i] : 0;
+  }
+
+  if (valid && last > first) {
+    while (arrlenu(scan->totals) < hmlenu(scan->series)) {
+      arrput(scan->totals, (scan_totals_t) {});
+    }
+
+    scan_totals_t* totals = scan->totals;
+    for (size_t i = first; i < last; i++) {
+      totals[series[row_series[i]]].rows++;
+    }
+
+    // a column at a time, each a tight loop over one array
+    uint32_t needed = scan_columns(report->kind);
+    for (int column = ARCHIVE_NANOSECONDS; column <= ARCHIVE_FLAGS && valid; column++) {
+      if ((needed & 1 << column) == 0) {
+        continue;
+      }
+
+      // peak rss of the buckets is the largest of them and the flags are whatever any bucket saw,
+      // the rest are counters
+      valid = get_archive_column(columns[column], header.column_bytes[column], last, values);
+      if (valid && header.version != ARCHIVE_VERSION_V1 && (ARCHIVE_SERIES_DELTA_COLUMNS & 1 << column) != 0) {
+        memset(previous, 0, header.series_count * sizeof(*previous));
+        for (size_t i = 0; i < last; i++) {
+          values[i] = previous[row_series[i]] += zigzag_decode(values[i]);
+        }
+      }
+
+      for (size_t i = first; i < last && valid; i++) {
+        int64_t* sum = &totals[series[row_series[i]]].sums[column];
+        if (column == ARCHIVE_MAX_RSS) {
+          *sum = values[i] > *sum ? values[i] : *sum;
+        } else if (column == ARCHIVE_FLAGS) {
+          *sum |= values[i];
+        } else {
+          *sum += values[i];
+        }
+      }
+    }
+
+    size_t durations_offset = 0;
+    for (size_t i = 0; i < last && valid && (needed & 1 << ARCHIVE_DURATIONS) != 0; i++) {
+      uint64_t len = 0;
+      const uint8_t* durations = columns[ARCHIVE_DURATIONS];
+      valid = get_varint(durations, header.column_bytes[ARCHIVE_DURATIONS], &durations_offset, &len) &&
+              len <= header.column_bytes[ARCHIVE_DURATIONS] - durations_offset;
+
+      if (valid && i >= first && len > 0) {
+        scan_totals_t* total = &totals[series[row_series[i]]];
+        if (total->durations == NULL) {
+          total->durations = calloc(DURATION_BUCKETS, sizeof(uint64_t));
+        }
+        valid = decode_histogram(durations + durations_offset, len, total->durations);
+      }
+      durations_offset += valid ? len : 0;
+    }
+
+    scan->rows += last - first;
+  }
+
+  if (!valid) {
+    fprintf(stderr, "ERROR: archive %s is corrupt\n", path);
+  }
+
+  free(values);
+  free(row_series);
+  free(previous);
+  arrfree(series);
+  arrfree(strings);
+  munmap((void*) data, size);
+  return valid;
+}
+
+// the totals of every series as a temporary `spycy_all`, so the scan is reported by run_report
+void load_scan(scan_t* scan) {
+  if (sqlite3_open(":memory:", &db) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to open scan database: %s\n", sqlite3_errmsg(db));
+  }
+  register_histogram_functions();
+
+  char* sql = NULL;
+  size_t sql_len = 0;
+  FILE* sql_stream = open_memstream(&sql, &sql_len);
+  fprintf(sql_stream, "create temp table spycy_all (");
+  for (size_t i = 0; i < USAGE_COLUMNS_COUNT; i++) {
+    fprintf(sql_stream, "%s%s", i == 0 ? "" : ", ", usage_columns[i].name);
+  }
+  fprintf(sql_stream, ")");
+  fclose(sql_stream);
+  exec_or_fail(sql);
+  free(sql);
+
+  sqlite3_stmt* insert_statement = NULL;
+  if (sqlite3_prepare_v2(db,
+                         "insert into spycy_all (executable_path, username, cgroup, bucket, nanoseconds_spent, "
+                         "                       cpu_user_ns, cpu_system_ns, read_bytes, write_bytes, max_rss_kb, "
+                         "                       executions, inclusive_ns, flags, durations, change_seq) "
+                         "values (?, ?, ?, 0, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 0)",
+                         -1, &insert_statement, NULL) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare scan statement: %s\n", sqlite3_errmsg(db));
+  }
+
+  exec_or_fail("begin");
+  for (size_t i = 0; i < arrlenu(scan->totals); i++) {
+    scan_totals_t* totals = &scan->totals[i];
+    if (totals->rows == 0) {
+      continue;
+    }
+
+    archive_series_t* key = &scan->series[i].key;
+
+    static uint8_t blob[HISTOGRAM_BLOB_MAX] = {};
+    size_t blob_len = totals->durations != NULL ? encode_histogram(totals->durations, blob) : 0;
+
+    int rc = SQLITE_OK;
+    if ((rc = sqlite3_bind_text(insert_statement, 1, scan->strings[key->path].key, -1, SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(insert_statement, 2, scan->strings[key->user].key, -1, SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(insert_statement, 3, scan->strings[key->cgroup].key, -1, SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_blob(insert_statement, 13, blob_len > 0 ? blob : NULL, blob_len, SQLITE_STATIC)) != SQLITE_OK) {
+      SQLITE3_FAIL("ERROR: failed to bind scan statement: %s\n", sqlite3_errstr(rc));
+    }
+    for (int column = ARCHIVE_NANOSECONDS; column <= ARCHIVE_FLAGS; column++) {
+      if ((rc = sqlite3_bind_int64(insert_statement, 4 + column - ARCHIVE_NANOSECONDS, totals->sums[column])) != SQLITE_OK) {
+        SQLITE3_FAIL("ERROR: failed to bind scan statement: %s\n", sqlite3_errstr(rc));
+      }
+    }
+
+    if (sqlite3_step(insert_statement) != SQLITE_DONE) {
+      SQLITE3_FAIL("ERROR: failed to load scan: %s\n", sqlite3_errmsg(db));
+    }
+    sqlite3_reset(insert_statement);
+    free(totals->durations);
+  }
+  exec_or_fail("commit");
+
+  sqlite3_finalize(insert_statement);
+}
+
+int scan_main(char* program, int argc, char** argv) {
+  report_t report = {};
+  int first_path = parse_report(program, argc, argv, &report);
+  if (first_path == argc) {
+    report_usage(program);
+  }
+
+  uint64_t start_ns = monotonic_now_ns();
+
+  scan_t scan = {};
+  sh_new_arena(scan.strings);
+  for (int i = first_path; i < argc; i++) {
+    if (!scan_archive(&scan, argv[i], &report)) {
+      return 1;
+    }
+  }
+
+  // the archives already left out what is outside the time range, the rest is filtered as usual
+  uint64_t scan_ns = monotonic_now_ns() - start_ns;
+  load_scan(&scan);
+  report.since = 0;
+  report.until = 0;
+  run_report(&report);
+  sqlite3_close(db);
+
+  fprintf(stderr, "LOG: scanned %" PRIu64 " rows of %d archives in %.3f ms, %.3f ms in total\n",
+          scan.rows, argc - first_path, scan_ns / 1e6, (monotonic_now_ns() - start_ns) / 1e6);
+
+  arrfree(scan.totals);
+  hmfree(scan.series);
+  shfree(scan.strings);
+  return 0;
+}
+
+int tail_main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "USAGE: %s tail <path to ring file>\n", argv[0]);
+    return 1;
+  }
+
+  spycy_ring_t reader = {};
+  if (spycy_ring_open(&reader, argv[1]) == -1) {
+    fprintf(stderr, "ERROR: failed to open ring %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  if (signal(SIGINT, signal_handler) == SIG_ERR || signal(SIGTERM, signal_handler) == SIG_ERR) {
+    perror("ERROR: signal");
+    return 1;
+  }
+
+  uint64_t missed = 0;
+  uint64_t reported_missed = 0;
+  spycy_ring_record_t record = {};
+
+  while (!quit) {
+    if (!spycy_ring_next(&reader, &record, &missed)) {
+      fflush(stdout);
+
+      struct timespec pause = {.tv_nsec = 10 * 1000 * 1000};
+      nanosleep(&pause, NULL);
+      continue;
+    }
+
+    if (missed != reported_missed) {
+      fprintf(stderr, "WARNING: fell behind, %" PRIu64 " records were overwritten\n", missed - reported_missed);
+      reported_missed = missed;
+    }
+
+    static char executable_path[PATH_MAX] = {};
+    bool known = spycy_ring_executable(&reader, &record, executable_path, sizeof(executable_path));
+    printf("%s\t%d\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s\n",
+           record.kind == SPYCY_RING_EXEC ? "exec" : "exit",
+           record.tgid, username_by_uid(record.uid),
+           record.start_time_ns, record.end_time_ns, record.duration_ns,
+           known ? executable_path : "?");
+  }
+
+  spycy_ring_close(&reader);
+  return 0;
+}
+
+// `spycy aggregate`: merges the batches --export ships from many hosts into one database
+typedef struct {
+  event_source_t source;
+  uint8_t* input;
+  char host[256];
+  uint64_t epoch;
+  bool greeted;
+  // 1 for agents that send whole strings and no cgroups
+  int version;
+} aggregator_client_t;
+
+// an agent's sequence number only matters while it may send a batch again, which it stops doing long
+// before this
+#define AGGREGATOR_AGENTS_KEPT_SECONDS (7 * 24 * 3600)
+
+typedef enum {
+  EXPORT_BATCH_APPLIED,
+  // sending it again would not help
+  EXPORT_BATCH_MALFORMED,
+  // the database failed, it may go in the next time
+  EXPORT_BATCH_FAILED,
+} export_batch_result_t;
+
+sqlite3_stmt* aggregator_select_seq = NULL;
+sqlite3_stmt* aggregator_upsert_row = NULL;
+sqlite3_stmt* aggregator_upsert_agent = NULL;
+sqlite3_stmt* aggregator_prune_agents = NULL;
+
+char* aggregator_schema =
+  "create table if not exists spycy_fleet ("
+  " host text not null,"
+  " executable_path text not null,"
+  " username text not null,"
+  " cgroup text not null default '',"
+  " bucket integer not null,"
+  " nanoseconds_spent integer not null,"
+  " executions integer not null,"
+  " primary key(host, executable_path, username, cgroup, bucket)"
+  ");"
+  "create index if not exists spycy_fleet_by_bucket on spycy_fleet (bucket);"
+  "create table if not exists spycy_agents ("
+  " host text not null,"
+  " epoch integer not null,"
+  " seq integer not null,"
+  " updated_at integer not null,"
+  " primary key(host, epoch)"
+  ");";
+
+// spycy_fleet from before agents sent cgroups, its rows move to the empty cgroup
+char* aggregator_upgrade =
+  "begin;"
+  "alter table spycy_fleet rename to spycy_fleet_v1;"
+  "drop index spycy_fleet_by_bucket;"
+  "create table spycy_fleet ("
+  " host text not null,"
+  " executable_path text not null,"
+  " username text not null,"
+  " cgroup text not null default '',"
+  " bucket integer not null,"
+  " nanoseconds_spent integer not null,"
+  " executions integer not null,"
+  " primary key(host, executable_path, username, cgroup, bucket)"
+  ");"
+  "create index spycy_fleet_by_bucket on spycy_fleet (bucket);"
+  "insert into spycy_fleet (host, executable_path, username, bucket, nanoseconds_spent, executions) "
+  " select host, executable_path, username, bucket, nanoseconds_spent, executions from spycy_fleet_v1;"
+  "drop table spycy_fleet_v1;"
+  "commit;";
+
+void close_aggregator_client(aggregator_client_t* client) {
+  close(client->source.fd);
+  arrfree(client->input);
+  free(client);
+}
+
+bool take_export_string(uint8_t* payload, size_t len, size_t* offset, char** string) {
+  uint64_t string_len = 0;
+  if (!get_varint(payload, len, offset, &string_len) || len - *offset < string_len) {
+    return false;
+  }
+  *string = strndup((char *) payload + *offset, string_len);
+  *offset += string_len;
+  return true;
+}
+
+// the rows go in within one transaction with the batch's sequence number, so a batch sent again
+// after its ack got lost is recognized and skipped
+export_batch_result_t apply_export_batch(aggregator_client_t* client, uint8_t* payload, size_t len, uint64_t* seq) {
+  size_t offset = 1;
+  uint64_t strings_count = 0;
+  uint64_t rows_count = 0;
+  char** strings = NULL;
+  uint64_t* rows = NULL;
+  // the strings a row refers to come first, the numbers after them
+  size_t string_fields = client->version == 1 ? 2 : 3;
+  size_t fields = string_fields + 3;
+
+  bool valid = get_varint(payload, len, &offset, seq) && get_varint(payload, len, &offset, &strings_count);
+  for (uint64_t i = 0; valid && i < strings_count; i++) {
+    const char* previous = i > 0 ? strings[i - 1] : "";
+    uint64_t shared = 0;
+    char* own = NULL;
+    valid = (client->version == 1 || (get_varint(payload, len, &offset, &shared) && shared <= strlen(previous))) &&
+            take_export_string(payload, len, &offset, &own);
+
+    char* string = NULL;
+    if (valid) {
+      string = malloc(shared + strlen(own) + 1);
+      memcpy(string, previous, shared);
+      strcpy(string + shared, own);
+    }
+    free(own);
+    arrput(strings, string);
+  }
+  valid = valid && get_varint(payload, len, &offset, &rows_count);
+  for (uint64_t i = 0; valid && i < rows_count * fields; i++) {
+    uint64_t value = 0;
+    valid = get_varint(payload, len, &offset, &value) && (i % fields >= string_fields || value < strings_count);
+    arrput(rows, value);
+  }
+  valid = valid && offset == len;
+
+  bool applied = false;
+  if (valid && sqlite3_exec(db, "begin immediate;", NULL, NULL, NULL) == SQLITE_OK) {
+    sqlite3_reset(aggregator_select_seq);
+    sqlite3_bind_text(aggregator_select_seq, 1, client->host, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(aggregator_select_seq, 2, (int64_t) client->epoch);
+    bool seen = sqlite3_step(aggregator_select_seq) == SQLITE_ROW &&
+                (uint64_t) sqlite3_column_int64(aggregator_select_seq, 0) >= *seq;
+    sqlite3_reset(aggregator_select_seq);
+
+    bool ok = true;
+    for (uint64_t i = 0; ok && !seen && i < rows_count; i++) {
+      uint64_t* row = &rows[i * fields];
+      uint64_t* numbers = row + string_fields;
+      sqlite3_reset(aggregator_upsert_row);
+      ok = sqlite3_bind_text(aggregator_upsert_row, 1, client->host, -1, SQLITE_STATIC) == SQLITE_OK &&
+           sqlite3_bind_text(aggregator_upsert_row, 2, strings[row[0]], -1, SQLITE_STATIC) == SQLITE_OK &&
+           sqlite3_bind_text(aggregator_upsert_row, 3, strings[row[1]], -1, SQLITE_STATIC) == SQLITE_OK &&
+           sqlite3_bind_text(aggregator_upsert_row, 4, string_fields > 2 ? strings[row[2]] : "", -1, SQLITE_STATIC) == SQLITE_OK &&
+           sqlite3_bind_int64(aggregator_upsert_row, 5, numbers[0] * BUCKET_SECONDS) == SQLITE_OK &&
+           sqlite3_bind_int64(aggregator_upsert_row, 6, numbers[1]) == SQLITE_OK &&
+           sqlite3_bind_int64(aggregator_upsert_row, 7, numbers[2]) == SQLITE_OK &&
+           sqlite3_step(aggregator_upsert_row) == SQLITE_DONE;
+    }
+
+    if (ok && !seen) {
+      sqlite3_reset(aggregator_upsert_agent);
+      ok = sqlite3_bind_text(aggregator_upsert_agent, 1, client->host, -1, SQLITE_STATIC) == SQLITE_OK &&
+           sqlite3_bind_int64(aggregator_upsert_agent, 2, (int64_t) client->epoch) == SQLITE_OK &&
+           sqlite3_bind_int64(aggregator_upsert_agent, 3, *seq) == SQLITE_OK &&
+           sqlite3_bind_int64(aggregator_upsert_agent, 4, time(NULL)) == SQLITE_OK &&
+           sqlite3_step(aggregator_upsert_agent) == SQLITE_DONE;
+    }
+
+    applied = ok && sqlite3_exec(db, "commit;", NULL, NULL, NULL) == SQLITE_OK;
+    if (!applied) {
+      fprintf(stderr, "WARNING: failed to apply batch %" PRIu64 " from %s: %s\n", *seq, client->host, sqlite3_errmsg(db));
+      sqlite3_exec(db, "rollback;", NULL, NULL, NULL);
+    }
+  }
+
+  for (size_t i = 0; i < arrlenu(strings); i++) {
+    free(strings[i]);
+  }
+  arrfree(strings);
+  arrfree(rows);
+  return !valid ? EXPORT_BATCH_MALFORMED : applied ? EXPORT_BATCH_APPLIED : EXPORT_BATCH_FAILED;
+}
+
+// agents that have not sent anything for a long time are forgotten, every start of one adds a row
+void prune_aggregator_agents() {
+  sqlite3_reset(aggregator_prune_agents);
+  if (sqlite3_bind_int64(aggregator_prune_agents, 1, time(NULL) - AGGREGATOR_AGENTS_KEPT_SECONDS) != SQLITE_OK ||
+      sqlite3_step(aggregator_prune_agents) != SQLITE_DONE) {
+    fprintf(stderr, "WARNING: failed to prune spycy_agents: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_reset(aggregator_prune_agents);
+}
+
+bool handle_aggregator_frame(aggregator_client_t* client, uint8_t* payload, size_t len) {
+  bool current = len >= 1 + strlen(EXPORT_MAGIC) && memcmp(payload + 1, EXPORT_MAGIC, strlen(EXPORT_MAGIC)) == 0;
+  bool v1 = len >= 1 + strlen(EXPORT_MAGIC_V1) && memcmp(payload + 1, EXPORT_MAGIC_V1, strlen(EXPORT_MAGIC_V1)) == 0;
+  if ((current || v1) && payload[0] == EXPORT_FRAME_HELLO) {
+    client->version = current ? 2 : 1;
+    size_t offset = 1 + strlen(EXPORT_MAGIC);
+    char* host = NULL;
+    if (!get_varint(payload, len, &offset, &client->epoch) || !take_export_string(payload, len, &offset, &host)) {
+      return false;
+    }
+    snprintf(client->host, sizeof(client->host), "%s", host);
+    free(host);
+
+    if (!client->greeted) {
+      printf("LOG: agent %s connected\n", client->host);
+      fflush(stdout);
+      prune_aggregator_agents();
+    }
+    client->greeted = true;
+    return true;
+  }
+
+  if (len < 1 || payload[0] != EXPORT_FRAME_BATCH || !client->greeted) {
+    return false;
+  }
+
+  uint64_t seq = 0;
+  export_batch_result_t result = apply_export_batch(client, payload, len, &seq);
+  if (result == EXPORT_BATCH_FAILED) {
+    return false;
+  }
+
+  // the frame around it is intact, so the connection carries on with the next one
+  if (result == EXPORT_BATCH_MALFORMED) {
+    fprintf(stderr, "WARNING: rejected a malformed batch from %s\n", client->host);
+  }
+
+  // tiny and rare, a socket too full for it belongs to an agent that stopped reading
+  uint8_t* ack = start_export_frame(result == EXPORT_BATCH_APPLIED ? EXPORT_FRAME_ACK : EXPORT_FRAME_REJECT);
+  if (result == EXPORT_BATCH_APPLIED) {
+    put_export_varint(&ack, seq);
+  }
+  finish_export_frame(ack);
+  bool sent = send(client->source.fd, ack, arrlenu(ack), MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t) arrlenu(ack);
+  arrfree(ack);
+  return sent;
+}
+
+void handle_aggregator_client(event_source_t* source, uint32_t events) {
+  aggregator_client_t* client = (aggregator_client_t*) source;
+
+  static uint8_t buffer[64 * 1024];
+  ssize_t received = 0;
+  while ((received = recv(source->fd, buffer, sizeof(buffer), 0)) > 0) {
+    memcpy(arraddnptr(client->input, received), buffer, received);
+  }
+  bool closed = received == 0 || (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ||
+                (events & (EPOLLERR | EPOLLHUP));
+
+  // an agent that sent its last batches and hung up in the same breath still gets them applied
+  bool failed = false;
+  size_t offset = 0;
+  uint32_t len = 0;
+  while (!failed && arrlenu(client->input) - offset >= sizeof(len)) {
+    memcpy(&len, client->input + offset, sizeof(len));
+    if (len > EXPORT_FRAME_MAX) {
+      failed = true;
+      break;
+    }
+    if (arrlenu(client->input) - offset - sizeof(len) < len) {
+      break;
+    }
+
+    failed = !handle_aggregator_frame(client, client->input + offset + sizeof(len), len);
+    offset += sizeof(len) + len;
+  }
+
+  if (closed || failed) {
+    close_aggregator_client(client);
+    return;
+  }
+  arrdeln(client->input, 0, offset);
+}
+
+void accept_aggregator_clients(event_source_t* source, uint32_t events) {
+  (void) events;
+
+  int client_fd = -1;
+  while ((client_fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    aggregator_client_t* client = calloc(1, sizeof(*client));
+    assert(client != NULL);
+
+    client->source.fd = client_fd;
+    client->source.handle = handle_aggregator_client;
+    watch(&client->source, EPOLLIN);
+  }
+}
+
+event_source_t aggregator_source = {
+  .fd = -1,
+  .handle = accept_aggregator_clients,
+};
+
+void prepare_aggregator_statement(char* sql, sqlite3_stmt** statement) {
+  if (sqlite3_prepare_v2(db, sql, -1, statement, NULL) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to prepare aggregator statement: %s\n", sqlite3_errmsg(db));
+  }
+}
+
+int aggregate_main(char* program, int argc, char** argv) {
+  static struct option options[] = {
+    {"listen", required_argument, NULL, 'l'},
+    {},
+  };
+
+  char* listen_address = NULL;
+  int option = 0;
+  while ((option = getopt_long(argc, argv, "l:", options, NULL)) != -1) {
+    if (option == 'l') {
+      listen_address = optarg;
+    } else {
+      listen_address = NULL;
+      break;
+    }
+  }
+
+  if (listen_address == NULL || argc - optind > 1) {
+    fprintf(stderr, "USAGE: %s aggregate --listen=HOST:PORT|PATH [path to database file]\n", program);
+    return 1;
+  }
+
+  char* path = optind < argc ? argv[optind] : default_db_path();
+  if (sqlite3_open(path, &db) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: failed to open database at %s: %s\n", path, sqlite3_errmsg(db));
+    return 1;
+  }
+  sqlite3_busy_timeout(db, 5000);
+
+  char* error_message = NULL;
+  sqlite3_exec(db, "pragma journal_mode = wal;", NULL, NULL, NULL);
+  sqlite3_stmt* columns_statement = NULL;
+  bool outdated = sqlite3_prepare_v2(db, "select count(*) > 0 and sum(name = 'cgroup') = 0 "
+                                         "from pragma_table_info('spycy_fleet')",
+                                     -1, &columns_statement, NULL) == SQLITE_OK &&
+                  sqlite3_step(columns_statement) == SQLITE_ROW &&
+                  sqlite3_column_int(columns_statement, 0) != 0;
+  sqlite3_finalize(columns_statement);
+  if (outdated && sqlite3_exec(db, aggregator_upgrade, NULL, NULL, &error_message) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to add cgroups to spycy_fleet: %s\n", error_message);
+  }
+  if (sqlite3_exec(db, aggregator_schema, NULL, NULL, &error_message) != SQLITE_OK) {
+    SQLITE3_FAIL("ERROR: failed to create aggregator tables: %s\n", error_message);
+  }
+
+  prepare_aggregator_statement("select seq from spycy_agents where host = ? and epoch = ?",
+                               &aggregator_select_seq);
+  prepare_aggregator_statement("insert into spycy_fleet "
+                               "(host, executable_path, username, cgroup, bucket, nanoseconds_spent, executions) "
+                               "values (?, ?, ?, ?, ?, ?, ?) "
+                               "on conflict (host, executable_path, username, cgroup, bucket) do update set "
+                               " nanoseconds_spent = nanoseconds_spent + excluded.nanoseconds_spent, "
+                               " executions = executions + excluded.executions",
+                               &aggregator_upsert_row);
+  prepare_aggregator_statement("insert into spycy_agents (host, epoch, seq, updated_at) values (?, ?, ?, ?) "
+                               "on conflict (host, epoch) do update set "
+                               " seq = excluded.seq, updated_at = excluded.updated_at",
+                               &aggregator_upsert_agent);
+  prepare_aggregator_statement("delete from spycy_agents where updated_at < ?", &aggregator_prune_agents);
+  prune_aggregator_agents();
+
+  if (signal(SIGINT, signal_handler) == SIG_ERR || signal(SIGTERM, signal_handler) == SIG_ERR) {
+    FAIL("signal");
+  }
+
+  if ((event_loop = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    FAIL("epoll_create1");
+  }
+
+  bool is_unix = strchr(listen_address, '/') != NULL;
+  aggregator_source.fd = is_unix ? listen_unix(listen_address) : listen_tcp(listen_address);
+  watch(&aggregator_source, EPOLLIN);
+
+  printf("LOG: aggregating into %s, listening on %s\n", path, listen_address);
+  fflush(stdout);
+
+  while (!quit) {
+    static struct epoll_event events[64] = {};
+    int ready = epoll_wait(event_loop, events, sizeof(events) / sizeof(events[0]), -1);
+    if (ready == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ready == -1) {
+      FAIL("epoll_wait");
+    }
+
+    for (int i = 0; i < ready; i++) {
+      event_source_t* source = events[i].data.ptr;
+      source->handle(source, events[i].events);
+    }
+  }
+
+  if (is_unix) {
+    unlink(listen_address);
+  }
+  sqlite3_finalize(aggregator_select_seq);
+  sqlite3_finalize(aggregator_upsert_row);
+  sqlite3_finalize(aggregator_upsert_agent);
+  sqlite3_finalize(aggregator_prune_agents);
+  sqlite3_close(db);
+  return 0;
+}
+
+noreturn void usage(char* program) {
+  fprintf(stderr,
+          "USAGE: %s [options] [path to database file]\n"
+          "       %s dump [path to database file]\n"
+          "       %s report top|users|dirs|cpu|cgroups|durations|tree [options] [path to database file]\n"
+          "       %s tail <path to ring file>\n"
+          "       %s aggregate --listen=HOST:PORT|PATH [path to database file]\n"
+          "       %s changes [--since=CURSOR] [--cursor-file=PATH] [--format=csv|binary] [path to database file]\n"
+          "       %s archive --output=PATH [--since=TIME] [--until=TIME] [path to database file]\n"
+          "       %s scan top|users|dirs|cpu|cgroups|durations|tree [options] <archive file>...\n"
+          "OPTIONS:\n"
+          "  -s, --shard=none|day|week  write usage into one database file per day or per week\n"
+          "  -r, --retention=N          keep only the N most recent shard files\n"
+          "  -f, --flush-interval=N     write usage to the database every N seconds, 0 after every exit (default 1)\n"
+          "  -l, --socket=PATH          serve live usage over a unix socket at PATH\n"
+          "  -m, --metrics=ADDRESS      serve prometheus metrics on HOST:PORT or a unix socket PATH\n"
+          "      --ring=PATH            publish exec/exit records into a shared memory ring at PATH\n"
+          "      --ring-size=N          records the ring holds, rounded up to a power of two (default 65536)\n"
+          "      --no-taskstats         do not record cpu time, memory and i/o from taskstats\n"
+          "      --rules=PATH           include or exclude processes by path, glob, uid or cgroup, see README\n"
+          "      --top-k=K              keep only the K busiest executables, fold the rest into their directories\n"
+          "      --tail-depth=N         how many directory levels folded executables keep (default 1)\n"
+          "      --sample-above=N       above N execs a second track only a sample of processes and scale it up\n"
+          "      --max-processes=N      track at most N running processes, evicting dead ones whose exit was missed\n"
+          "      --sweep-batch=N        check N tracked processes for a missed exit every second, 0 to never (default 64)\n"
+          "      --handoff=PATH         take over from the spycy listening at PATH, then listen there for the next one\n"
+          "      --snapshot=PATH        keep timing processes that outlive a restart, saving them to PATH in between\n"
+          "      --export=ADDRESS       ship usage to a spycy aggregate at HOST:PORT or a unix socket PATH\n"
+          "      --export-interval=N    seconds of usage every exported batch holds (default 10)\n",
+          program, program, program, program, program, program, program, program);
+  exit(1);
+}
+
+// the benchmark includes this file and brings its own main
+#ifndef SPYCY_NO_MAIN
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "dump") == 0) {
+    return dump_main(argc - 1, argv + 1);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "report") == 0) {
+    return report_main(argv[0], argc - 1, argv + 1);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "tail") == 0) {
+    return tail_main(argc - 1, argv + 1);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "aggregate") == 0) {
+    return aggregate_main(argv[0], argc - 1, argv + 1);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "changes") == 0) {
+    return changes_main(argv[0], argc - 1, argv + 1);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "archive") == 0) {
+    return archive_main(argv[0], argc - 1, argv + 1);
+  }
+
+  if (argc > 1 && strcmp(argv[1], "scan") == 0) {
+    return scan_main(argv[0], argc - 1, argv + 1);
+  }
+
+  static struct option options[] = {
+    {"shard", required_argument, NULL, 's'},
+    {"retention", required_argument, NULL, 'r'},
+    {"flush-interval", required_argument, NULL, 'f'},
+    {"socket", required_argument, NULL, 'l'},
+    {"metrics", required_argument, NULL, 'm'},
+    {"ring", required_argument, NULL, 'R'},
+    {"ring-size", required_argument, NULL, 'N'},
+    {"no-taskstats", no_argument, NULL, 'T'},
+    {"rules", required_argument, NULL, 'x'},
+    {"top-k", required_argument, NULL, 'K'},
+    {"tail-depth", required_argument, NULL, 'D'},
+    {"sample-above", required_argument, NULL, 'S'},
+    {"max-processes", required_argument, NULL, 'P'},
+    {"sweep-batch", required_argument, NULL, 'W'},
+    {"handoff", required_argument, NULL, 'H'},
+    {"snapshot", required_argument, NULL, 'Z'},
+    {"export", required_argument, NULL, 'E'},
+    {"export-interval", required_argument, NULL, 'J'},
+    {},
+  };
+
+  int option = 0;
+  while ((option = getopt_long(argc, argv, "s:r:f:l:m:", options, NULL)) != -1) {
+    if (option == 's' && strcmp(optarg, "none") == 0) {
+      shard_mode = SHARD_NONE;
+    } else if (option == 's' && strcmp(optarg, "day") == 0) {
+      shard_mode = SHARD_DAY;
+    } else if (option == 's' && strcmp(optarg, "week") == 0) {
+      shard_mode = SHARD_WEEK;
+    } else if (option == 'r' && atoi(optarg) > 0) {
+      shard_retention = atoi(optarg);
+    } else if (option == 'f' && atoi(optarg) >= 0) {
+      flush_interval = atoi(optarg);
+    } else if (option == 'l') {
+      stats_socket_path = optarg;
+    } else if (option == 'm') {
+      metrics_address = optarg;
+    } else if (option == 'R') {
+      ring_path = optarg;
+    } else if (option == 'T') {
+      taskstats_enabled = false;
+    } else if (option == 'x') {
+      load_rules(optarg);
+    } else if (option == 'K' && atoi(optarg) > 0) {
+      top_k = atoi(optarg);
+    } else if (option == 'D' && atoi(optarg) > 0) {
+      tail_depth = atoi(optarg);
+    } else if (option == 'S' && atoll(optarg) > 0) {
+      sample_above = atoll(optarg);
+    } else if (option == 'P' && atoll(optarg) > 0) {
+      max_processes = atoll(optarg);
+    } else if (option == 'W' && atoll(optarg) >= 0) {
+      sweep_batch = atoll(optarg);
+    } else if (option == 'H') {
+      handoff_path = optarg;
+    } else if (option == 'Z') {
+      snapshot_path = optarg;
+    } else if (option == 'E') {
+      export_address = optarg;
+    } else if (option == 'J' && atoi(optarg) > 0) {
+      export_interval = atoi(optarg);
+    } else if (option == 'N' && atoll(optarg) > 0) {
+      // slots are picked with a mask
+      ring_capacity = 1;
+      while (ring_capacity < (uint64_t) atoll(optarg)) {
+        ring_capacity *= 2;
+      }
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (argc - optind > 1) {
+    usage(argv[0]);
+  }
+
+  base_db_path = optind < argc ? argv[optind] : default_db_path();
+
+  // an instance already running hands over its sockets and processes, see --handoff. it has
+  // closed the database by the time we open it
+  bool took_over = handoff_path != NULL && take_over(handoff_path);
+
+  // once the old instance has stopped writing into its ring
+  if (ring_path != NULL) {
+    start_ring(ring_path);
+  }
+
+  if (shard_mode == SHARD_NONE) {
+    open_db(base_db_path);
+  } else {
+    rotate_shard();
+  }
+
+  if (!took_over) {
+    start_connector();
+  }
+
+  // after the connector, so exits that happen while it loads are queued rather than missed
+  if (!took_over && snapshot_path != NULL) {
+    load_snapshot(snapshot_path);
+  }
+
+  if (signal(SIGINT, signal_handler) == SIG_ERR || signal(SIGTERM, signal_handler) == SIG_ERR ||
+      signal(SIGUSR1, dump_signal_handler) == SIG_ERR) {
+    FAIL("signal");
+  }
+
+  if ((event_loop = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    FAIL("epoll_create1");
+  }
+
+  netlink_source.fd = connection;
+  watch(&netlink_source, EPOLLIN);
+
+  start_timer();
+
+  if (connection_taskstats != -1 && !taskstats_enabled) {
+    close(connection_taskstats);
+    connection_taskstats = -1;
+  }
+
+  if (connection_taskstats != -1) {
+    taskstats_source.fd = connection_taskstats;
+    watch(&taskstats_source, EPOLLIN);
+  } else if (taskstats_enabled) {
+    start_taskstats();
+  }
+
+  if (stats_socket_path != NULL) {
+    start_stats_server(stats_socket_path);
+  }
+
+  if (metrics_address != NULL) {
+    start_metrics_server(metrics_address);
+  }
+
+  if (handoff_path != NULL) {
+    start_handoff_server(handoff_path);
+  }
+
+  while (!quit) {
+    if (should_close) {
+      break;
+    }
+
+    static struct epoll_event events[64] = {};
+    int ready = epoll_wait(event_loop, events, sizeof(events) / sizeof(events[0]), -1);
+    if (dump_requested) {
+      dump_requested = 0;
+      dump_self_metrics();
+    }
+    if (ready == -1 && errno == EINTR) {
+      continue;
+    }
+    if (ready == -1) {
+      FAIL("epoll_wait");
+    }
+
+    for (int i = 0; i < ready; i++) {
+      event_source_t* source = events[i].data.ptr;
+      source->handle(source, events[i].events);
     }
   }
 
   destruct();
 }
+#endif // SPYCY_NO_MAIN
@@ -0,0 +1,243 @@
+// replays synthetic proc connector events through handle_message to measure the hot path without the
+// kernel, /proc or a disk in the way:
+//
+//   $ make bench
+//   $ ./spycy_bench --events=2000000 --mix=4:4:5 --paths=100000 --sink=null
+//
+// the events are generated up front, so only spycy's own work is timed
+#include "spycy_bench.h"
+
+#include <sys/resource.h>
+
+// every allocation in the process goes through here, sqlite's included
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void __libc_free(void* pointer);
+
+uint64_t allocations = 0;
+
+void* malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+  allocations++;
+  return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer) {
+  __libc_free(pointer);
+}
+
+typedef struct {
+  // a cn_msg immediately followed by its proc_event, as in the kernel's messages: the cn_msg is aligned,
+  // the proc_event after its 20 bytes need not be 8 byte aligned
+  _Alignas(struct cn_msg) char message[sizeof(struct cn_msg) + sizeof(struct proc_event)];
+  // the executable an exec resolves to
+  uint32_t path;
+} bench_event_t;
+
+uint32_t bench_path = 0;
+
+int bench_executable_path(pid_t pid, char executable_path[PATH_MAX]) {
+  (void) pid;
+  return snprintf(executable_path, PATH_MAX, "/usr/bench/%u/executable-%u", bench_path % 16, bench_path);
+}
+
+int bench_uid(pid_t pid, uid_t* uid) {
+  (void) pid;
+  *uid = 0;
+  return 0;
+}
+
+int bench_cgroup(pid_t pid, char cgroup_path[PATH_MAX]) {
+  snprintf(cgroup_path, PATH_MAX, "/bench/%d", pid % 4);
+  return 0;
+}
+
+long peak_rss_kb() {
+  struct rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+noreturn void bench_usage(char* program) {
+  fprintf(stderr,
+          "USAGE: %s [options]\n"
+          "OPTIONS:\n"
+          "      --events=N             events to replay (default 1000000)\n"
+          "      --mix=EXEC:EXIT:FORK   relative weights of the event types (default 1:1:1)\n"
+          "      --paths=N              distinct executables execs pick from (default 1000)\n"
+          "      --live=N               processes alive at most at once (default 1000)\n"
+          "      --pid-max=N            size of the pid space, smaller means pids get reused sooner (default 32768)\n"
+          "      --sink=null|memory     drop aggregates or write them to an in-memory database (default memory)\n"
+          "      --flush-every=N        flush after every N events, like the timer does (default 100000)\n"
+          "      --top-k=K              run with --top-k=K\n"
+          "      --seed=N               seed of the event stream\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  size_t events_count = 1000000;
+  unsigned mix[3] = {1, 1, 1};
+  uint32_t paths = 1000;
+  size_t live_max = 1000;
+  pid_t pid_max = 32768;
+  bool null_sink = false;
+  size_t flush_every = 100000;
+
+  struct option options[] = {
+    {"events", required_argument, NULL, 'n'},
+    {"mix", required_argument, NULL, 'm'},
+    {"paths", required_argument, NULL, 'p'},
+    {"live", required_argument, NULL, 'l'},
+    {"pid-max", required_argument, NULL, 'P'},
+    {"sink", required_argument, NULL, 's'},
+    {"flush-every", required_argument, NULL, 'f'},
+    {"top-k", required_argument, NULL, 'K'},
+    {"seed", required_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0},
+  };
+
+  int option = 0;
+  while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    if (option == 'n' && atoll(optarg) > 0) {
+      events_count = atoll(optarg);
+    } else if (option == 'm' && sscanf(optarg, "%u:%u:%u", &mix[0], &mix[1], &mix[2]) == 3 &&
+               mix[0] + mix[1] + mix[2] > 0) {
+    } else if (option == 'p' && atoll(optarg) > 0) {
+      paths = atoll(optarg);
+    } else if (option == 'l' && atoll(optarg) > 0) {
+      live_max = atoll(optarg);
+    } else if (option == 'P' && atoi(optarg) > 1) {
+      pid_max = atoi(optarg);
+    } else if (option == 's' && (strcmp(optarg, "null") == 0 || strcmp(optarg, "memory") == 0)) {
+      null_sink = strcmp(optarg, "null") == 0;
+    } else if (option == 'f' && atoll(optarg) > 0) {
+      flush_every = atoll(optarg);
+    } else if (option == 'K' && atoll(optarg) > 0) {
+      top_k = atoll(optarg);
+    } else if (option == 'S') {
+      bench_random_state ^= strtoull(optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL;
+    } else {
+      bench_usage(argv[0]);
+    }
+  }
+
+  if (live_max >= (size_t) pid_max) {
+    live_max = pid_max - 1;
+  }
+
+  // the stream models real processes: forks make new ones, execs and exits pick a live one
+  bench_event_t* events = calloc(events_count, sizeof(*events));
+  pid_t* live = calloc(live_max, sizeof(*live));
+  bool* pid_used = calloc(pid_max, sizeof(*pid_used));
+  size_t live_len = 0;
+  pid_t next_pid = 2;
+  size_t kinds[EVENT_KINDS_COUNT] = {};
+
+  // pid 1 forks whatever has no parent left
+  pid_used[1] = true;
+
+  for (size_t i = 0; i < events_count; i++) {
+    bench_event_t* bench_event = &events[i];
+    struct proc_event built = {};
+    struct proc_event* event = &built;
+    event->timestamp_ns = 1000000000ULL + i * 1000;
+
+    uint64_t pick = bench_random() % (mix[0] + mix[1] + mix[2]);
+    int kind = pick < mix[0] ? EVENT_EXEC : pick < mix[0] + mix[1] ? EVENT_EXIT : EVENT_FORK;
+    if (live_len == 0 || (kind == EVENT_FORK && live_len == live_max)) {
+      kind = live_len == 0 ? EVENT_FORK : EVENT_EXIT;
+    }
+
+    if (kind == EVENT_FORK) {
+      while (pid_used[next_pid]) {
+        next_pid = next_pid + 1 < pid_max ? next_pid + 1 : 2;
+      }
+
+      pid_t parent = live_len > 0 && bench_random() % 2 ? live[bench_random() % live_len] : 1;
+      event->what = PROC_EVENT_FORK;
+      event->event_data.fork.parent_pid = parent;
+      event->event_data.fork.parent_tgid = parent;
+      event->event_data.fork.child_pid = next_pid;
+      event->event_data.fork.child_tgid = next_pid;
+
+      pid_used[next_pid] = true;
+      live[live_len++] = next_pid;
+    } else {
+      size_t index = bench_random() % live_len;
+      pid_t pid = live[index];
+
+      if (kind == EVENT_EXEC) {
+        event->what = PROC_EVENT_EXEC;
+        event->event_data.exec.process_pid = pid;
+        event->event_data.exec.process_tgid = pid;
+        bench_event->path = bench_random() % paths;
+      } else {
+        event->what = PROC_EVENT_EXIT;
+        event->event_data.exit.process_pid = pid;
+        event->event_data.exit.process_tgid = pid;
+
+        pid_used[pid] = false;
+        live[index] = live[--live_len];
+      }
+    }
+
+    memcpy(bench_event->message + sizeof(struct cn_msg), event, sizeof(*event));
+    kinds[kind]++;
+  }
+
+  free(live);
+  free(pid_used);
+
+  resolver = (resolver_t) {
+    .executable_path = bench_executable_path,
+    .uid = bench_uid,
+    .cgroup = bench_cgroup,
+  };
+  if (!null_sink) {
+    open_db(":memory:");
+  }
+
+  long rss_before_kb = peak_rss_kb();
+  uint64_t allocations_before = allocations;
+  uint64_t start_ns = monotonic_now_ns();
+
+  for (size_t i = 0; i < events_count; i++) {
+    bench_path = events[i].path;
+    handle_message((struct cn_msg*) events[i].message);
+
+    if ((i + 1) % flush_every == 0) {
+      flush_usage();
+    }
+  }
+  flush_usage();
+
+  uint64_t elapsed_ns = monotonic_now_ns() - start_ns;
+  uint64_t allocations_during = allocations - allocations_before;
+  long rss_after_kb = peak_rss_kb();
+
+  printf("events\t%zu\t(%zu exec, %zu exit, %zu fork)\n",
+         events_count, kinds[EVENT_EXEC], kinds[EVENT_EXIT], kinds[EVENT_FORK]);
+  printf("sink\t%s\n", null_sink ? "null" : "memory");
+  printf("seconds\t%.3f\n", elapsed_ns / 1e9);
+  printf("events_per_second\t%.0f\n", events_count / (elapsed_ns / 1e9));
+  printf("ns_per_event\t%.1f\n", (double) elapsed_ns / events_count);
+  printf("allocations_per_event\t%.3f\n", (double) allocations_during / events_count);
+  printf("peak_rss_kb\t%ld\t(+%ld while replaying)\n", rss_after_kb, rss_after_kb - rss_before_kb);
+  printf("tracked_processes\t%zu\n", hmlenu(tgids));
+  printf("executables\t%zu\n", arrlenu(executable_paths) - arrlenu(free_executable_ids));
+  printf("aggregates\t%zu\n", hmlenu(aggregates));
+
+  free(events);
+  return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef SPYCY_BENCH_H
+#define SPYCY_BENCH_H
+
+// what the benchmarks share: each one is spycy.c itself without its main, plus a generator for the
+// workloads they make up. xorshift64*, so the same seed replays the same workload on any machine
+#define SPYCY_NO_MAIN
+#include "spycy.c"
+
+static uint64_t bench_random_state = 0x9e3779b97f4a7c15ULL;
+
+static inline uint64_t bench_random(void) {
+  bench_random_state ^= bench_random_state >> 12;
+  bench_random_state ^= bench_random_state << 25;
+  bench_random_state ^= bench_random_state >> 27;
+  return bench_random_state * 0x2545f4914f6cdd1dULL;
+}
+
+#endif // SPYCY_BENCH_H
@@ -0,0 +1,86 @@
+#ifndef SPYCY_HASH_H
+#define SPYCY_HASH_H
+
+// the hash stb_ds uses for executable paths and other string keys. stb_ds's own one takes a byte at a
+// time, this is wyhash (https://github.com/wangyi-fudan/wyhash, public domain) which takes 16 or 48,
+// worth it for paths that are easily 50 to 100 bytes long. build with -DSPYCY_STB_PATH_HASH to go back
+// to stb_ds's
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static inline uint64_t spycy_hash_mix(uint64_t a, uint64_t b) {
+  __uint128_t product = (__uint128_t) a * b;
+  return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static inline uint64_t spycy_hash_read64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t spycy_hash_read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t spycy_hash_bytes(const void* key, size_t len, uint64_t seed) {
+  static const uint64_t secret[4] = {
+    0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL,
+  };
+
+  const uint8_t* p = key;
+  uint64_t a = 0;
+  uint64_t b = 0;
+  seed ^= spycy_hash_mix(seed ^ secret[0], secret[1]);
+
+  if (len <= 16) {
+    if (len >= 4) {
+      // two overlapping reads cover anything from 4 to 16 bytes
+      a = (spycy_hash_read32(p) << 32) | spycy_hash_read32(p + ((len >> 3) << 2));
+      b = (spycy_hash_read32(p + len - 4) << 32) | spycy_hash_read32(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+    }
+  } else {
+    size_t left = len;
+    if (left > 48) {
+      uint64_t seed1 = seed;
+      uint64_t seed2 = seed;
+      do {
+        seed = spycy_hash_mix(spycy_hash_read64(p) ^ secret[1], spycy_hash_read64(p + 8) ^ seed);
+        seed1 = spycy_hash_mix(spycy_hash_read64(p + 16) ^ secret[2], spycy_hash_read64(p + 24) ^ seed1);
+        seed2 = spycy_hash_mix(spycy_hash_read64(p + 32) ^ secret[3], spycy_hash_read64(p + 40) ^ seed2);
+        p += 48;
+        left -= 48;
+      } while (left > 48);
+      seed ^= seed1 ^ seed2;
+    }
+
+    while (left > 16) {
+      seed = spycy_hash_mix(spycy_hash_read64(p) ^ secret[1], spycy_hash_read64(p + 8) ^ seed);
+      p += 16;
+      left -= 16;
+    }
+
+    // the last 16 bytes, overlapping what came before if there are fewer left
+    a = spycy_hash_read64(p + left - 16);
+    b = spycy_hash_read64(p + left - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  __uint128_t product = (__uint128_t) a * b;
+  a = (uint64_t) product;
+  b = (uint64_t) (product >> 64);
+  return spycy_hash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+static inline size_t spycy_hash_string(char* str, size_t seed) {
+  return spycy_hash_bytes(str, strlen(str), seed);
+}
+
+#endif // SPYCY_HASH_H
@@ -0,0 +1,138 @@
+// times the hash maps spycy leans on: interning executable paths (sh_new_arena, shput, shgeti) and the
+// per-pid process table (hmput, hmgeti, hmdel), plus both string hashes on their own. the paths mix
+// short system binaries with the long ones nix, language toolchains and build directories produce:
+//
+//   $ make spycy_hash_bench spycy_hash_bench_stb
+//   $ ./spycy_hash_bench && ./spycy_hash_bench_stb
+//
+// the two binaries only differ in the hash their maps use, see source/spycy_hash.h
+#include "spycy_bench.h"
+
+#ifdef SPYCY_STB_PATH_HASH
+#include "spycy_hash.h"
+#define PATH_HASH_NAME "stb_ds"
+#else
+#define PATH_HASH_NAME "wyhash"
+#endif
+
+char* random_path(uint64_t n) {
+  static char path[PATH_MAX];
+  static char* names[] = {"bash", "git", "python3.12", "node", "cc1", "ld.lld", "rustc", "sh", "make", "clang-18"};
+  char* name = names[bench_random() % (sizeof(names) / sizeof(names[0]))];
+
+  // roughly half system binaries, the rest in long store and build paths
+  switch (bench_random() % 10) {
+  case 0: case 1: case 2: case 3: case 4:
+    snprintf(path, PATH_MAX, "/usr/bin/%s-%" PRIu64, name, n);
+    break;
+  case 5: case 6:
+    snprintf(path, PATH_MAX, "/nix/store/%016" PRIx64 "%016" PRIx64 "-%s-%" PRIu64 "/bin/%s",
+             bench_random(), bench_random(), name, n, name);
+    break;
+  case 7: case 8:
+    snprintf(path, PATH_MAX, "/home/builder/src/project-%" PRIu64 "/target/release/build/%s-%016" PRIx64 "/out/%s",
+             n % 97, name, bench_random(), name);
+    break;
+  default:
+    snprintf(path, PATH_MAX, "/opt/toolchains/llvm-%" PRIu64 "/lib/llvm/libexec/%s/%s/%s",
+             n, name, name, name);
+  }
+
+  return strdup(path);
+}
+
+typedef struct {
+  char* key;
+  uint32_t value;
+} path_item_t;
+
+uint64_t sink = 0;
+
+double per_op_ns(uint64_t start_ns, size_t operations) {
+  return (double) (monotonic_now_ns() - start_ns) / operations;
+}
+
+int main(int argc, char** argv) {
+  size_t paths_count = argc > 1 && atoll(argv[1]) > 0 ? (size_t) atoll(argv[1]) : 100000;
+  size_t lookups_count = 4 * paths_count;
+  int rounds = 20;
+
+  char** paths = NULL;
+  char** misses = NULL;
+  size_t bytes = 0;
+  for (size_t i = 0; i < paths_count; i++) {
+    arrput(paths, random_path(i));
+    arrput(misses, random_path(paths_count + i));
+    bytes += strlen(paths[i]);
+  }
+
+  // lookups come with their own copies, like the paths readlink hands us
+  char** lookups = NULL;
+  for (size_t i = 0; i < lookups_count; i++) {
+    arrput(lookups, strdup(paths[bench_random() % paths_count]));
+  }
+
+  printf("map_hash\t%s\n", PATH_HASH_NAME);
+  printf("paths\t%zu\t(mean length %.1f)\n", paths_count, (double) bytes / paths_count);
+
+  uint64_t start_ns = monotonic_now_ns();
+  for (int round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < paths_count; i++) {
+      sink += stbds_hash_string(paths[i], round);
+    }
+  }
+  double stb_ns = per_op_ns(start_ns, rounds * paths_count);
+
+  start_ns = monotonic_now_ns();
+  for (int round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < paths_count; i++) {
+      sink += spycy_hash_string(paths[i], round);
+    }
+  }
+  double wyhash_ns = per_op_ns(start_ns, rounds * paths_count);
+
+  printf("hash_stb_ds_ns\t%.1f\t(%.2f GB/s)\n", stb_ns, bytes / (stb_ns * paths_count));
+  printf("hash_wyhash_ns\t%.1f\t(%.2f GB/s, %.2fx)\n", wyhash_ns, bytes / (wyhash_ns * paths_count), stb_ns / wyhash_ns);
+
+  path_item_t* interned = NULL;
+  sh_new_arena(interned);
+  start_ns = monotonic_now_ns();
+  for (size_t i = 0; i < paths_count; i++) {
+    shput(interned, paths[i], i);
+  }
+  printf("shput_ns\t%.1f\n", per_op_ns(start_ns, paths_count));
+
+  start_ns = monotonic_now_ns();
+  for (size_t i = 0; i < lookups_count; i++) {
+    sink += shgeti(interned, lookups[i]);
+  }
+  printf("shgeti_hit_ns\t%.1f\n", per_op_ns(start_ns, lookups_count));
+
+  start_ns = monotonic_now_ns();
+  for (size_t i = 0; i < paths_count; i++) {
+    sink += shgeti(interned, misses[i]);
+  }
+  printf("shgeti_miss_ns\t%.1f\n", per_op_ns(start_ns, paths_count));
+  shfree(interned);
+
+  // the process table: pids come and go, a few thousand alive at once
+  item_t* processes = NULL;
+  size_t churn = 4 * paths_count;
+  pid_t* alive = calloc(4096, sizeof(*alive));
+  start_ns = monotonic_now_ns();
+  for (size_t i = 0; i < churn; i++) {
+    size_t slot = bench_random() % 4096;
+    if (alive[slot] != 0) {
+      sink += hmgeti(processes, alive[slot]);
+      hmdel(processes, alive[slot]);
+    }
+    alive[slot] = 300 + (bench_random() % 4000000);
+    hmput(processes, alive[slot], (process_info_t) {});
+  }
+  printf("pid_put_get_del_ns\t%.1f\n", per_op_ns(start_ns, churn));
+  hmfree(processes);
+  free(alive);
+
+  // keeps the compiler from dropping the loops above
+  return sink == 42;
+}
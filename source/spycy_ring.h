@@ -0,0 +1,200 @@
+#ifndef SPYCY_RING_H
+#define SPYCY_RING_H
+
+// layout of the shared memory file spycy publishes resolved exec/exit records into (`--ring=PATH`),
+// plus a reader other programs can include as is. there is one writer (spycy) and any number of
+// readers, nobody takes locks and readers never make a syscall per record.
+//
+//   [header, 4096 bytes][records, capacity * 64 bytes][paths, paths_capacity bytes]
+//
+// record number n lives in slot n % capacity. the writer marks the slot with 2n + 1 while it fills it
+// in and 2n + 2 once it is done, so a reader that sees anything but 2n + 2 before and after copying a
+// record knows it was overwritten and has to skip ahead.
+//
+// paths are a ring of their own. every byte ever written has a position that only grows, byte p lives
+// at p % paths_capacity and a path never wraps around the end. a record carries the position (plus one)
+// of its executable's path, published before the record. the writer raises paths_reserved before it
+// overwrites anything, so a path copied out is intact if paths_reserved, read afterwards, is at most
+// paths_capacity past it. executable ids are reused with --top-k, a path found through the record is
+// always the one the record was written with.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPYCY_RING_MAGIC 0x676e697279637073ULL
+#define SPYCY_RING_VERSION 2
+#define SPYCY_RING_HEADER_SIZE 4096
+
+typedef enum {
+  SPYCY_RING_EXEC = 1,
+  SPYCY_RING_EXIT = 2,
+} spycy_ring_kind_t;
+
+typedef enum {
+  // spycy was sampling, this process stands for `weight` processes
+  SPYCY_RING_SAMPLED = 1,
+} spycy_ring_flags_t;
+
+typedef struct {
+  _Atomic uint64_t sequence;
+  uint32_t kind;
+  int32_t tgid;
+  uint32_t uid;
+  uint32_t executable_id;
+  uint64_t start_time_ns;
+  uint64_t end_time_ns;
+  uint64_t duration_ns;
+  uint32_t flags;
+  uint32_t weight;
+  // position of the executable's path plus one, 0 if it was not published
+  uint64_t path_position;
+} spycy_ring_record_t;
+
+_Static_assert(sizeof(spycy_ring_record_t) == 64, "ring records are one cache line");
+
+typedef struct {
+  _Atomic uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;
+  uint64_t paths_capacity;
+  _Atomic uint64_t head;
+  // end of the last path written or being written
+  _Atomic uint64_t paths_reserved;
+} spycy_ring_header_t;
+
+static inline size_t spycy_ring_size(uint64_t capacity, uint64_t paths_capacity) {
+  return SPYCY_RING_HEADER_SIZE +
+         capacity * sizeof(spycy_ring_record_t) +
+         paths_capacity;
+}
+
+typedef struct {
+  spycy_ring_header_t* header;
+  spycy_ring_record_t* records;
+  char* paths;
+  size_t size;
+  uint64_t next;
+} spycy_ring_t;
+
+static inline void spycy_ring_map(spycy_ring_t* ring, void* memory, size_t size) {
+  ring->header = memory;
+  ring->records = (spycy_ring_record_t*) ((char*) memory + SPYCY_RING_HEADER_SIZE);
+  ring->paths = (char*) (ring->records + ring->header->capacity);
+  ring->size = size;
+}
+
+// maps the ring read-only and starts at the newest record, returns -1 with errno set on failure
+static inline int spycy_ring_open(spycy_ring_t* ring, const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat info = {};
+  if (fstat(fd, &info) == -1 || (size_t) info.st_size < SPYCY_RING_HEADER_SIZE) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  void* memory = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (memory == MAP_FAILED) {
+    return -1;
+  }
+
+  spycy_ring_header_t* header = memory;
+  if (atomic_load_explicit(&header->magic, memory_order_acquire) != SPYCY_RING_MAGIC ||
+      header->version != SPYCY_RING_VERSION ||
+      header->record_size != sizeof(spycy_ring_record_t) ||
+      header->paths_capacity == 0 ||
+      spycy_ring_size(header->capacity, header->paths_capacity) > (size_t) info.st_size) {
+    munmap(memory, info.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  spycy_ring_map(ring, memory, info.st_size);
+  ring->next = atomic_load_explicit(&header->head, memory_order_acquire);
+  return 0;
+}
+
+static inline void spycy_ring_close(spycy_ring_t* ring) {
+  munmap(ring->header, ring->size);
+  ring->header = NULL;
+}
+
+// copies the next record into `record` and returns true, or returns false if there is nothing new yet.
+// records the writer lapped before they could be read are skipped and added to `*missed`
+static inline bool spycy_ring_next(spycy_ring_t* ring, spycy_ring_record_t* record, uint64_t* missed) {
+  for (;;) {
+    uint64_t head = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+    if (ring->next >= head) {
+      return false;
+    }
+
+    if (head - ring->next > ring->header->capacity) {
+      *missed += head - ring->header->capacity - ring->next;
+      ring->next = head - ring->header->capacity;
+    }
+
+    spycy_ring_record_t* slot = &ring->records[ring->next & (ring->header->capacity - 1)];
+    uint64_t expected = 2 * ring->next + 2;
+
+    uint64_t before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    memcpy((char*) record + sizeof(record->sequence), (char*) slot + sizeof(slot->sequence),
+           sizeof(*record) - sizeof(record->sequence));
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t after = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+
+    if (before == expected && after == expected) {
+      atomic_store_explicit(&record->sequence, ring->next, memory_order_relaxed);
+      ring->next++;
+      return true;
+    }
+
+    // overwritten while we were looking at it, the loop above moves us past the writer
+    *missed += 1;
+    ring->next++;
+  }
+}
+
+// copies the executable path of `record` into `path` and returns true, or returns false if spycy had no
+// room for it or it has been overwritten by newer paths since
+static inline bool spycy_ring_executable(spycy_ring_t* ring, const spycy_ring_record_t* record,
+                                         char* path, size_t path_size) {
+  if (record->path_position == 0 || path_size == 0) {
+    return false;
+  }
+
+  uint64_t position = record->path_position - 1;
+  uint64_t paths_capacity = ring->header->paths_capacity;
+  size_t offset = position % paths_capacity;
+  size_t max_len = paths_capacity - offset < path_size ? paths_capacity - offset : path_size;
+
+  size_t len = 0;
+  while (len < max_len) {
+    path[len] = ((volatile char*) ring->paths)[offset + len];
+    if (path[len] == 0) {
+      break;
+    }
+    len++;
+  }
+
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t reserved = atomic_load_explicit(&ring->header->paths_reserved, memory_order_relaxed);
+  return len < max_len && reserved - position <= paths_capacity;
+}
+
+#endif // SPYCY_RING_H
@@ -0,0 +1,424 @@
+// replays exits through spycy's persistence layer (account_usage, flush_usage, save_to_db) once per
+// storage strategy, against a database in a temporary directory:
+//
+//   $ ./spycy tail /run/spycy.ring > exits.tsv     # or no file for a synthetic stream
+//   $ ./spycy_storage_bench exits.tsv
+//
+// every strategy runs in a fresh process, so none of them inherits another's aggregates or caches.
+// writes and syncs are counted by a vfs that wraps the default one
+#include "spycy_bench.h"
+
+typedef struct {
+  char* name;
+  // run after the schema is in place
+  char* pragmas;
+  // flush after every exit, like --flush-interval=0, instead of after every --batch exits
+  bool per_exit;
+} strategy_t;
+
+strategy_t strategies[] = {
+  {"per-exit", "", true},
+  {"per-exit-normal", "pragma synchronous = normal;", true},
+  {"batch", "", false},
+  {"batch-normal", "pragma synchronous = normal;", false},
+  {"batch-rollback", "pragma journal_mode = delete;", false},
+};
+
+#define STRATEGIES_COUNT (sizeof(strategies) / sizeof(strategies[0]))
+
+typedef struct {
+  uid_t uid;
+  uint64_t duration_ns;
+  char* executable_path;
+} recorded_exit_t;
+
+recorded_exit_t* exits = NULL;
+
+uint64_t bytes_written = 0;
+uint64_t syncs = 0;
+
+sqlite3_vfs* real_vfs = NULL;
+
+typedef struct {
+  sqlite3_file base;
+  // the real vfs's file lives right after this struct
+  sqlite3_file* real;
+} counting_file_t;
+
+int counting_close(sqlite3_file* file) {
+  return ((counting_file_t*) file)->real->pMethods->xClose(((counting_file_t*) file)->real);
+}
+
+int counting_read(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xRead(real, buffer, amount, offset);
+}
+
+int counting_write(sqlite3_file* file, const void* buffer, int amount, sqlite3_int64 offset) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  bytes_written += amount;
+  return real->pMethods->xWrite(real, buffer, amount, offset);
+}
+
+int counting_truncate(sqlite3_file* file, sqlite3_int64 size) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xTruncate(real, size);
+}
+
+int counting_sync(sqlite3_file* file, int flags) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  syncs++;
+  return real->pMethods->xSync(real, flags);
+}
+
+int counting_file_size(sqlite3_file* file, sqlite3_int64* size) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xFileSize(real, size);
+}
+
+int counting_lock(sqlite3_file* file, int lock) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xLock(real, lock);
+}
+
+int counting_unlock(sqlite3_file* file, int lock) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xUnlock(real, lock);
+}
+
+int counting_check_reserved_lock(sqlite3_file* file, int* reserved) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xCheckReservedLock(real, reserved);
+}
+
+int counting_file_control(sqlite3_file* file, int operation, void* argument) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xFileControl(real, operation, argument);
+}
+
+int counting_sector_size(sqlite3_file* file) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xSectorSize(real);
+}
+
+int counting_device_characteristics(sqlite3_file* file) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xDeviceCharacteristics(real);
+}
+
+// the wal index lives in shared memory, it is not what ends up on disk so it is not counted
+int counting_shm_map(sqlite3_file* file, int page, int page_size, int extend, void volatile** memory) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xShmMap(real, page, page_size, extend, memory);
+}
+
+int counting_shm_lock(sqlite3_file* file, int offset, int n, int flags) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xShmLock(real, offset, n, flags);
+}
+
+void counting_shm_barrier(sqlite3_file* file) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  real->pMethods->xShmBarrier(real);
+}
+
+int counting_shm_unmap(sqlite3_file* file, int delete) {
+  sqlite3_file* real = ((counting_file_t*) file)->real;
+  return real->pMethods->xShmUnmap(real, delete);
+}
+
+sqlite3_io_methods counting_io_methods = {
+  .iVersion = 2,
+  .xClose = counting_close,
+  .xRead = counting_read,
+  .xWrite = counting_write,
+  .xTruncate = counting_truncate,
+  .xSync = counting_sync,
+  .xFileSize = counting_file_size,
+  .xLock = counting_lock,
+  .xUnlock = counting_unlock,
+  .xCheckReservedLock = counting_check_reserved_lock,
+  .xFileControl = counting_file_control,
+  .xSectorSize = counting_sector_size,
+  .xDeviceCharacteristics = counting_device_characteristics,
+  .xShmMap = counting_shm_map,
+  .xShmLock = counting_shm_lock,
+  .xShmBarrier = counting_shm_barrier,
+  .xShmUnmap = counting_shm_unmap,
+};
+
+int counting_open(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* out_flags) {
+  (void) vfs;
+  counting_file_t* counting = (counting_file_t*) file;
+  counting->real = (sqlite3_file*) (counting + 1);
+
+  int rc = real_vfs->xOpen(real_vfs, name, counting->real, flags, out_flags);
+  counting->base.pMethods = counting->real->pMethods != NULL ? &counting_io_methods : NULL;
+  return rc;
+}
+
+int counting_delete(sqlite3_vfs* vfs, const char* name, int sync_directory) {
+  (void) vfs;
+  syncs += sync_directory != 0;
+  return real_vfs->xDelete(real_vfs, name, sync_directory);
+}
+
+int counting_access(sqlite3_vfs* vfs, const char* name, int flags, int* result) {
+  (void) vfs;
+  return real_vfs->xAccess(real_vfs, name, flags, result);
+}
+
+int counting_full_pathname(sqlite3_vfs* vfs, const char* name, int size, char* output) {
+  (void) vfs;
+  return real_vfs->xFullPathname(real_vfs, name, size, output);
+}
+
+int counting_randomness(sqlite3_vfs* vfs, int size, char* output) {
+  (void) vfs;
+  return real_vfs->xRandomness(real_vfs, size, output);
+}
+
+int counting_sleep(sqlite3_vfs* vfs, int microseconds) {
+  (void) vfs;
+  return real_vfs->xSleep(real_vfs, microseconds);
+}
+
+int counting_current_time(sqlite3_vfs* vfs, double* now) {
+  (void) vfs;
+  return real_vfs->xCurrentTime(real_vfs, now);
+}
+
+int counting_get_last_error(sqlite3_vfs* vfs, int size, char* output) {
+  (void) vfs;
+  return real_vfs->xGetLastError(real_vfs, size, output);
+}
+
+sqlite3_vfs counting_vfs = {
+  .iVersion = 1,
+  .zName = "spycy-counting",
+  .xOpen = counting_open,
+  .xDelete = counting_delete,
+  .xAccess = counting_access,
+  .xFullPathname = counting_full_pathname,
+  .xRandomness = counting_randomness,
+  .xSleep = counting_sleep,
+  .xCurrentTime = counting_current_time,
+  .xGetLastError = counting_get_last_error,
+};
+
+void register_counting_vfs() {
+  real_vfs = sqlite3_vfs_find(NULL);
+  counting_vfs.szOsFile = sizeof(counting_file_t) + real_vfs->szOsFile;
+  counting_vfs.mxPathname = real_vfs->mxPathname;
+  sqlite3_vfs_register(&counting_vfs, 1);
+}
+
+// `spycy tail` lines: exec|exit  tgid  user  start  end  duration  executable
+void load_exits(FILE* file) {
+  static char line[PATH_MAX + 256];
+  static char username[256];
+  static char executable_path[PATH_MAX];
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    uint64_t duration_ns = 0;
+    if (strncmp(line, "exit\t", 5) != 0 ||
+        sscanf(line, "exit\t%*d\t%255[^\t]\t%*u\t%*u\t%" SCNu64 "\t%4095[^\n]", username, &duration_ns,
+               executable_path) != 3) {
+      continue;
+    }
+
+    struct passwd* passwd = getpwnam(username);
+    arrput(exits, ((recorded_exit_t) {
+      .uid = passwd != NULL ? passwd->pw_uid : (uid_t) atoi(username),
+      .duration_ns = duration_ns,
+      .executable_path = strdup(executable_path),
+    }));
+  }
+}
+
+void synthesize_exits(size_t count, uint32_t paths) {
+  static char executable_path[PATH_MAX];
+
+  for (size_t i = 0; i < count; i++) {
+    // skewed so that a few executables get most of the exits like on a real host
+    uint64_t random = bench_random();
+    uint32_t path = (random % paths) * (random % paths) / paths;
+    snprintf(executable_path, PATH_MAX, "/usr/bench/%u/executable-%u", path % 16, path);
+    arrput(exits, ((recorded_exit_t) {
+      .uid = 0,
+      .duration_ns = 1000000 + random % 1000000000,
+      .executable_path = strdup(executable_path),
+    }));
+  }
+}
+
+void run_strategy(strategy_t* strategy, char* directory, size_t batch) {
+  static char database_path[PATH_MAX];
+  snprintf(database_path, PATH_MAX, "%s/%s.db", directory, strategy->name);
+
+  // what open_db does, without its log line in the middle of the table
+  if (sqlite3_open(database_path, &db)) {
+    fprintf(stderr, "ERROR: failed to open database at %s: %s\n", database_path, sqlite3_errmsg(db));
+    exit(1);
+  }
+  register_histogram_functions();
+  prepare_db();
+
+  char* error_message = NULL;
+  sqlite3_exec(db, strategy->pragmas, NULL, NULL, &error_message);
+  if (error_message != NULL) {
+    fprintf(stderr, "ERROR: %s: %s\n", strategy->name, error_message);
+    exit(1);
+  }
+
+  uint32_t cgroup_id = intern_cgroup("");
+  uint64_t bytes_before = bytes_written;
+  uint64_t syncs_before = syncs;
+  uint64_t start_ns = monotonic_now_ns();
+
+  for (ptrdiff_t i = 0; i < arrlen(exits); i++) {
+    process_info_t info = {
+      .executable_id = track_executable(exits[i].executable_path),
+      .uid = exits[i].uid,
+      .cgroup_id = cgroup_id,
+    };
+    usage_t usage = {
+      .nanoseconds_spent = exits[i].duration_ns,
+      .inclusive_ns = exits[i].duration_ns,
+      .executions = 1,
+    };
+    account_usage(aggregate_key_of(&info), &usage);
+
+    if (strategy->per_exit || (i + 1) % batch == 0) {
+      flush_usage();
+    }
+  }
+  flush_usage();
+
+  uint64_t elapsed_ns = monotonic_now_ns() - start_ns;
+  latency_t* flushes = &latencies[LATENCY_FLUSH];
+
+  printf("%s\t%.0f\t%.0f\t%.3f\t%.3f\t%" PRIu64 "\t%" PRIu64 "\n",
+          strategy->name,
+          flushes->count / (elapsed_ns / 1e9),
+          arrlen(exits) / (elapsed_ns / 1e9),
+          latency_percentile(LATENCY_FLUSH, 50) / 1e6,
+          latency_percentile(LATENCY_FLUSH, 99) / 1e6,
+          bytes_written - bytes_before,
+          syncs - syncs_before);
+  fflush(stdout);
+
+  sqlite3_close(db);
+  db = NULL;
+
+  static char file_path[PATH_MAX + 8];
+  char* suffixes[] = {"", "-wal", "-shm", "-journal"};
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    snprintf(file_path, sizeof(file_path), "%s%s", database_path, suffixes[i]);
+    unlink(file_path);
+  }
+}
+
+noreturn void bench_usage(char* program) {
+  fprintf(stderr,
+          "USAGE: %s [options] [exits recorded with spycy tail]\n"
+          "OPTIONS:\n"
+          "      --exits=N              exits to synthesize when no recording is given (default 10000)\n"
+          "      --paths=N              distinct executables the synthetic exits pick from (default 1000)\n"
+          "      --batch=N              exits per flush for the batch strategies (default 1000)\n"
+          "      --strategy=NAME        run only this strategy, may be repeated\n"
+          "      --directory=PATH       where the databases go (default a new directory under /tmp)\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  size_t exits_count = 10000;
+  uint32_t paths = 1000;
+  size_t batch = 1000;
+  char* directory = NULL;
+  char** only = NULL;
+
+  struct option options[] = {
+    {"exits", required_argument, NULL, 'n'},
+    {"paths", required_argument, NULL, 'p'},
+    {"batch", required_argument, NULL, 'b'},
+    {"strategy", required_argument, NULL, 's'},
+    {"directory", required_argument, NULL, 'd'},
+    {NULL, 0, NULL, 0},
+  };
+
+  int option = 0;
+  while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    if (option == 'n' && atoll(optarg) > 0) {
+      exits_count = atoll(optarg);
+    } else if (option == 'p' && atoll(optarg) > 0) {
+      paths = atoll(optarg);
+    } else if (option == 'b' && atoll(optarg) > 0) {
+      batch = atoll(optarg);
+    } else if (option == 's') {
+      arrput(only, optarg);
+    } else if (option == 'd') {
+      directory = optarg;
+    } else {
+      bench_usage(argv[0]);
+    }
+  }
+
+  if (optind < argc) {
+    FILE* file = fopen(argv[optind], "r");
+    if (file == NULL) {
+      fprintf(stderr, "ERROR: failed to open %s: %s\n", argv[optind], strerror(errno));
+      return 1;
+    }
+    load_exits(file);
+    fclose(file);
+  } else {
+    synthesize_exits(exits_count, paths);
+  }
+
+  if (arrlen(exits) == 0) {
+    fprintf(stderr, "ERROR: no exits to replay\n");
+    return 1;
+  }
+
+  static char temporary_directory[] = "/tmp/spycy-storage-XXXXXX";
+  bool remove_directory = directory == NULL;
+  if (directory == NULL && (directory = mkdtemp(temporary_directory)) == NULL) {
+    perror("ERROR: mkdtemp");
+    return 1;
+  }
+
+  register_counting_vfs();
+
+  printf("# %td exits in %s\n", arrlen(exits), directory);
+  printf("strategy\tcommits_per_second\texits_per_second\tp50_ms\tp99_ms\tbytes_written\tsyncs\n");
+  fflush(stdout);
+
+  for (size_t i = 0; i < STRATEGIES_COUNT; i++) {
+    bool selected = arrlen(only) == 0;
+    for (ptrdiff_t j = 0; j < arrlen(only); j++) {
+      selected = selected || strcmp(only[j], strategies[i].name) == 0;
+    }
+    if (!selected) {
+      continue;
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+      run_strategy(&strategies[i], directory, batch);
+      _exit(0);
+    }
+    if (child == -1) {
+      perror("ERROR: fork");
+      return 1;
+    }
+    waitpid(child, NULL, 0);
+  }
+
+  if (remove_directory) {
+    rmdir(directory);
+  }
+
+  return 0;
+}
@@ -0,0 +1,364 @@
+// starts processes at a fixed rate next to a running spycy and checks how many of them made it into
+// its database, stepping the rate up until some go missing:
+//
+//   $ ./spycy /tmp/spycy.db &
+//   $ ./spycy_storm --rate=500 --workers=4 --database=/tmp/spycy.db
+//
+// the processes are the storm binary itself exec'd in child mode, so every row with its path and no
+// other is one of ours. with --shard the shards next to the database are counted too. with --top-k the
+// storm's executions can end up folded into its directory with everything else there, storm stops
+// with an error once it sees that
+#define _GNU_SOURCE
+#include <glob.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdnoreturn.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#define CHILD_ARGUMENT "--child"
+
+typedef struct {
+  uint64_t launched;
+  uint64_t failed;
+  // from the first fork to the last, waiting for the children to exit is not part of the rate
+  uint64_t launching_ns;
+} worker_stats_t;
+
+char storm_path[PATH_MAX] = {};
+
+void sleep_ns(uint64_t duration_ns) {
+  struct timespec duration = {
+    .tv_sec = duration_ns / 1000000000,
+    .tv_nsec = duration_ns % 1000000000,
+  };
+  while (nanosleep(&duration, &duration) == -1 && errno == EINTR) {
+  }
+}
+
+uint64_t monotonic_now_ns() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+typedef struct {
+  int64_t executions;
+  // recorded for directories the storm binary is in, which is where --top-k folds it
+  int64_t folded;
+} recorded_t;
+
+// adds what one database file recorded for the storm binary, false if it could not be read
+bool add_recorded(char* path, recorded_t* recorded) {
+  sqlite3* db = NULL;
+  if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: failed to open database at %s: %s\n", path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return false;
+  }
+  sqlite3_busy_timeout(db, 5000);
+
+  sqlite3_stmt* statement = NULL;
+  bool read = false;
+  if (sqlite3_prepare_v2(db,
+                         "select coalesce(sum(executions) filter (where executable_path = ?1), 0), "
+                         "       coalesce(sum(executions) filter (where executable_path != ?1), 0) "
+                         "from spycy_data "
+                         "where executable_path = ?1 or "
+                         "      (executable_path like '%/' and substr(?1, 1, length(executable_path)) = executable_path)",
+                         -1, &statement, NULL) != SQLITE_OK ||
+      sqlite3_bind_text(statement, 1, storm_path, -1, SQLITE_STATIC) != SQLITE_OK) {
+    fprintf(stderr, "ERROR: failed to query %s: %s\n", path, sqlite3_errmsg(db));
+  } else if (sqlite3_step(statement) == SQLITE_ROW) {
+    recorded->executions += sqlite3_column_int64(statement, 0);
+    recorded->folded += sqlite3_column_int64(statement, 1);
+    read = true;
+  }
+
+  sqlite3_finalize(statement);
+  sqlite3_close(db);
+  return read;
+}
+
+// what the database and its shards (named the way spycy --shard names them) recorded for the storm
+// binary, exits if they could not be read
+recorded_t recorded_executions(char* database_path) {
+  static char pattern[PATH_MAX + 8] = {};
+  size_t stem_len = strlen(database_path);
+  if (stem_len > 3 && strcmp(database_path + stem_len - 3, ".db") == 0) {
+    stem_len -= 3;
+  }
+  snprintf(pattern, sizeof(pattern), "%.*s-*.db", (int) stem_len, database_path);
+
+  glob_t shards = {};
+  glob(pattern, 0, NULL, &shards);
+
+  // a sharded setup may never have written the base database itself
+  recorded_t recorded = {};
+  struct stat info = {};
+  bool read = (stat(database_path, &info) == -1 && shards.gl_pathc > 0) || add_recorded(database_path, &recorded);
+  for (size_t i = 0; i < shards.gl_pathc && read; i++) {
+    read = add_recorded(shards.gl_pathv[i], &recorded);
+  }
+
+  globfree(&shards);
+  if (!read) {
+    exit(1);
+  }
+  return recorded;
+}
+
+// one worker per core, each starting its share of the processes on a fixed schedule
+void run_worker(int cpu, uint64_t rate, uint64_t duration_ns, unsigned long_percent, uint64_t long_ns,
+                worker_stats_t* stats) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+
+  static char long_argument[32];
+  snprintf(long_argument, sizeof(long_argument), "%" PRIu64, long_ns);
+
+  uint64_t interval_ns = 1000000000 / rate;
+  uint64_t start_ns = monotonic_now_ns();
+  uint64_t running = 0;
+
+  for (uint64_t n = 0; ; n++) {
+    uint64_t due_ns = start_ns + n * interval_ns;
+    if (due_ns - start_ns >= duration_ns) {
+      break;
+    }
+
+    uint64_t now_ns = monotonic_now_ns();
+    if (due_ns > now_ns) {
+      sleep_ns(due_ns - now_ns);
+    }
+
+    // --long percent of the processes, spread out evenly: with --long=1 it is every 100th
+    bool long_lived = long_percent > 0 && (n * long_percent) % 100 + long_percent > 99;
+    pid_t child = fork();
+    if (child == 0) {
+      char* child_argv[] = {storm_path, CHILD_ARGUMENT, long_lived ? long_argument : "0", NULL};
+      execv(storm_path, child_argv);
+      _exit(127);
+    }
+
+    if (child == -1) {
+      stats->failed++;
+    } else {
+      stats->launched++;
+      running++;
+    }
+
+    while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0) {
+      running--;
+    }
+  }
+  stats->launching_ns = monotonic_now_ns() - start_ns;
+
+  while (running > 0 && waitpid(-1, NULL, 0) > 0) {
+    running--;
+  }
+}
+
+typedef struct {
+  uint64_t launched;
+  uint64_t failed;
+  int64_t recorded;
+  double achieved_rate;
+} step_result_t;
+
+step_result_t run_step(uint64_t rate, int workers, uint64_t duration_ns, unsigned long_percent,
+                       uint64_t long_ns, uint64_t settle_ns, char* database_path) {
+  step_result_t result = {};
+
+  recorded_t before = recorded_executions(database_path);
+
+  worker_stats_t* stats = mmap(NULL, workers * sizeof(worker_stats_t), PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats == MAP_FAILED) {
+    perror("ERROR: mmap");
+    exit(1);
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 0; i < workers; i++) {
+    uint64_t worker_rate = rate / workers + ((uint64_t) i < rate % workers);
+    pid_t worker = fork();
+    if (worker == 0) {
+      if (worker_rate > 0) {
+        run_worker(i % cpus, worker_rate, duration_ns, long_percent, long_ns, &stats[i]);
+      }
+      _exit(0);
+    }
+    if (worker == -1) {
+      perror("ERROR: fork");
+      exit(1);
+    }
+  }
+
+  while (wait(NULL) > 0) {
+  }
+
+  uint64_t launching_ns = 1;
+  for (int i = 0; i < workers; i++) {
+    result.launched += stats[i].launched;
+    result.failed += stats[i].failed;
+    launching_ns = stats[i].launching_ns > launching_ns ? stats[i].launching_ns : launching_ns;
+  }
+  munmap(stats, workers * sizeof(worker_stats_t));
+
+  // spycy writes on its own schedule, give it a few flushes to catch up
+  sleep_ns(settle_ns);
+
+  recorded_t after = recorded_executions(database_path);
+  if (after.folded > before.folded) {
+    fprintf(stderr,
+            "ERROR: spycy folded executions into a directory of %s, its own cannot be told apart. "
+            "run spycy without --top-k to measure\n",
+            storm_path);
+    exit(1);
+  }
+
+  result.recorded = after.executions - before.executions;
+  result.achieved_rate = result.launched / (launching_ns / 1e9);
+  return result;
+}
+
+noreturn void usage(char* program) {
+  fprintf(stderr,
+          "USAGE: %s --database=PATH [options]\n"
+          "OPTIONS:\n"
+          "      --database=PATH        the database the running spycy writes to, its shards are read too\n"
+          "      --rate=N               processes a second to start with (default 100)\n"
+          "      --step=F               multiply the rate by F after every step without loss (default 2)\n"
+          "      --steps=N              give up after N steps (default 10), 1 runs a single rate\n"
+          "      --workers=N            processes starting processes, one per core (default all cores)\n"
+          "      --duration=S           seconds every step lasts (default 5)\n"
+          "      --long=P               percent of processes that live --long-ms instead of exiting at once (default 0)\n"
+          "      --long-ms=MS           how long the long lived ones run (default 1000)\n"
+          "      --settle=S             seconds to wait for spycy to flush after a step (default 3)\n"
+          "      --max-loss=P           percent of processes that may go missing before a rate counts as lossy (default 0)\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  // child mode has to stay as cheap as possible, nothing else happens before it
+  if (argc == 3 && strcmp(argv[1], CHILD_ARGUMENT) == 0) {
+    uint64_t lifetime_ns = strtoull(argv[2], NULL, 10);
+    if (lifetime_ns > 0) {
+      sleep_ns(lifetime_ns);
+    }
+    return 0;
+  }
+
+  char* database_path = NULL;
+  uint64_t rate = 100;
+  double step = 2;
+  int steps = 10;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t duration_ns = 5000000000ULL;
+  unsigned long_percent = 0;
+  uint64_t long_ns = 1000000000ULL;
+  uint64_t settle_ns = 3000000000ULL;
+  double max_loss = 0;
+
+  struct option options[] = {
+    {"database", required_argument, NULL, 'd'},
+    {"rate", required_argument, NULL, 'r'},
+    {"step", required_argument, NULL, 's'},
+    {"steps", required_argument, NULL, 'n'},
+    {"workers", required_argument, NULL, 'w'},
+    {"duration", required_argument, NULL, 't'},
+    {"long", required_argument, NULL, 'l'},
+    {"long-ms", required_argument, NULL, 'L'},
+    {"settle", required_argument, NULL, 'S'},
+    {"max-loss", required_argument, NULL, 'm'},
+    {NULL, 0, NULL, 0},
+  };
+
+  int option = 0;
+  while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    if (option == 'd') {
+      database_path = optarg;
+    } else if (option == 'r' && atoll(optarg) > 0) {
+      rate = atoll(optarg);
+    } else if (option == 's' && atof(optarg) > 1) {
+      step = atof(optarg);
+    } else if (option == 'n' && atoi(optarg) > 0) {
+      steps = atoi(optarg);
+    } else if (option == 'w' && atoi(optarg) > 0) {
+      workers = atoi(optarg);
+    } else if (option == 't' && atof(optarg) > 0) {
+      duration_ns = atof(optarg) * 1e9;
+    } else if (option == 'l' && atoi(optarg) >= 0 && atoi(optarg) <= 100) {
+      long_percent = atoi(optarg);
+    } else if (option == 'L' && atoll(optarg) > 0) {
+      long_ns = atoll(optarg) * 1000000;
+    } else if (option == 'S' && atof(optarg) >= 0) {
+      settle_ns = atof(optarg) * 1e9;
+    } else if (option == 'm' && atof(optarg) >= 0) {
+      max_loss = atof(optarg);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (database_path == NULL) {
+    usage(argv[0]);
+  }
+
+  // spycy records the resolved path, so that is what we look for
+  if (readlink("/proc/self/exe", storm_path, sizeof(storm_path) - 1) == -1) {
+    perror("ERROR: readlink");
+    return 1;
+  }
+
+  printf("rate\tachieved\tlaunched\trecorded\tloss\n");
+  fflush(stdout);
+
+  uint64_t sustained_rate = 0;
+  for (int i = 0; i < steps; i++) {
+    step_result_t result = run_step(rate, workers, duration_ns, long_percent, long_ns, settle_ns, database_path);
+
+    double loss = result.launched > 0 ? 100.0 * ((int64_t) result.launched - result.recorded) / result.launched : 0;
+    printf("%" PRIu64 "\t%.0f\t%" PRIu64 "\t%" PRId64 "\t%.3f%%\n",
+           rate, result.achieved_rate, result.launched, result.recorded, loss);
+    if (result.failed > 0) {
+      printf("WARNING: %" PRIu64 " forks failed\n", result.failed);
+    }
+    fflush(stdout);
+
+    if (loss > max_loss) {
+      break;
+    }
+
+    // a rate the machine could not even start processes at does not count as sustained by spycy
+    sustained_rate = result.achieved_rate < rate ? (uint64_t) result.achieved_rate : rate;
+    if (result.achieved_rate < 0.9 * rate) {
+      printf("LOG: could not start processes any faster, spycy kept up with all of them\n");
+      break;
+    }
+
+    rate *= step;
+  }
+
+  printf("sustainable_rate\t%" PRIu64 "\n", sustained_rate);
+  return 0;
+}
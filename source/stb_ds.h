@@ -51,6 +51,13 @@ COMPILE-TIME OPTIONS
      define both, or neither. Note that at the moment, 'context' will always be NULL.
      @TODO add an array/hash initialization function that takes a memory context pointer.
 
+  #define STBDS_HASH_STRING(str,seed) better_string_hash(str,seed)
+
+     This define only needs to be set in the file containing #define STB_DS_IMPLEMENTATION.
+
+     By default string keys are hashed with stbds_hash_string(). You can substitute your
+     own function, it gets the NUL-terminated key and the table's seed and returns a size_t.
+
   #define STBDS_UNIT_TESTS
 
      Defines a function stbds_unit_tests() that checks the functioning of the data structures.
@@ -1013,6 +1020,10 @@ static stbds_hash_index *stbds_make_hash_index(size_t slot_count, stbds_hash_ind
 #define STBDS_ROTATE_LEFT(val, n)   (((val) << (n)) | ((val) >> (STBDS_SIZE_T_BITS - (n))))
 #define STBDS_ROTATE_RIGHT(val, n)  (((val) >> (n)) | ((val) << (STBDS_SIZE_T_BITS - (n))))
 
+#ifndef STBDS_HASH_STRING
+#define STBDS_HASH_STRING(str,seed) stbds_hash_string(str,seed)
+#endif
+
 size_t stbds_hash_string(char *str, size_t seed)
 {
   size_t hash = seed;
@@ -1233,7 +1244,7 @@ static ptrdiff_t stbds_hm_find_slot(void *a, size_t elemsize, void *key, size_t
 {
   void *raw_a = STBDS_HASH_TO_ARR(a,elemsize);
   stbds_hash_index *table = stbds_hash_table(raw_a);
-  size_t hash = mode >= STBDS_HM_STRING ? stbds_hash_string((char*)key,table->seed) : stbds_hash_bytes(key, keysize,table->seed);
+  size_t hash = mode >= STBDS_HM_STRING ? STBDS_HASH_STRING((char*)key,table->seed) : stbds_hash_bytes(key, keysize,table->seed);
   size_t step = STBDS_BUCKET_LENGTH;
   size_t limit,i;
   size_t pos;
@@ -1370,7 +1381,7 @@ void *stbds_hmput_key(void *a, size_t elemsize, void *key, size_t keysize, int m
 
   // we iterate hash table explicitly because we want to track if we saw a tombstone
   {
-    size_t hash = mode >= STBDS_HM_STRING ? stbds_hash_string((char*)key,table->seed) : stbds_hash_bytes(key, keysize,table->seed);
+    size_t hash = mode >= STBDS_HM_STRING ? STBDS_HASH_STRING((char*)key,table->seed) : stbds_hash_bytes(key, keysize,table->seed);
     size_t step = STBDS_BUCKET_LENGTH;
     size_t pos;
     ptrdiff_t tombstone = -1;